@@ -13,23 +13,58 @@
 // limitations under the License.
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
 #include <algorithm>
-#include <memory>
+#include <atomic>
+#include <new>
+#include <utility>
+#include <vector>
+#include "reclaimer.h"
+#include "slab_pool.h"
+#include "summary.h"
 
-template <class K, class V>
+template <class K, class V, class Summary = NoSummary>
 class AVL {
  public:
   AVL() {}
 
-  AVL Add(K key, V value) const {
+  // build from entries sorted by key in O(n); the entries are moved from
+  template <class It>
+  static AVL FromSorted(It begin, It end) {
+    return AVL(Build(begin, end));
+  }
+
+  AVL Add(K key, V value) const & {
     return AVL(AddKey(root_, std::move(key), std::move(value)));
   }
-  AVL Remove(const K &key) const { return AVL(RemoveKey(root_, key)); }
+  AVL Remove(const K &key) const & { return AVL(RemoveKey(root_, key)); }
+
+  // Transient updates: on an expiring AVL (avl = std::move(avl).Add(...)),
+  // nodes that no other version references are updated in place rather
+  // than copied, so a batch of updates allocates only for the first path it
+  // touches. The result is an ordinary persistent value again.
+  AVL Add(K key, V value) && {
+    return AVL(AddKey(std::move(root_), std::move(key), std::move(value)));
+  }
+  AVL Remove(const K &key) && {
+    // key may live inside the tree, which is about to be taken apart
+    K k = key;
+    return AVL(RemoveKey(std::move(root_), k));
+  }
   const V *Lookup(const K &key) const {
-    NodePtr n = Get(root_, key);
+    const Node *n = Get(root_.get(), key);
     return n ? &n->value : nullptr;
   }
 
+  // find the entry with the greatest key <= key
+  // returns {nullptr, nullptr} if there is no such entry
+  std::pair<const K *, const V *> LookupFloor(const K &key) const {
+    const Node *n = GetFloor(root_.get(), key, nullptr);
+    if (n == nullptr) return std::make_pair(nullptr, nullptr);
+    return std::make_pair(&n->key, &n->value);
+  }
+
   bool Empty() const { return root_ == nullptr; }
 
   template <class F>
@@ -37,24 +72,181 @@ class AVL {
     ForEachImpl(root_.get(), std::forward<F>(f));
   }
 
+  // visit entries with lo <= key < hi in order
+  template <class F>
+  void ForEachInRange(const K &lo, const K &hi, F &&f) const {
+    ForEachInRangeImpl(root_.get(), lo, hi, std::forward<F>(f));
+  }
+
+  // summary of all entries
+  Summary Total() const { return SummaryOf(root_); }
+
+  // summary of all entries with keys < key
+  Summary SummaryBefore(const K &key) const {
+    Summary s;
+    const Node *n = root_.get();
+    while (n != nullptr) {
+      if (n->key < key) {
+        s = s + SummaryOf(n->left) + Summary(n->key, n->value);
+        n = n->right.get();
+      } else {
+        n = n->left.get();
+      }
+    }
+    return s;
+  }
+
+  // find the first entry for which pred(summary of all entries up to and
+  // including it) holds - pred must be monotonic over the key order
+  // if before is non-null, it receives the summary of all preceding entries
+  template <class F>
+  std::pair<const K *, const V *> Select(F &&pred, Summary *before) const {
+    Summary s;
+    const Node *n = root_.get();
+    while (n != nullptr) {
+      Summary l = s + SummaryOf(n->left);
+      if (pred(l)) {
+        n = n->left.get();
+        continue;
+      }
+      Summary m = l + Summary(n->key, n->value);
+      if (pred(m)) {
+        if (before != nullptr) *before = l;
+        return std::make_pair(&n->key, &n->value);
+      }
+      s = m;
+      n = n->right.get();
+    }
+    return std::make_pair(nullptr, nullptr);
+  }
+
   bool SameIdentity(AVL avl) const { return root_ == avl.root_; }
 
+  // visit in key order the entries of a and b outside the subtrees they
+  // share, as f(key, value, in_b); entries of copied nodes are visited even
+  // if unchanged. O(differences * log n) when one version derives from the
+  // other.
+  template <class F>
+  static void ForEachDifference(const AVL &a, const AVL &b, F &&f) {
+    DiffCursor ca, cb;
+    ca.Push(a.root_.get());
+    cb.Push(b.root_.get());
+    while (!ca.items.empty() && !cb.items.empty()) {
+      const auto x = ca.items.back();
+      const auto y = cb.items.back();
+      if (x == y) {
+        ca.items.pop_back();
+        cb.items.pop_back();
+      } else if (!x.second || !y.second) {
+        // open the taller subtree first so that shared ones line up
+        if (y.second || (!x.second && x.first->height >= y.first->height)) {
+          ca.Expand();
+        } else {
+          cb.Expand();
+        }
+      } else if (x.first->key < y.first->key) {
+        f(const_cast<const K &>(x.first->key),
+          const_cast<const V &>(x.first->value), false);
+        ca.items.pop_back();
+      } else if (y.first->key < x.first->key) {
+        f(const_cast<const K &>(y.first->key),
+          const_cast<const V &>(y.first->value), true);
+        cb.items.pop_back();
+      } else {
+        f(const_cast<const K &>(x.first->key),
+          const_cast<const V &>(x.first->value), false);
+        f(const_cast<const K &>(y.first->key),
+          const_cast<const V &>(y.first->value), true);
+        ca.items.pop_back();
+        cb.items.pop_back();
+      }
+    }
+    ca.Drain(f, false);
+    cb.Drain(f, true);
+  }
+
  private:
   struct Node;
-  typedef std::shared_ptr<Node> NodePtr;
-  struct Node : public std::enable_shared_from_this<Node> {
-    Node(K k, V v, NodePtr l, NodePtr r, long h)
+
+  // intrusive reference to an immutable node
+  class NodePtr {
+   public:
+    NodePtr() : p_(nullptr) {}
+    NodePtr(std::nullptr_t) : p_(nullptr) {}
+    // adopts the reference held by a freshly created node
+    explicit NodePtr(Node *p) : p_(p) {}
+    NodePtr(const NodePtr &other) : p_(other.p_) {
+      if (p_ != nullptr) p_->Ref();
+    }
+    NodePtr(NodePtr &&other) : p_(other.p_) { other.p_ = nullptr; }
+    NodePtr &operator=(NodePtr other) {
+      std::swap(p_, other.p_);
+      return *this;
+    }
+    ~NodePtr() {
+      if (p_ != nullptr) p_->Unref();
+    }
+
+    Node *get() const { return p_; }
+    Node *operator->() const { return p_; }
+    // true if this is the only reference to the node
+    bool unique() const {
+      return p_ != nullptr &&
+             p_->refs.load(std::memory_order_acquire) == 1;
+    }
+    Node *release() {
+      Node *p = p_;
+      p_ = nullptr;
+      return p;
+    }
+    explicit operator bool() const { return p_ != nullptr; }
+    bool operator==(const NodePtr &other) const { return p_ == other.p_; }
+    bool operator!=(const NodePtr &other) const { return p_ != other.p_; }
+
+   private:
+    Node *p_;
+  };
+
+  struct Node {
+    Node(K k, V v, NodePtr l, NodePtr r, long h, Summary s)
         : key(std::move(k)),
           value(std::move(v)),
           left(std::move(l)),
           right(std::move(r)),
-          height(h) {}
-    const K key;
-    const V value;
-    const NodePtr left;
-    const NodePtr right;
-    const long height;
+          height(h),
+          summary(std::move(s)) {}
+    // subtrees this node was the last owner of are left to the reclaimer:
+    // dropping a version frees one node on the dropping thread, not all of
+    // the nodes only it held
+    ~Node() {
+      NodePtr dead[2];
+      size_t n = 0;
+      if (left.unique()) dead[n++] = std::move(left);
+      if (right.unique()) dead[n++] = std::move(right);
+      if (n > 0) Graveyard<NodePtr>::Get()->Bury(dead, n);
+    }
+    // immutable once shared; only modified through a unique NodePtr
+    K key;
+    V value;
+    NodePtr left;
+    NodePtr right;
+    long height;
+    Summary summary;
+    // versions are handed between threads, so counts must be atomic; taking
+    // a reference needs no ordering
+    mutable std::atomic<uint32_t> refs{1};
+
+    void Ref() const { refs.fetch_add(1, std::memory_order_relaxed); }
+    void Unref() const {
+      if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete this;
+    }
+
+    // allocated from Pool by MakeNode
+    static void operator delete(void *p) { Pool::Free(p); }
   };
+  typedef SlabPool<(sizeof(Node) + alignof(max_align_t) - 1) /
+                   alignof(max_align_t) * alignof(max_align_t)>
+      Pool;
   NodePtr root_;
 
   AVL(NodePtr root) : root_(std::move(root)) {}
@@ -67,136 +259,263 @@ class AVL {
     ForEachImpl(n->right.get(), std::forward<F>(f));
   }
 
-  static long Height(const NodePtr &n) { return n ? n->height : 0; }
+  // an in-order walk that can stop short of whole subtrees: items are
+  // subtrees not yet opened (false) or single entries (true), next at back
+  struct DiffCursor {
+    std::vector<std::pair<const Node *, bool>> items;
 
-  static NodePtr MakeNode(K key, V value, const NodePtr &left,
-                          const NodePtr &right) {
-    return std::make_shared<Node>(std::move(key), std::move(value), left, right,
-                                  1 + std::max(Height(left), Height(right)));
-  }
+    void Push(const Node *n) {
+      if (n != nullptr) items.emplace_back(n, false);
+    }
+    void Expand() {
+      const Node *n = items.back().first;
+      items.pop_back();
+      Push(n->right.get());
+      items.emplace_back(n, true);
+      Push(n->left.get());
+    }
+    template <class F>
+    void Drain(F &&f, bool in_b) {
+      for (auto it = items.rbegin(); it != items.rend(); ++it) {
+        auto visit = [&](const K &k, const V &v) { f(k, v, in_b); };
+        if (it->second) {
+          visit(it->first->key, it->first->value);
+        } else {
+          ForEachImpl(it->first, visit);
+        }
+      }
+    }
+  };
 
-  static NodePtr Get(const NodePtr &node, const K &key) {
-    if (node == nullptr) {
-      return nullptr;
+  template <class F>
+  static void ForEachInRangeImpl(const Node *n, const K &lo, const K &hi,
+                                 F &&f) {
+    if (n == nullptr) return;
+    const bool above_lo = lo < n->key;
+    const bool below_hi = n->key < hi;
+    if (above_lo) ForEachInRangeImpl(n->left.get(), lo, hi, f);
+    if (below_hi && !(n->key < lo)) {
+      f(const_cast<const K &>(n->key), const_cast<const V &>(n->value));
     }
+    if (below_hi) ForEachInRangeImpl(n->right.get(), lo, hi, f);
+  }
 
-    if (node->key > key) {
-      return Get(node->left, key);
-    } else if (node->key < key) {
-      return Get(node->right, key);
+  template <class It>
+  static NodePtr Build(It begin, It end) {
+    if (begin == end) return nullptr;
+    It mid = begin + (end - begin) / 2;
+    NodePtr left = Build(begin, mid);
+    NodePtr right = Build(mid + 1, end);
+    return MakeNode(nullptr, std::move(mid->first), std::move(mid->second),
+                    std::move(left), std::move(right));
+  }
+
+  static long Height(const NodePtr &n) { return n ? n->height : 0; }
+
+  static Summary SummaryOf(const NodePtr &n) {
+    return n ? n->summary : Summary();
+  }
+
+  // build a node; shell, if non-null, is a uniquely owned node whose
+  // contents have been taken and whose memory is reused
+  static NodePtr MakeNode(NodePtr shell, K key, V value, NodePtr left,
+                          NodePtr right) {
+    Summary summary = SummaryOf(left) + Summary(key, value) + SummaryOf(right);
+    const long height = 1 + std::max(Height(left), Height(right));
+    Node *reuse = shell.release();
+    void *mem;
+    if (reuse != nullptr) {
+      reuse->~Node();
+      mem = reuse;
     } else {
-      return node;
+      mem = Pool::Allocate();
     }
+    return NodePtr(::new (mem) Node(std::move(key), std::move(value),
+                                    std::move(left), std::move(right), height,
+                                    std::move(summary)));
   }
 
-  static NodePtr RotateLeft(K key, V value, const NodePtr &left,
-                            const NodePtr &right) {
-    return MakeNode(
-        right->key, right->value,
-        MakeNode(std::move(key), std::move(value), left, right->left),
-        right->right);
-  }
+  // a node taken apart for rebuilding: its contents are moved out if the
+  // node is uniquely owned (and shell keeps it for reuse), copied otherwise
+  struct Parts {
+    NodePtr shell;
+    K key;
+    V value;
+    NodePtr left;
+    NodePtr right;
+  };
 
-  static NodePtr RotateRight(K key, V value, const NodePtr &left,
-                             const NodePtr &right) {
-    return MakeNode(
-        left->key, left->value, left->left,
-        MakeNode(std::move(key), std::move(value), left->right, right));
+  static Parts Take(NodePtr node) {
+    if (node.unique()) {
+      Node *n = node.get();
+      return Parts{std::move(node), std::move(n->key), std::move(n->value),
+                   std::move(n->left), std::move(n->right)};
+    }
+    return Parts{nullptr, node->key, node->value, node->left, node->right};
   }
 
-  static NodePtr RotateLeftRight(K key, V value, const NodePtr &left,
-                                 const NodePtr &right) {
-    /* rotate_right(..., rotate_left(left), right) */
-    return MakeNode(
-        left->right->key, left->right->value,
-        MakeNode(left->key, left->value, left->left, left->right->left),
-        MakeNode(std::move(key), std::move(value), left->right->right, right));
+  static const Node *Get(const Node *node, const K &key) {
+    while (node != nullptr) {
+      if (key < node->key) {
+        node = node->left.get();
+      } else if (node->key < key) {
+        node = node->right.get();
+      } else {
+        return node;
+      }
+    }
+    return nullptr;
   }
 
-  static NodePtr RotateRightLeft(K key, V value, const NodePtr &left,
-                                 const NodePtr &right) {
-    /* rotate_left(..., left, rotate_right(right)) */
-    return MakeNode(
-        right->left->key, right->left->value,
-        MakeNode(std::move(key), std::move(value), left, right->left->left),
-        MakeNode(right->key, right->value, right->left->right, right->right));
+  static const Node *GetFloor(const Node *node, const K &key,
+                              const Node *best) {
+    while (node != nullptr) {
+      if (key < node->key) {
+        node = node->left.get();
+      } else if (node->key < key) {
+        best = node;
+        node = node->right.get();
+      } else {
+        return node;
+      }
+    }
+    return best;
   }
 
-  static NodePtr Rebalance(K key, V value, const NodePtr &left,
-                           const NodePtr &right) {
+  static NodePtr Rebalance(NodePtr shell, K key, V value, NodePtr left,
+                           NodePtr right) {
     switch (Height(left) - Height(right)) {
-      case 2:
-        if (Height(left->left) - Height(left->right) == -1) {
-          return RotateLeftRight(std::move(key), std::move(value), left, right);
-        } else {
-          return RotateRight(std::move(key), std::move(value), left, right);
+      case 2: {
+        Parts l = Take(std::move(left));
+        if (Height(l.left) - Height(l.right) == -1) {
+          /* rotate_right(..., rotate_left(left), right) */
+          Parts lr = Take(std::move(l.right));
+          return MakeNode(
+              std::move(lr.shell), std::move(lr.key), std::move(lr.value),
+              MakeNode(std::move(l.shell), std::move(l.key),
+                       std::move(l.value), std::move(l.left),
+                       std::move(lr.left)),
+              MakeNode(std::move(shell), std::move(key), std::move(value),
+                       std::move(lr.right), std::move(right)));
         }
-      case -2:
-        if (Height(right->left) - Height(right->right) == 1) {
-          return RotateRightLeft(std::move(key), std::move(value), left, right);
-        } else {
-          return RotateLeft(std::move(key), std::move(value), left, right);
+        /* rotate_right */
+        return MakeNode(std::move(l.shell), std::move(l.key),
+                        std::move(l.value), std::move(l.left),
+                        MakeNode(std::move(shell), std::move(key),
+                                 std::move(value), std::move(l.right),
+                                 std::move(right)));
+      }
+      case -2: {
+        Parts r = Take(std::move(right));
+        if (Height(r.left) - Height(r.right) == 1) {
+          /* rotate_left(..., left, rotate_right(right)) */
+          Parts rl = Take(std::move(r.left));
+          return MakeNode(
+              std::move(rl.shell), std::move(rl.key), std::move(rl.value),
+              MakeNode(std::move(shell), std::move(key), std::move(value),
+                       std::move(left), std::move(rl.left)),
+              MakeNode(std::move(r.shell), std::move(r.key),
+                       std::move(r.value), std::move(rl.right),
+                       std::move(r.right)));
         }
+        /* rotate_left */
+        return MakeNode(std::move(r.shell), std::move(r.key),
+                        std::move(r.value),
+                        MakeNode(std::move(shell), std::move(key),
+                                 std::move(value), std::move(left),
+                                 std::move(r.left)),
+                        std::move(r.right));
+      }
       default:
-        return MakeNode(key, value, left, right);
+        return MakeNode(std::move(shell), std::move(key), std::move(value),
+                        std::move(left), std::move(right));
     }
   }
 
-  static NodePtr AddKey(const NodePtr &node, K key, V value) {
+  static NodePtr AddKey(NodePtr node, K key, V value) {
     if (!node) {
-      return MakeNode(std::move(key), std::move(value), nullptr, nullptr);
+      return MakeNode(nullptr, std::move(key), std::move(value), nullptr,
+                      nullptr);
     }
     if (node->key < key) {
-      return Rebalance(node->key, node->value, node->left,
-                       AddKey(node->right, std::move(key), std::move(value)));
+      Parts p = Take(std::move(node));
+      NodePtr right =
+          AddKey(std::move(p.right), std::move(key), std::move(value));
+      return Rebalance(std::move(p.shell), std::move(p.key),
+                       std::move(p.value), std::move(p.left),
+                       std::move(right));
     }
     if (key < node->key) {
-      return Rebalance(node->key, node->value,
-                       AddKey(node->left, std::move(key), std::move(value)),
-                       node->right);
+      Parts p = Take(std::move(node));
+      NodePtr left =
+          AddKey(std::move(p.left), std::move(key), std::move(value));
+      return Rebalance(std::move(p.shell), std::move(p.key),
+                       std::move(p.value), std::move(left),
+                       std::move(p.right));
     }
-    return MakeNode(std::move(key), std::move(value), node->left, node->right);
+    if (!node.unique()) {
+      return MakeNode(nullptr, std::move(key), std::move(value), node->left,
+                      node->right);
+    }
+    Parts p = Take(std::move(node));
+    return MakeNode(std::move(p.shell), std::move(key), std::move(value),
+                    std::move(p.left), std::move(p.right));
   }
 
-  static NodePtr InOrderHead(NodePtr node) {
+  static const Node *InOrderHead(const Node *node) {
     while (node->left != nullptr) {
-      node = node->left;
+      node = node->left.get();
     }
     return node;
   }
 
-  static NodePtr InOrderTail(NodePtr node) {
+  static const Node *InOrderTail(const Node *node) {
     while (node->right != nullptr) {
-      node = node->right;
+      node = node->right.get();
     }
     return node;
   }
 
-  static NodePtr RemoveKey(const NodePtr &node, const K &key) {
+  static NodePtr RemoveKey(NodePtr node, const K &key) {
     if (node == nullptr) {
       return nullptr;
     }
     if (key < node->key) {
-      return Rebalance(node->key, node->value, RemoveKey(node->left, key),
-                       node->right);
+      Parts p = Take(std::move(node));
+      NodePtr left = RemoveKey(std::move(p.left), key);
+      return Rebalance(std::move(p.shell), std::move(p.key),
+                       std::move(p.value), std::move(left),
+                       std::move(p.right));
     } else if (node->key < key) {
-      return Rebalance(node->key, node->value, node->left,
-                       RemoveKey(node->right, key));
+      Parts p = Take(std::move(node));
+      NodePtr right = RemoveKey(std::move(p.right), key);
+      return Rebalance(std::move(p.shell), std::move(p.key),
+                       std::move(p.value), std::move(p.left),
+                       std::move(right));
     } else {
       if (node->left == nullptr) {
         return node->right;
       } else if (node->right == nullptr) {
         return node->left;
-      } else if (node->left->height < node->right->height) {
-        NodePtr h = InOrderHead(node->right);
-        return Rebalance(h->key, h->value, node->left,
-                         RemoveKey(node->right, h->key));
+      }
+      Parts p = Take(std::move(node));
+      if (p.left->height < p.right->height) {
+        const Node *h = InOrderHead(p.right.get());
+        K hkey = h->key;
+        V hvalue = h->value;
+        NodePtr right = RemoveKey(std::move(p.right), hkey);
+        return Rebalance(std::move(p.shell), std::move(hkey),
+                         std::move(hvalue), std::move(p.left),
+                         std::move(right));
       } else {
-        NodePtr h = InOrderTail(node->left);
-        return Rebalance(h->key, h->value, RemoveKey(node->left, h->key),
-                         node->right);
+        const Node *h = InOrderTail(p.left.get());
+        K hkey = h->key;
+        V hvalue = h->value;
+        NodePtr left = RemoveKey(std::move(p.left), hkey);
+        return Rebalance(std::move(p.shell), std::move(hkey),
+                         std::move(hvalue), std::move(left),
+                         std::move(p.right));
       }
     }
-    abort();
   }
 };
@@ -13,6 +13,8 @@
 // limitations under the License.
 #include "avl.h"
 #include <gtest/gtest.h>
+#include <atomic>
+#include <thread>
 
 TEST(AvlTest, NoOp) { AVL<int, int> avl; }
 
@@ -21,3 +23,116 @@ TEST(AvlTest, Lookup) {
   EXPECT_EQ(nullptr, avl.Lookup(2));
   EXPECT_EQ(42, *avl.Lookup(1));
 }
+
+namespace {
+struct Count {
+  Count() {}
+  Count(int, int v) : n(1), sum(v) {}
+  Count operator+(const Count& o) const {
+    Count c;
+    c.n = n + o.n;
+    c.sum = sum + o.sum;
+    return c;
+  }
+  int n = 0;
+  int sum = 0;
+};
+}  // namespace
+
+TEST(AvlTest, Summary) {
+  AVL<int, int, Count> avl;
+  for (int i = 0; i < 100; i++) avl = avl.Add(i, 2 * i);
+  avl = avl.Remove(50);
+  EXPECT_EQ(99, avl.Total().n);
+  EXPECT_EQ(10, avl.SummaryBefore(10).n);
+  EXPECT_EQ(90, avl.SummaryBefore(10).sum);
+  EXPECT_EQ(50, avl.SummaryBefore(51).n);
+  Count before;
+  auto f = avl.Select([](const Count& c) { return c.n > 50; }, &before);
+  EXPECT_EQ(51, *f.first);
+  EXPECT_EQ(102, *f.second);
+  EXPECT_EQ(50, before.n);
+  int visited = 0;
+  avl.ForEachInRange(45, 55, [&](int k, int v) { visited++; });
+  EXPECT_EQ(9, visited);
+}
+
+TEST(AvlTest, TransientLeavesSnapshotsAlone) {
+  AVL<int, int> avl;
+  for (int i = 0; i < 100; i++) avl = std::move(avl).Add(i, i);
+  auto snapshot = avl;
+  for (int i = 0; i < 100; i += 2) avl = std::move(avl).Remove(i);
+  for (int i = 100; i < 200; i++) avl = std::move(avl).Add(i, -i);
+  int n = 0;
+  snapshot.ForEach([&n](int k, int v) {
+    EXPECT_EQ(n, k);
+    EXPECT_EQ(k, v);
+    n++;
+  });
+  EXPECT_EQ(100, n);
+  EXPECT_EQ(nullptr, avl.Lookup(2));
+  EXPECT_EQ(-150, *avl.Lookup(150));
+}
+
+namespace {
+// counts destructions of live values, and those on the thread that created
+// the value
+std::atomic<int> destroyed{0};
+struct Tracked {
+  explicit Tracked(int* here) : here(here), owner(std::this_thread::get_id()) {}
+  Tracked(const Tracked&) = default;
+  Tracked(Tracked&& other) : here(other.here), owner(other.owner) {
+    other.here = nullptr;
+  }
+  ~Tracked() {
+    if (here == nullptr) return;
+    destroyed++;
+    if (std::this_thread::get_id() == owner) ++*here;
+  }
+  int* here;
+  std::thread::id owner;
+};
+}  // namespace
+
+TEST(AvlTest, DroppedVersionIsReclaimedInBackground) {
+  int destroyed_here = 0;
+  {
+    AVL<int, Tracked> avl;
+    for (int i = 0; i < 10000; i++) {
+      avl = std::move(avl).Add(i, Tracked(&destroyed_here));
+    }
+    destroyed = 0;
+    destroyed_here = 0;
+  }
+  // only the root's value goes with the version
+  EXPECT_EQ(1, destroyed_here);
+  Reclaimer::Get()->Drain();
+  EXPECT_EQ(0u, Reclaimer::Get()->queue_depth());
+  EXPECT_EQ(10000, destroyed.load());
+  EXPECT_EQ(1, destroyed_here);
+}
+
+// last: the reclaimer stays stopped for the rest of the process
+TEST(AvlTest, StoppedReclaimerLeavesDroppingToTheDropper) {
+  int destroyed_here = 0;
+  {
+    AVL<int, Tracked> avl;
+    for (int i = 0; i < 10000; i++) {
+      avl = std::move(avl).Add(i, Tracked(&destroyed_here));
+    }
+    destroyed = 0;
+    destroyed_here = 0;
+  }
+  Reclaimer::Get()->Stop();
+  EXPECT_EQ(0u, Reclaimer::Get()->queue_depth());
+  EXPECT_EQ(10000, destroyed.load());
+  {
+    AVL<int, Tracked> avl;
+    for (int i = 0; i < 100; i++) {
+      avl = std::move(avl).Add(i, Tracked(&destroyed_here));
+    }
+    destroyed = 0;
+    destroyed_here = 0;
+  }
+  EXPECT_EQ(100, destroyed_here);
+}
@@ -0,0 +1,65 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <benchmark/benchmark.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "journal.h"
+#include "temp_file.h"
+
+// a journal of state.range(0) keystrokes typed at the end of the document,
+// each its own batch as the editor sends them
+static void WriteTyping(const std::string& path, int keystrokes) {
+  Site site;
+  Journal journal(path);
+  String::CommandBuf buf;
+  ID after = String::Begin();
+  for (int i = 0; i < keystrokes; i++) {
+    buf.clear();
+    after = String::MakeRawInsert(&buf, &site, "abcdefgh\n"[i % 9], after,
+                                  String::End());
+    journal.Append(buf);
+  }
+}
+
+// appending is on the editing path: it must not wait for the disk
+static void BM_JournalAppend(benchmark::State& state) {
+  NamedTempFile tmp;
+  Site site;
+  Journal journal(tmp.filename());
+  String::CommandBuf buf;
+  ID after = String::Begin();
+  for (auto _ : state) {
+    buf.clear();
+    after = String::MakeRawInsert(&buf, &site, 'x', after, String::End());
+    journal.Append(buf);
+  }
+  journal.Flush();
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_JournalAppend);
+
+static void BM_JournalRecover(benchmark::State& state) {
+  NamedTempFile tmp;
+  WriteTyping(tmp.filename(), state.range(0));
+  for (auto _ : state) {
+    String content;
+    Journal::Recover(tmp.filename(), &content);
+    benchmark::DoNotOptimize(content);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_JournalRecover)->Range(1000, 100000)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
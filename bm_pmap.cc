@@ -0,0 +1,134 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <benchmark/benchmark.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+#include <random>
+#include <vector>
+#include "avl.h"
+#include "btree.h"
+
+// live heap bytes, tracked through the global allocator so that memory per
+// entry includes node headers and control blocks (nodes are freed on the
+// reclaimer thread too)
+static std::atomic<size_t> live_bytes{0};
+
+void* operator new(size_t n) {
+  size_t* p = static_cast<size_t*>(malloc(n + sizeof(size_t) * 2));
+  if (p == nullptr) throw std::bad_alloc();
+  *p = n;
+  live_bytes += n;
+  return p + 2;
+}
+
+void operator delete(void* p) noexcept {
+  if (p == nullptr) return;
+  size_t* h = static_cast<size_t*>(p) - 2;
+  live_bytes -= *h;
+  free(h);
+}
+
+void operator delete(void* p, size_t) noexcept { operator delete(p); }
+
+static std::vector<uint64_t> GenKeys(size_t n) {
+  std::mt19937_64 rng(n);
+  std::vector<uint64_t> keys(n);
+  for (auto& k : keys) k = rng();
+  return keys;
+}
+
+template <class M>
+static M Build(const std::vector<uint64_t>& keys) {
+  M m;
+  for (auto k : keys) m = m.Add(k, k);
+  return m;
+}
+
+template <class M>
+static void BM_Insert(benchmark::State& state) {
+  auto keys = GenKeys(state.range(0));
+  for (auto _ : state) {
+    M m = Build<M>(keys);
+    benchmark::DoNotOptimize(m);
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+template <class M>
+static void BM_Lookup(benchmark::State& state) {
+  auto keys = GenKeys(state.range(0));
+  M m = Build<M>(keys);
+  std::mt19937 rng(42);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(m.Lookup(keys[rng() % keys.size()]));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+template <class M>
+static void BM_Memory(benchmark::State& state) {
+  auto keys = GenKeys(state.range(0));
+  for (auto _ : state) {
+    size_t before = live_bytes;
+    M m = Build<M>(keys);
+    state.counters["bytes_per_entry"] =
+        static_cast<double>(live_bytes - before) / keys.size();
+  }
+}
+
+// dropping the last reference to a version of state.range(0) entries: the
+// time the dropping thread spends, with the rest left to the reclaimer
+template <class M>
+static void BM_DropVersion(benchmark::State& state) {
+  auto keys = GenKeys(state.range(0));
+  for (auto _ : state) {
+    state.PauseTiming();
+    M m = Build<M>(keys);
+    Reclaimer::Get()->Drain();
+    state.ResumeTiming();
+    m = M();
+    state.PauseTiming();
+    Reclaimer::Get()->Drain();
+    state.ResumeTiming();
+  }
+}
+
+typedef AVL<uint64_t, uint64_t> AVLMap;
+typedef BTree<uint64_t, uint64_t> BTreeMap;
+
+BENCHMARK_TEMPLATE(BM_Insert, AVLMap)->RangeMultiplier(10)->Range(1e3, 1e7);
+BENCHMARK_TEMPLATE(BM_Insert, BTreeMap)->RangeMultiplier(10)->Range(1e3, 1e7);
+BENCHMARK_TEMPLATE(BM_Lookup, AVLMap)->RangeMultiplier(10)->Range(1e3, 1e7);
+BENCHMARK_TEMPLATE(BM_Lookup, BTreeMap)->RangeMultiplier(10)->Range(1e3, 1e7);
+BENCHMARK_TEMPLATE(BM_Memory, AVLMap)
+    ->RangeMultiplier(10)
+    ->Range(1e3, 1e7)
+    ->Iterations(1);
+BENCHMARK_TEMPLATE(BM_Memory, BTreeMap)
+    ->RangeMultiplier(10)
+    ->Range(1e3, 1e7)
+    ->Iterations(1);
+
+BENCHMARK_TEMPLATE(BM_DropVersion, AVLMap)
+    ->RangeMultiplier(10)
+    ->Range(1e3, 1e6)
+    ->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_DropVersion, BTreeMap)
+    ->RangeMultiplier(10)
+    ->Range(1e3, 1e6)
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
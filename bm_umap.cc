@@ -0,0 +1,78 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <benchmark/benchmark.h>
+#include <vector>
+#include "buffer.h"
+
+// a highlighter republishing every token of a file, a few of them retagged
+static void BM_PublishTokens(benchmark::State& state) {
+  const int n = state.range(0);
+  const int changed_per_mille = state.range(1);
+  Site site;
+  std::vector<ID> ids;
+  for (int i = 0; i <= n; i++) ids.push_back(site.GenerateID());
+  Tag base = Tag().Push("source.c++");
+  const Tag tags[] = {base.Push("keyword.c++"), base.Push("comment.c++"),
+                      base.Push("LIBCLANG-DeclRefExpr"),
+                      base.Push("LIBCLANG-FunctionDecl")};
+  std::vector<int> tag(n);
+  for (int i = 0; i < n; i++) tag[i] = i % 4;
+
+  UMapEditor<ID, Annotation<Tag>> editor(&site);
+  auto publish = [&]() {
+    AnnotationMap<Tag>::CommandBuf commands;
+    editor.BeginEdit(&commands);
+    for (int i = 0; i < n; i++) {
+      editor.Add(ids[i], Annotation<Tag>(ids[i + 1], tags[tag[i]]));
+    }
+    editor.Publish();
+    return commands.size();
+  };
+  publish();
+
+  const int stride = 1000 / changed_per_mille;
+  int round = 0;
+  size_t commands = 0;
+  for (auto _ : state) {
+    round++;
+    for (int i = round % stride; i < n; i += stride) tag[i] = (tag[i] + 1) % 4;
+    commands += publish();
+  }
+  state.counters["commands"] = double(commands) / state.iterations();
+}
+BENCHMARK(BM_PublishTokens)->Args({50000, 10})->Args({50000, 1000});
+
+// a disassembly republished unchanged
+static void BM_PublishSideBuffer(benchmark::State& state) {
+  Site site;
+  SideBuffer side_buffer;
+  for (int i = 0; i < state.range(0); i++) {
+    for (char c : std::string("  mov rax, qword ptr [rbp - 8]\n")) {
+      side_buffer.content.push_back(c);
+      side_buffer.tokens.push_back(Tag());
+    }
+  }
+  side_buffer.CalcLines();
+
+  UMapEditor<std::string, SideBuffer> editor(&site);
+  for (auto _ : state) {
+    UMap<std::string, SideBuffer>::CommandBuf commands;
+    editor.BeginEdit(&commands);
+    editor.Add("disasm", side_buffer);
+    editor.Publish();
+  }
+}
+BENCHMARK(BM_PublishSideBuffer)->Range(1, 1 << 16);
+
+BENCHMARK_MAIN();
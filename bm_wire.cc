@@ -0,0 +1,77 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <benchmark/benchmark.h>
+#include "wire.h"
+
+// a 1MB paste
+static EditResponse Paste() {
+  Site site;
+  EditResponse r;
+  String::MakeRawInsert(&r.content, &site, std::string(1 << 20, 'x'),
+                        String::Begin(), String::End());
+  return r;
+}
+
+// a highlighting pass over n tokens, as libclang publishes them
+static EditResponse Tokens(int n) {
+  Site site;
+  EditResponse r;
+  const Tag tag = Tag().Push("identifier").Push("cxx");
+  for (int i = 0; i < n; i++) {
+    AnnotationMap<Tag>::MakeInsert(
+        &r.token_types, &site, ID(1, 2 * i),
+        Annotation<Tag>(ID(1, 2 * i + 1), tag));
+  }
+  return r;
+}
+
+static void Encode(benchmark::State& state, const EditResponse& r) {
+  size_t bytes = 0;
+  for (auto _ : state) {
+    std::string out = EncodeResponse(r);
+    bytes += out.size();
+    benchmark::DoNotOptimize(out);
+  }
+  state.SetBytesProcessed(bytes);
+}
+
+static void Decode(benchmark::State& state, const EditResponse& r) {
+  const std::string in = EncodeResponse(r);
+  for (auto _ : state) {
+    EditResponse decoded;
+    DecodeResponse(in.data(), in.size(), &decoded);
+    benchmark::DoNotOptimize(decoded);
+  }
+  state.SetBytesProcessed(state.iterations() * in.size());
+}
+
+static void BM_EncodePaste(benchmark::State& state) { Encode(state, Paste()); }
+BENCHMARK(BM_EncodePaste);
+
+static void BM_DecodePaste(benchmark::State& state) { Decode(state, Paste()); }
+BENCHMARK(BM_DecodePaste);
+
+static void BM_EncodeTokens(benchmark::State& state) {
+  Encode(state, Tokens(state.range(0)));
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_EncodeTokens)->Range(1000, 50000);
+
+static void BM_DecodeTokens(benchmark::State& state) {
+  Decode(state, Tokens(state.range(0)));
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_DecodeTokens)->Range(1000, 50000);
+
+BENCHMARK_MAIN();
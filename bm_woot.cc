@@ -0,0 +1,369 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <benchmark/benchmark.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <new>
+#include <random>
+#include <vector>
+#include "woot.h"
+
+// heap allocations, counted through the global allocator: every form of
+// new and delete is replaced, so that none mixes with the library's
+static size_t allocs = 0;
+
+static void* Allocate(size_t n, size_t align) {
+  allocs++;
+  void* p = align <= alignof(max_align_t)
+                ? malloc(n)
+                : aligned_alloc(align, (n + align - 1) / align * align);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+// kept out of line: inlined, the compiler sees free() meet operator new
+__attribute__((noinline)) static void Deallocate(void* p) { free(p); }
+
+void* operator new(size_t n) { return Allocate(n, 0); }
+void* operator new[](size_t n) { return Allocate(n, 0); }
+void* operator new(size_t n, std::align_val_t a) {
+  return Allocate(n, static_cast<size_t>(a));
+}
+void* operator new[](size_t n, std::align_val_t a) {
+  return Allocate(n, static_cast<size_t>(a));
+}
+
+void operator delete(void* p) noexcept { Deallocate(p); }
+void operator delete[](void* p) noexcept { Deallocate(p); }
+void operator delete(void* p, size_t) noexcept { Deallocate(p); }
+void operator delete[](void* p, size_t) noexcept { Deallocate(p); }
+void operator delete(void* p, std::align_val_t) noexcept { Deallocate(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { Deallocate(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+  Deallocate(p);
+}
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+  Deallocate(p);
+}
+
+// bytes of heap in use, node pool slabs included
+static size_t HeapBytes() { return mallinfo2().uordblks; }
+
+// allocations per iteration since start_allocs, and the peak resident set of
+// the process so far (which only grows: read it against the sizes run before)
+static void CountMemory(benchmark::State& state, size_t start_allocs) {
+  state.counters["allocs_per_op"] = benchmark::Counter(
+      allocs - start_allocs, benchmark::Counter::kAvgIterations);
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  state.counters["peak_rss_mb"] = usage.ru_maxrss / 1024.0;
+}
+
+// a document of text, loaded as one command
+static String Document(Site* site, const std::string& text) {
+  String s;
+  String::CommandBuf buf;
+  String::MakeRawInsert(&buf, site, text, String::Begin(), String::End());
+  for (const auto& cmd : buf) s = std::move(s).Integrate(cmd);
+  return s;
+}
+
+// heap held per character by a 64k character document, either typed in
+// order (range(0) == 0), which keeps characters in long runs, or typed at
+// random places (range(0) == 1), which leaves a run per character.
+// Registered first, and the documents are kept: node pools never return
+// memory, so nodes freed before a document is built would be reused by it
+// uncounted.
+static void BM_BytesPerChar(benchmark::State& state) {
+  static std::vector<String> documents;
+  const size_t kChars = 65536;
+  const bool scattered = state.range(0) == 1;
+  size_t bytes = 0;
+  for (auto _ : state) {
+    Site site;
+    String::CommandBuf buf;
+    std::mt19937 rng(42);
+    const size_t start_bytes = HeapBytes();
+    String s;
+    ID after = String::Begin();
+    for (size_t i = 0; i < kChars; i++) {
+      if (scattered) {
+        const size_t offset = rng() % (s.Length() + 1);
+        after = offset == 0 ? String::Begin() : s.IDAtOffset(offset - 1);
+      }
+      buf.clear();
+      after = s.MakeInsert(&buf, &site, 'y', after);
+      s = std::move(s).Integrate(buf[0]);
+    }
+    buf = String::CommandBuf();
+    bytes = HeapBytes() - start_bytes;
+    documents.push_back(std::move(s));
+  }
+  state.counters["bytes_per_char"] = static_cast<double>(bytes) / kChars;
+}
+BENCHMARK(BM_BytesPerChar)
+    ->Arg(0)
+    ->Arg(1)
+    ->Iterations(1)
+    ->Unit(benchmark::kMillisecond);
+
+// insert-heavy editing: each iteration inserts one character after a random
+// visible character of a document that starts with state.range(0) characters
+static void BM_IntegrateRandomInsert(benchmark::State& state) {
+  Site site;
+  String s;
+  String::CommandBuf buf;
+  String::MakeRawInsert(&buf, &site, std::string(state.range(0), 'x'),
+                        String::Begin(), String::End());
+  for (const auto& cmd : buf) s = s.Integrate(cmd);
+  std::mt19937 rng(42);
+  size_t start_allocs = allocs;
+  for (auto _ : state) {
+    buf.clear();
+    ID after = s.IDAtOffset(rng() % s.Length());
+    s.MakeInsert(&buf, &site, 'y', after);
+    s = s.Integrate(buf[0]);
+  }
+  CountMemory(state, start_allocs);
+}
+BENCHMARK(BM_IntegrateRandomInsert)->Range(1024, 1 << 20);
+
+// sequential typing in the middle of a document of state.range(0) characters
+static void BM_IntegrateTyping(benchmark::State& state) {
+  Site site;
+  String s = Document(&site, std::string(state.range(0), 'x'));
+  String::CommandBuf buf;
+  ID after = s.IDAtOffset(state.range(0) / 2);
+  size_t start_allocs = allocs;
+  for (auto _ : state) {
+    buf.clear();
+    after = s.MakeInsert(&buf, &site, 'y', after);
+    s = s.Integrate(buf[0]);
+  }
+  CountMemory(state, start_allocs);
+}
+BENCHMARK(BM_IntegrateTyping)->RangeMultiplier(10)->Range(1000, 1000000);
+
+// loading state.range(0) characters into an empty document
+static void BM_IntegrateLoad(benchmark::State& state) {
+  Site site;
+  String::CommandBuf buf;
+  String::MakeRawInsert(&buf, &site, std::string(state.range(0), 'x'),
+                        String::Begin(), String::End());
+  size_t start_allocs = allocs;
+  for (auto _ : state) {
+    String s;
+    for (const auto& cmd : buf) s = std::move(s).Integrate(cmd);
+    benchmark::DoNotOptimize(s);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  state.counters["allocs_per_char"] =
+      static_cast<double>(allocs - start_allocs) /
+      (state.iterations() * state.range(0));
+}
+BENCHMARK(BM_IntegrateLoad)->Range(1024, 1 << 20);
+
+// pasting state.range(0) characters into the middle of a 64k document
+static void BM_IntegratePaste(benchmark::State& state) {
+  Site site;
+  String base;
+  String::CommandBuf buf;
+  String::MakeRawInsert(&buf, &site, std::string(65536, 'x'), String::Begin(),
+                        String::End());
+  for (const auto& cmd : buf) base = std::move(base).Integrate(cmd);
+  buf.clear();
+  String::MakeRawInsert(&buf, &site, std::string(state.range(0), 'y'),
+                        base.IDAtOffset(32768), base.IDAtOffset(32769));
+  size_t start_allocs = allocs;
+  for (auto _ : state) {
+    String s = base;
+    for (const auto& cmd : buf) s = std::move(s).Integrate(cmd);
+    benchmark::DoNotOptimize(s);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  state.counters["allocs_per_char"] =
+      static_cast<double>(allocs - start_allocs) /
+      (state.iterations() * state.range(0));
+}
+BENCHMARK(BM_IntegratePaste)->Range(1024, 1 << 20);
+
+// removing the middle half of a document of state.range(0) characters with
+// one command per id span, the document either loaded in one piece
+// (range(1) == 0) or with a character typed after every 16th (range(1) == 1),
+// which leaves the spans short
+static void BM_IntegrateRemoveRange(benchmark::State& state) {
+  Site site;
+  const size_t n = state.range(0);
+  String base = Document(&site, std::string(n, 'x'));
+  String::CommandBuf buf;
+  if (state.range(1) == 1) {
+    for (size_t i = 0; i < n; i += 16) {
+      buf.clear();
+      base.MakeInsert(&buf, &site, 'y', base.IDAtOffset(i + i / 16));
+      base = std::move(base).Integrate(buf[0]);
+    }
+  }
+  buf.clear();
+  base.MakeRemove(&buf, base.IDAtOffset(base.Length() / 4),
+                  base.IDAtOffset(base.Length() * 3 / 4));
+  size_t start_allocs = allocs;
+  for (auto _ : state) {
+    String s = base;
+    for (const auto& cmd : buf) s = std::move(s).Integrate(cmd);
+    benchmark::DoNotOptimize(s);
+  }
+  state.SetItemsProcessed(state.iterations() * (base.Length() / 2));
+  state.counters["commands"] = buf.size();
+  CountMemory(state, start_allocs);
+}
+static void RemoveRangeArgs(benchmark::internal::Benchmark* b) {
+  for (int n = 1000; n <= 1000000; n *= 10) {
+    b->Args({n, 0});
+    b->Args({n, 1});
+  }
+}
+BENCHMARK(BM_IntegrateRemoveRange)
+    ->Apply(RemoveRangeArgs)
+    ->Unit(benchmark::kMicrosecond);
+
+// state.range(0) sites each typing 8 characters at the same place in a
+// document of state.range(1) characters, concurrently: every site's first
+// insert goes between the same two characters, so integrating them takes
+// String::IntegrateInsert's slow path. Integrated round robin, a character
+// from each site in turn, as a collaborator would see them arrive.
+static void BM_IntegrateConcurrentInserts(benchmark::State& state) {
+  const size_t kChars = 8;
+  const size_t sites = state.range(0);
+  Site base_site;
+  const String base = Document(&base_site, std::string(state.range(1), 'x'));
+  const ID after = base.IDAtOffset(state.range(1) / 2);
+  const ID before = base.IDAtOffset(state.range(1) / 2 + 1);
+  std::vector<String::CommandBuf> typed(sites);
+  for (size_t i = 0; i < sites; i++) {
+    Site site;
+    ID prev = after;
+    for (size_t j = 0; j < kChars; j++) {
+      prev = String::MakeRawInsert(&typed[i], &site, 'a' + i % 26, prev,
+                                   before);
+    }
+  }
+  size_t start_allocs = allocs;
+  for (auto _ : state) {
+    String s = base;
+    for (size_t j = 0; j < kChars; j++) {
+      for (size_t i = 0; i < sites; i++) {
+        s = std::move(s).Integrate(typed[i][j]);
+      }
+    }
+    benchmark::DoNotOptimize(s);
+  }
+  state.SetItemsProcessed(state.iterations() * sites * kChars);
+  CountMemory(state, start_allocs);
+}
+static void ConcurrentInsertsArgs(benchmark::internal::Benchmark* b) {
+  for (int sites : {2, 8, 64}) {
+    b->Args({sites, 1000});
+    b->Args({sites, 1000000});
+  }
+}
+BENCHMARK(BM_IntegrateConcurrentInserts)
+    ->Apply(ConcurrentInsertsArgs)
+    ->Unit(benchmark::kMicrosecond);
+
+// ordering ids far apart in a buffer of state.range(0) lines
+static void BM_OrderIDs(benchmark::State& state) {
+  Site site;
+  String s;
+  String::CommandBuf buf;
+  std::string text;
+  for (int i = 0; i < state.range(0); i++) text += "int x = 42;\n";
+  String::MakeRawInsert(&buf, &site, text, String::Begin(), String::End());
+  for (const auto& cmd : buf) s = std::move(s).Integrate(cmd);
+  std::mt19937 rng(42);
+  std::vector<ID> ids;
+  for (int i = 0; i < 1024; i++) {
+    ids.push_back(s.IDAtOffset(rng() % text.size()));
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(s.OrderIDs(ids[i % 1024], ids[(i + 511) % 1024]));
+    i++;
+  }
+}
+BENCHMARK(BM_OrderIDs)->Range(1024, 1 << 20);
+
+// diffing a buffer of state.range(0) lines against versions of it with a
+// single character inserted or removed
+static void BM_DiffSingleEdit(benchmark::State& state) {
+  Site site;
+  String s;
+  String::CommandBuf buf;
+  std::string text;
+  for (int i = 0; i < state.range(0); i++) text += "int x = 42;\n";
+  String::MakeRawInsert(&buf, &site, text, String::Begin(), String::End());
+  for (const auto& cmd : buf) s = std::move(s).Integrate(cmd);
+  std::mt19937 rng(42);
+  std::vector<String> edited;
+  for (int i = 0; i < 1024; i++) {
+    buf.clear();
+    const ID id = s.IDAtOffset(rng() % s.Length());
+    if (i % 2) {
+      s.MakeRemove(&buf, id);
+    } else {
+      s.MakeInsert(&buf, &site, 'y', id);
+    }
+    edited.push_back(s.Integrate(buf[0]));
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(edited[i++ % 1024].Diff(s));
+  }
+}
+BENCHMARK(BM_DiffSingleEdit)->Range(1000, 100000);
+
+// recording a 1MB paste, either as one command per character (range(0) == 0)
+// or as a single run command: the command buffer is a flat record array plus
+// a text arena, so recording should cost neither allocations nor pointers
+// per command
+static void BM_RecordPaste(benchmark::State& state) {
+  Site site;
+  const std::string text(1 << 20, 'x');
+  const bool per_char = state.range(0) == 0;
+  String::CommandBuf buf;
+  size_t commands = 0;
+  size_t bytes = 0;
+  size_t start_allocs = allocs;
+  for (auto _ : state) {
+    buf.clear();
+    if (per_char) {
+      ID after = String::Begin();
+      for (char c : text) {
+        after = String::MakeRawInsert(&buf, &site, c, after, String::End());
+      }
+    } else {
+      String::MakeRawInsert(&buf, &site, text, String::Begin(),
+                            String::End());
+    }
+    commands += buf.size();
+    bytes = buf.Bytes();
+  }
+  state.SetItemsProcessed(commands);
+  state.counters["bytes_per_command"] = static_cast<double>(bytes) / buf.size();
+  state.counters["allocs_per_command"] =
+      static_cast<double>(allocs - start_allocs) / commands;
+}
+BENCHMARK(BM_RecordPaste)->Arg(0)->Arg(1);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,600 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <assert.h>
+#include <stdint.h>
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+#include "reclaimer.h"
+#include "summary.h"
+
+// Persistent B+-tree with the same interface as AVL (avl.h).
+// Entries are stored inline in wide leaves; interior nodes hold one child
+// pointer and the smallest key beneath it per slot. A lookup touches
+// O(log_B n) nodes instead of O(log_2 n), and an update copies only the nodes
+// along the modified root-to-leaf spine.
+template <class K, class V, class Summary = NoSummary>
+class BTree {
+ public:
+  BTree() {}
+
+  // build from entries sorted by key in O(n); the entries are moved from
+  template <class It>
+  static BTree FromSorted(It begin, It end) {
+    const int64_t n = end - begin;
+    if (n == 0) return BTree();
+    std::vector<NodePtr> level;
+    const int64_t leaves = (n + kLeafSlots - 1) / kLeafSlots;
+    It it = begin;
+    for (int64_t i = 0; i < leaves; i++) {
+      auto leaf = std::make_shared<Leaf>();
+      // spread entries evenly so that no leaf is underfull
+      for (int64_t j = n * i / leaves; j < n * (i + 1) / leaves; j++, ++it) {
+        leaf->keys.push_back(std::move(it->first));
+        leaf->values.push_back(std::move(it->second));
+      }
+      level.push_back(Finish(std::move(leaf)));
+    }
+    while (level.size() > 1) {
+      const int64_t m = level.size();
+      const int64_t branches = (m + kBranchSlots - 1) / kBranchSlots;
+      std::vector<NodePtr> up;
+      for (int64_t i = 0; i < branches; i++) {
+        auto branch = std::make_shared<Branch>();
+        for (int64_t j = m * i / branches; j < m * (i + 1) / branches; j++) {
+          AppendChild(branch.get(), std::move(level[j]));
+        }
+        up.push_back(Finish(std::move(branch)));
+      }
+      level.swap(up);
+    }
+    return BTree(std::move(level[0]));
+  }
+
+  BTree Add(K key, V value) const {
+    if (root_ == nullptr) {
+      auto leaf = std::make_shared<Leaf>();
+      leaf->keys.push_back(std::move(key));
+      leaf->values.push_back(std::move(value));
+      return BTree(Finish(std::move(leaf)));
+    }
+    Split s = Insert(root_.get(), std::move(key), std::move(value));
+    if (s.second == nullptr) return BTree(std::move(s.first));
+    auto branch = std::make_shared<Branch>();
+    AppendChild(branch.get(), std::move(s.first));
+    AppendChild(branch.get(), std::move(s.second));
+    return BTree(Finish(std::move(branch)));
+  }
+
+  BTree Remove(const K &key) const {
+    if (root_ == nullptr) return *this;
+    bool found = false;
+    NodePtr root = Erase(root_, key, &found);
+    if (!found) return *this;
+    while (root != nullptr && !root->leaf && Size(root.get()) == 1) {
+      root = AsBranch(root.get())->children[0];
+    }
+    return BTree(std::move(root));
+  }
+
+  const V *Lookup(const K &key) const {
+    const Leaf *leaf = FindLeaf(key);
+    if (leaf == nullptr) return nullptr;
+    int i = LowerBound(leaf->keys, key);
+    if (i == leaf->keys.size() || key < leaf->keys[i]) return nullptr;
+    return &leaf->values[i];
+  }
+
+  // find the entry with the greatest key <= key
+  // returns {nullptr, nullptr} if there is no such entry
+  std::pair<const K *, const V *> LookupFloor(const K &key) const {
+    const Leaf *leaf = FindLeaf(key);
+    if (leaf == nullptr) return std::make_pair(nullptr, nullptr);
+    int i = UpperBound(leaf->keys, key) - 1;
+    if (i < 0) return std::make_pair(nullptr, nullptr);
+    return std::make_pair(&leaf->keys[i], &leaf->values[i]);
+  }
+
+  bool Empty() const { return root_ == nullptr; }
+
+  template <class F>
+  void ForEach(F &&f) const {
+    ForEachImpl(root_.get(), std::forward<F>(f));
+  }
+
+  // visit entries with lo <= key < hi in order
+  template <class F>
+  void ForEachInRange(const K &lo, const K &hi, F &&f) const {
+    ForEachInRangeImpl(root_.get(), lo, hi, std::forward<F>(f));
+  }
+
+  // summary of all entries
+  Summary Total() const { return root_ ? root_->summary : Summary(); }
+
+  // summary of all entries with keys < key
+  Summary SummaryBefore(const K &key) const {
+    Summary s;
+    const Node *n = root_.get();
+    while (n != nullptr && !n->leaf) {
+      const Branch *b = AsBranch(n);
+      int i = LowerBound(b->keys, key) - 1;
+      if (i < 0) return s;
+      for (int j = 0; j < i; j++) s = s + b->children[j]->summary;
+      n = b->children[i].get();
+    }
+    if (n == nullptr) return s;
+    const Leaf *leaf = AsLeaf(n);
+    for (int i = 0; i < leaf->keys.size() && leaf->keys[i] < key; i++) {
+      s = s + Summary(leaf->keys[i], leaf->values[i]);
+    }
+    return s;
+  }
+
+  // find the first entry for which pred(summary of all entries up to and
+  // including it) holds - pred must be monotonic over the key order
+  // if before is non-null, it receives the summary of all preceding entries
+  template <class F>
+  std::pair<const K *, const V *> Select(F &&pred, Summary *before) const {
+    Summary s;
+    const Node *n = root_.get();
+    while (n != nullptr && !n->leaf) {
+      const Branch *b = AsBranch(n);
+      const Node *next = nullptr;
+      for (int i = 0; i < b->children.size(); i++) {
+        Summary t = s + b->children[i]->summary;
+        if (pred(t)) {
+          next = b->children[i].get();
+          break;
+        }
+        s = t;
+      }
+      n = next;
+    }
+    if (n == nullptr) return std::make_pair(nullptr, nullptr);
+    const Leaf *leaf = AsLeaf(n);
+    for (int i = 0; i < leaf->keys.size(); i++) {
+      Summary t = s + Summary(leaf->keys[i], leaf->values[i]);
+      if (pred(t)) {
+        if (before != nullptr) *before = s;
+        return std::make_pair(&leaf->keys[i], &leaf->values[i]);
+      }
+      s = t;
+    }
+    return std::make_pair(nullptr, nullptr);
+  }
+
+  bool SameIdentity(BTree t) const { return root_ == t.root_; }
+
+  // visit in key order the entries of a and b outside the subtrees they
+  // share, as f(key, value, in_b); entries of copied leaves are visited even
+  // if unchanged. O(differences * B log_B n) when one version derives from
+  // the other.
+  template <class F>
+  static void ForEachDifference(const BTree &a, const BTree &b, F &&f) {
+    DiffCursor ca, cb;
+    ca.Push(a.root_.get(), Height(a.root_.get()));
+    cb.Push(b.root_.get(), Height(b.root_.get()));
+    while (!ca.items.empty() && !cb.items.empty()) {
+      const DiffItem x = ca.items.back();
+      const DiffItem y = cb.items.back();
+      if (x.node == y.node && x.entry == y.entry) {
+        ca.items.pop_back();
+        cb.items.pop_back();
+      } else if (x.entry < 0 || y.entry < 0) {
+        // open the taller subtree first so that shared ones line up
+        if (y.entry >= 0 || (x.entry < 0 && x.height >= y.height)) {
+          ca.Expand();
+        } else {
+          cb.Expand();
+        }
+      } else {
+        const Leaf *xl = AsLeaf(x.node);
+        const Leaf *yl = AsLeaf(y.node);
+        const K &xk = xl->keys[x.entry];
+        const K &yk = yl->keys[y.entry];
+        const bool take_x = !(yk < xk);
+        const bool take_y = !(xk < yk);
+        if (take_x) {
+          f(xk, xl->values[x.entry], false);
+          ca.items.pop_back();
+        }
+        if (take_y) {
+          f(yk, yl->values[y.entry], true);
+          cb.items.pop_back();
+        }
+      }
+    }
+    ca.Drain(f, false);
+    cb.Drain(f, true);
+  }
+
+ private:
+  // leaves target ~512 bytes of entries; branches always fan out 16 ways
+  static constexpr int kLeafSlots = std::max(
+      4, std::min(32, static_cast<int>(512 / (sizeof(K) + sizeof(V)))));
+  static constexpr int kBranchSlots = 16;
+
+  // fixed capacity array with inline storage for types that need not be
+  // default constructible; one spare slot holds the overflow before a split
+  template <class T, int N>
+  class Slots {
+   public:
+    Slots() {}
+    Slots(const Slots &) = delete;
+    Slots &operator=(const Slots &) = delete;
+    ~Slots() {
+      for (int i = 0; i < size_; i++) data()[i].~T();
+    }
+
+    int size() const { return size_; }
+    const T &operator[](int i) const { return data()[i]; }
+    T &operator[](int i) { return data()[i]; }
+    const T *begin() const { return data(); }
+    const T *end() const { return data() + size_; }
+
+    template <class U>
+    void push_back(U &&value) {
+      assert(size_ <= N);
+      new (data() + size_) T(std::forward<U>(value));
+      size_++;
+    }
+
+   private:
+    T *data() { return reinterpret_cast<T *>(storage_); }
+    const T *data() const { return reinterpret_cast<const T *>(storage_); }
+
+    alignas(T) unsigned char storage_[(N + 1) * sizeof(T)];
+    int size_ = 0;
+  };
+
+  struct Node {
+    explicit Node(bool l) : leaf(l) {}
+    const bool leaf;
+    Summary summary;
+  };
+  typedef std::shared_ptr<const Node> NodePtr;
+
+  struct Leaf : public Node {
+    Leaf() : Node(true) {}
+    Slots<K, kLeafSlots> keys;
+    Slots<V, kLeafSlots> values;
+  };
+
+  struct Branch : public Node {
+    Branch() : Node(false) {}
+    // children this branch was the last owner of are left to the reclaimer:
+    // dropping a version frees one node on the dropping thread, not all of
+    // the nodes only it held
+    ~Branch() {
+      NodePtr dead[kBranchSlots];
+      size_t n = 0;
+      for (int i = 0; i < children.size(); i++) {
+        if (children[i].use_count() == 1) dead[n++] = std::move(children[i]);
+      }
+      if (n > 0) Graveyard<NodePtr>::Get()->Bury(dead, n);
+    }
+    // keys[i] is the smallest key in children[i]
+    Slots<K, kBranchSlots> keys;
+    Slots<NodePtr, kBranchSlots> children;
+  };
+
+  // one node, or two after an overflowing insert
+  struct Split {
+    NodePtr first;
+    NodePtr second;
+  };
+
+  NodePtr root_;
+
+  BTree(NodePtr root) : root_(std::move(root)) {}
+
+  static const Leaf *AsLeaf(const Node *n) {
+    return static_cast<const Leaf *>(n);
+  }
+  static const Branch *AsBranch(const Node *n) {
+    return static_cast<const Branch *>(n);
+  }
+
+  static int Size(const Node *n) {
+    return n->leaf ? AsLeaf(n)->keys.size() : AsBranch(n)->keys.size();
+  }
+  static const K &MinKey(const Node *n) {
+    return n->leaf ? AsLeaf(n)->keys[0] : AsBranch(n)->keys[0];
+  }
+
+  template <class S>
+  static int LowerBound(const S &keys, const K &key) {
+    return std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+  }
+  template <class S>
+  static int UpperBound(const S &keys, const K &key) {
+    return std::upper_bound(keys.begin(), keys.end(), key) - keys.begin();
+  }
+
+  // index of the child that would contain key
+  static int ChildIndex(const Branch *b, const K &key) {
+    return std::max(0, UpperBound(b->keys, key) - 1);
+  }
+
+  static void AppendChild(Branch *b, NodePtr child) {
+    b->keys.push_back(MinKey(child.get()));
+    b->children.push_back(std::move(child));
+  }
+
+  static NodePtr Finish(std::shared_ptr<Leaf> leaf) {
+    Summary s;
+    for (int i = 0; i < leaf->keys.size(); i++) {
+      s = s + Summary(leaf->keys[i], leaf->values[i]);
+    }
+    leaf->summary = std::move(s);
+    return leaf;
+  }
+
+  static NodePtr Finish(std::shared_ptr<Branch> branch) {
+    Summary s;
+    for (int i = 0; i < branch->children.size(); i++) {
+      s = s + branch->children[i]->summary;
+    }
+    branch->summary = std::move(s);
+    return branch;
+  }
+
+  const Leaf *FindLeaf(const K &key) const {
+    const Node *n = root_.get();
+    if (n == nullptr) return nullptr;
+    while (!n->leaf) {
+      const Branch *b = AsBranch(n);
+      n = b->children[ChildIndex(b, key)].get();
+    }
+    return AsLeaf(n);
+  }
+
+  // distribute a (possibly overfull) leaf or branch across one or two nodes
+  static Split Balance(std::shared_ptr<Leaf> full) {
+    int n = full->keys.size();
+    if (n <= kLeafSlots) return Split{Finish(std::move(full)), nullptr};
+    auto a = std::make_shared<Leaf>();
+    auto b = std::make_shared<Leaf>();
+    for (int i = 0; i < n; i++) {
+      Leaf *dst = i < n / 2 ? a.get() : b.get();
+      dst->keys.push_back(full->keys[i]);
+      dst->values.push_back(full->values[i]);
+    }
+    return Split{Finish(std::move(a)), Finish(std::move(b))};
+  }
+
+  static Split Balance(std::shared_ptr<Branch> full) {
+    int n = full->keys.size();
+    if (n <= kBranchSlots) return Split{Finish(std::move(full)), nullptr};
+    auto a = std::make_shared<Branch>();
+    auto b = std::make_shared<Branch>();
+    for (int i = 0; i < n; i++) {
+      Branch *dst = i < n / 2 ? a.get() : b.get();
+      dst->keys.push_back(full->keys[i]);
+      dst->children.push_back(full->children[i]);
+    }
+    return Split{Finish(std::move(a)), Finish(std::move(b))};
+  }
+
+  static Split Insert(const Node *n, K key, V value) {
+    if (n->leaf) {
+      const Leaf *leaf = AsLeaf(n);
+      int size = leaf->keys.size();
+      int pos = LowerBound(leaf->keys, key);
+      bool replace = pos < size && !(key < leaf->keys[pos]);
+      auto out = std::make_shared<Leaf>();
+      for (int i = 0; i < pos; i++) {
+        out->keys.push_back(leaf->keys[i]);
+        out->values.push_back(leaf->values[i]);
+      }
+      out->keys.push_back(std::move(key));
+      out->values.push_back(std::move(value));
+      for (int i = replace ? pos + 1 : pos; i < size; i++) {
+        out->keys.push_back(leaf->keys[i]);
+        out->values.push_back(leaf->values[i]);
+      }
+      return Balance(std::move(out));
+    }
+    const Branch *b = AsBranch(n);
+    int c = ChildIndex(b, key);
+    Split s = Insert(b->children[c].get(), std::move(key), std::move(value));
+    auto out = std::make_shared<Branch>();
+    for (int i = 0; i < b->children.size(); i++) {
+      if (i != c) {
+        out->keys.push_back(b->keys[i]);
+        out->children.push_back(b->children[i]);
+        continue;
+      }
+      AppendChild(out.get(), std::move(s.first));
+      if (s.second != nullptr) AppendChild(out.get(), std::move(s.second));
+    }
+    return Balance(std::move(out));
+  }
+
+  // merge two adjacent siblings, splitting again if they do not fit one node
+  static Split Merge(const Node *l, const Node *r) {
+    int nl = Size(l);
+    int total = nl + Size(r);
+    int cut = total;
+    if (l->leaf) {
+      if (total > kLeafSlots) cut = total / 2;
+      auto a = std::make_shared<Leaf>();
+      auto b = std::make_shared<Leaf>();
+      for (int i = 0; i < total; i++) {
+        const Leaf *src = AsLeaf(i < nl ? l : r);
+        int j = i < nl ? i : i - nl;
+        Leaf *dst = i < cut ? a.get() : b.get();
+        dst->keys.push_back(src->keys[j]);
+        dst->values.push_back(src->values[j]);
+      }
+      return Split{Finish(std::move(a)),
+                   cut < total ? Finish(std::move(b)) : nullptr};
+    }
+    if (total > kBranchSlots) cut = total / 2;
+    auto a = std::make_shared<Branch>();
+    auto b = std::make_shared<Branch>();
+    for (int i = 0; i < total; i++) {
+      const Branch *src = AsBranch(i < nl ? l : r);
+      int j = i < nl ? i : i - nl;
+      Branch *dst = i < cut ? a.get() : b.get();
+      dst->keys.push_back(src->keys[j]);
+      dst->children.push_back(src->children[j]);
+    }
+    return Split{Finish(std::move(a)),
+                 cut < total ? Finish(std::move(b)) : nullptr};
+  }
+
+  static bool Underfull(const Node *n) {
+    if (n->leaf) return AsLeaf(n)->keys.size() < kLeafSlots / 2;
+    return AsBranch(n)->keys.size() < kBranchSlots / 2;
+  }
+
+  // returns the replacement for n (nullptr if it became empty); n is
+  // returned unchanged if key is absent
+  static NodePtr Erase(const NodePtr &n, const K &key, bool *found) {
+    if (n->leaf) {
+      const Leaf *leaf = AsLeaf(n.get());
+      int size = leaf->keys.size();
+      int pos = LowerBound(leaf->keys, key);
+      if (pos == size || key < leaf->keys[pos]) return n;
+      *found = true;
+      if (size == 1) return nullptr;
+      auto out = std::make_shared<Leaf>();
+      for (int i = 0; i < size; i++) {
+        if (i == pos) continue;
+        out->keys.push_back(leaf->keys[i]);
+        out->values.push_back(leaf->values[i]);
+      }
+      return Finish(std::move(out));
+    }
+    const Branch *b = AsBranch(n.get());
+    int size = b->children.size();
+    int c = ChildIndex(b, key);
+    NodePtr child = Erase(b->children[c], key, found);
+    if (!*found) return n;
+    // children [lo, hi] are replaced by merged: an emptied child is dropped,
+    // an underfull one is merged with a neighbour
+    int lo = c;
+    int hi = c;
+    Split merged{child, nullptr};
+    if (child != nullptr && Underfull(child.get()) && size > 1) {
+      if (c > 0) {
+        lo = c - 1;
+        merged = Merge(b->children[c - 1].get(), child.get());
+      } else {
+        hi = c + 1;
+        merged = Merge(child.get(), b->children[c + 1].get());
+      }
+    }
+    auto out = std::make_shared<Branch>();
+    for (int i = 0; i < size; i++) {
+      if (i < lo || i > hi) {
+        out->keys.push_back(b->keys[i]);
+        out->children.push_back(b->children[i]);
+      } else if (i == lo) {
+        if (merged.first != nullptr) AppendChild(out.get(), merged.first);
+        if (merged.second != nullptr) AppendChild(out.get(), merged.second);
+      }
+    }
+    if (out->children.size() == 0) return nullptr;
+    return Finish(std::move(out));
+  }
+
+  // levels above the leaves, counting leaves as 0
+  static int Height(const Node *n) {
+    int h = 0;
+    for (; n != nullptr && !n->leaf; h++) n = AsBranch(n)->children[0].get();
+    return h;
+  }
+
+  // an in-order walk that can stop short of whole subtrees: items are nodes
+  // not yet opened (entry < 0) or single leaf entries, next at back
+  struct DiffItem {
+    const Node *node;
+    int entry;
+    int height;
+  };
+  struct DiffCursor {
+    std::vector<DiffItem> items;
+
+    void Push(const Node *n, int height) {
+      if (n != nullptr) items.push_back(DiffItem{n, -1, height});
+    }
+    void Expand() {
+      const DiffItem item = items.back();
+      items.pop_back();
+      if (item.node->leaf) {
+        for (int i = Size(item.node) - 1; i >= 0; i--) {
+          items.push_back(DiffItem{item.node, i, 0});
+        }
+      } else {
+        const Branch *b = AsBranch(item.node);
+        for (int i = b->children.size() - 1; i >= 0; i--) {
+          Push(b->children[i].get(), item.height - 1);
+        }
+      }
+    }
+    template <class F>
+    void Drain(F &&f, bool in_b) {
+      auto visit = [&](const K &k, const V &v) { f(k, v, in_b); };
+      for (auto it = items.rbegin(); it != items.rend(); ++it) {
+        if (it->entry >= 0) {
+          const Leaf *leaf = AsLeaf(it->node);
+          visit(leaf->keys[it->entry], leaf->values[it->entry]);
+        } else {
+          ForEachImpl(it->node, visit);
+        }
+      }
+    }
+  };
+
+  template <class F>
+  static void ForEachImpl(const Node *n, F &&f) {
+    if (n == nullptr) return;
+    if (n->leaf) {
+      const Leaf *leaf = AsLeaf(n);
+      for (int i = 0; i < leaf->keys.size(); i++) {
+        f(leaf->keys[i], leaf->values[i]);
+      }
+      return;
+    }
+    const Branch *b = AsBranch(n);
+    for (int i = 0; i < b->children.size(); i++) {
+      ForEachImpl(b->children[i].get(), f);
+    }
+  }
+
+  template <class F>
+  static void ForEachInRangeImpl(const Node *n, const K &lo, const K &hi,
+                                 F &&f) {
+    if (n == nullptr) return;
+    if (n->leaf) {
+      const Leaf *leaf = AsLeaf(n);
+      for (int i = LowerBound(leaf->keys, lo);
+           i < leaf->keys.size() && leaf->keys[i] < hi; i++) {
+        f(leaf->keys[i], leaf->values[i]);
+      }
+      return;
+    }
+    const Branch *b = AsBranch(n);
+    for (int i = ChildIndex(b, lo); i < b->children.size() && b->keys[i] < hi;
+         i++) {
+      ForEachInRangeImpl(b->children[i].get(), lo, hi, f);
+    }
+  }
+};
@@ -0,0 +1,79 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "btree.h"
+#include <gtest/gtest.h>
+#include <string>
+
+TEST(BTreeTest, NoOp) { BTree<int, int> t; }
+
+TEST(BTreeTest, Lookup) {
+  auto t = BTree<int, int>().Add(1, 42);
+  EXPECT_EQ(nullptr, t.Lookup(2));
+  EXPECT_EQ(42, *t.Lookup(1));
+}
+
+TEST(BTreeTest, AddRemoveMany) {
+  BTree<int, std::string> t;
+  for (int i = 0; i < 10000; i++) t = t.Add((i * 7919) % 10000, "x");
+  auto full = t;
+  for (int i = 0; i < 10000; i += 2) t = t.Remove(i);
+  int n = 0;
+  int last = -1;
+  t.ForEach([&](int k, const std::string& v) {
+    EXPECT_EQ(1, k % 2);
+    EXPECT_LT(last, k);
+    last = k;
+    n++;
+  });
+  EXPECT_EQ(5000, n);
+  EXPECT_NE(nullptr, full.Lookup(42));
+  EXPECT_EQ(nullptr, t.Lookup(42));
+  EXPECT_EQ(41, *t.LookupFloor(42).first);
+  EXPECT_TRUE(t.SameIdentity(t.Remove(42)));
+  for (int i = 1; i < 10000; i += 2) t = t.Remove(i);
+  EXPECT_TRUE(t.Empty());
+}
+
+namespace {
+struct Count {
+  Count() {}
+  Count(int, int v) : n(1), sum(v) {}
+  Count operator+(const Count& o) const {
+    Count c;
+    c.n = n + o.n;
+    c.sum = sum + o.sum;
+    return c;
+  }
+  int n = 0;
+  int sum = 0;
+};
+}  // namespace
+
+TEST(BTreeTest, Summary) {
+  BTree<int, int, Count> t;
+  for (int i = 0; i < 100; i++) t = t.Add(i, 2 * i);
+  t = t.Remove(50);
+  EXPECT_EQ(99, t.Total().n);
+  EXPECT_EQ(10, t.SummaryBefore(10).n);
+  EXPECT_EQ(90, t.SummaryBefore(10).sum);
+  EXPECT_EQ(50, t.SummaryBefore(51).n);
+  Count before;
+  auto f = t.Select([](const Count& c) { return c.n > 50; }, &before);
+  EXPECT_EQ(51, *f.first);
+  EXPECT_EQ(102, *f.second);
+  EXPECT_EQ(50, before.n);
+  int visited = 0;
+  t.ForEachInRange(45, 55, [&](int k, int v) { visited++; });
+  EXPECT_EQ(9, visited);
+}
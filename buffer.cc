@@ -12,8 +12,11 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "buffer.h"
+#include <algorithm>
 #include "io_collaborator.h"
 #include "log.h"
+#include "reclaimer.h"
+#include "task_pool.h"
 #include "absl/strings/str_cat.h"
 
 Buffer::Buffer(const std::string& filename)
@@ -21,7 +24,21 @@ Buffer::Buffer(const std::string& filename)
       updating_(false),
       last_used_(absl::Now() - absl::Seconds(1000000)),
       filename_(filename) {
-  MakeCollaborator<IOCollaborator>();
+  // a journal left behind means the last session died: its text, rather
+  // than the file's, is what was being edited
+  std::unique_ptr<std::string> recovered;
+  const std::string journal = Journal::PathFor(filename);
+  String content;
+  if (Journal::Recover(journal, &content)) {
+    recovered.reset(new std::string(content.Render()));
+    Log() << "recovered " << recovered->size() << " chars from " << journal;
+  }
+  // ids are only unique within a session, so the recovered text is loaded
+  // afresh - and journaled afresh; the old journal stays until that is on
+  // disk
+  journal_.reset(new Journal(journal));
+  MakeCollaborator<IOCollaborator>(std::move(recovered));
+  compaction_thread_ = std::thread([this]() { RunCompaction(); });
 }
 
 Buffer::~Buffer() {
@@ -30,12 +47,16 @@ Buffer::~Buffer() {
   for (auto& t : collaborator_threads_) {
     t.join();
   }
+  compaction_thread_.join();
+  // a clean exit: nothing to recover
+  journal_->Discard();
 }
 
 void Buffer::AddCollaborator(AsyncCollaboratorPtr&& collaborator) {
   absl::MutexLock lock(&mu_);
   AsyncCollaborator* raw = collaborator.get();
   collaborators_.emplace_back(std::move(collaborator));
+  acked_versions_[raw] = version_;
   collaborator_threads_.emplace_back([this, raw]() {
     try {
       RunPull(raw);
@@ -58,6 +79,7 @@ void Buffer::AddCollaborator(SyncCollaboratorPtr&& collaborator) {
   absl::MutexLock lock(&mu_);
   SyncCollaborator* raw = collaborator.get();
   collaborators_.emplace_back(std::move(collaborator));
+  acked_versions_[raw] = version_;
   collaborator_threads_.emplace_back([this, raw]() {
     try {
       RunSync(raw);
@@ -103,8 +125,12 @@ EditNotification Buffer::NextNotification(Collaborator* collaborator,
         }
       } while (last_used_ != last_used_at_start && !state_.shutdown);
     }
+    const uint64_t base_version = *last_processed;
     *last_processed = version_;
+    notified_content_.emplace(version_, state_.content);
     EditNotification notification = state_;
+    notification.version = version_;
+    if (collaborator->wants_deltas()) AddDelta(base_version, &notification);
     collaborator->MarkRequest();
     mu_.Unlock();
     Log() << collaborator->name() << " notify";
@@ -117,6 +143,22 @@ EditNotification Buffer::NextNotification(Collaborator* collaborator,
   }
 }
 
+void Buffer::AddDelta(uint64_t base_version,
+                      EditNotification* notification) const {
+  // the history must reach back to the first version after base_version
+  if (base_version == 0 || history_.empty() ||
+      history_.front().first > base_version + 1) {
+    return;
+  }
+  notification->has_delta = true;
+  notification->base_version = base_version;
+  for (auto it = history_.rbegin();
+       it != history_.rend() && it->first > base_version; ++it) {
+    if (it->second) notification->delta.push_back(it->second);
+  }
+  std::reverse(notification->delta.begin(), notification->delta.end());
+}
+
 static bool HasUpdates(const EditResponse& response) {
   return response.become_loaded || response.referenced_file_changed ||
          !response.content.empty() || !response.token_types.empty() ||
@@ -129,27 +171,119 @@ static bool HasUpdates(const EditResponse& response) {
 template <class T>
 static void IntegrateState(T* state, const typename T::CommandBuf& commands) {
   for (const auto& cmd : commands) {
-    *state = state->Integrate(cmd);
+    *state = std::move(*state).Integrate(cmd);
   }
 }
 
+// below this many commands in a response, fanning out costs more than it saves
+static constexpr size_t kParallelIntegrateCommands = 4096;
+
+// version is bumped if the commands change state
+template <class T>
+static void AddIntegrateTask(T* state, uint64_t* version,
+                             const typename T::CommandBuf& commands,
+                             std::vector<std::function<void()>>* tasks,
+                             size_t* total) {
+  if (commands.empty()) return;
+  *total += commands.size();
+  tasks->emplace_back([state, version, &commands]() {
+    const T before = *state;
+    IntegrateState(state, commands);
+    if (!state->SameIdentity(before)) (*version)++;
+  });
+}
+
 void IntegrateResponse(const EditResponse& response, EditNotification* state) {
-  IntegrateState(&state->content, response.content);
-  IntegrateState(&state->token_types, response.token_types);
-  IntegrateState(&state->diagnostics, response.diagnostics);
-  IntegrateState(&state->diagnostic_ranges, response.diagnostic_ranges);
-  IntegrateState(&state->side_buffers, response.side_buffers);
-  IntegrateState(&state->side_buffer_refs, response.side_buffer_refs);
-  IntegrateState(&state->fixits, response.fixits);
-  IntegrateState(&state->referenced_files, response.referenced_files);
-  IntegrateState(&state->gutter_notes, response.gutter_notes);
-  IntegrateState(&state->cursors, response.cursors);
+  // the fields are independent persistent structures: integrate large
+  // responses a field per task
+  std::vector<std::function<void()>> tasks;
+  size_t total = 0;
+  AddIntegrateTask(&state->content, &state->field_versions.content,
+                   response.content, &tasks, &total);
+  AddIntegrateTask(&state->token_types, &state->field_versions.token_types,
+                   response.token_types, &tasks, &total);
+  AddIntegrateTask(&state->diagnostics, &state->field_versions.diagnostics,
+                   response.diagnostics, &tasks, &total);
+  AddIntegrateTask(&state->diagnostic_ranges,
+                   &state->field_versions.diagnostic_ranges,
+                   response.diagnostic_ranges, &tasks, &total);
+  AddIntegrateTask(&state->side_buffers, &state->field_versions.side_buffers,
+                   response.side_buffers, &tasks, &total);
+  AddIntegrateTask(&state->side_buffer_refs,
+                   &state->field_versions.side_buffer_refs,
+                   response.side_buffer_refs, &tasks, &total);
+  AddIntegrateTask(&state->fixits, &state->field_versions.fixits,
+                   response.fixits, &tasks, &total);
+  AddIntegrateTask(&state->referenced_files,
+                   &state->field_versions.referenced_files,
+                   response.referenced_files, &tasks, &total);
+  AddIntegrateTask(&state->gutter_notes, &state->field_versions.gutter_notes,
+                   response.gutter_notes, &tasks, &total);
+  AddIntegrateTask(&state->cursors, &state->field_versions.cursors,
+                   response.cursors, &tasks, &total);
+  if (tasks.size() > 1 && total >= kParallelIntegrateCommands) {
+    TaskPool::Default()->Run(std::move(tasks));
+  } else {
+    for (const auto& task : tasks) task();
+  }
   if (response.become_loaded) state->fully_loaded = true;
   if (response.referenced_file_changed) state->referenced_file_version++;
 }
 
+// the character at offset has data in effect
+template <class T>
+static void ExtendSpans(std::vector<AnnotationSpan<T>>* spans, size_t offset,
+                        const T& data) {
+  auto same = [](const T& a, const T& b) { return !(a < b) && !(b < a); };
+  if (same(data, T())) return;
+  if (!spans->empty() && spans->back().end == offset &&
+      same(spans->back().data, data)) {
+    spans->back().end++;
+    return;
+  }
+  spans->push_back(AnnotationSpan<T>{offset, offset + 1, data});
+}
+
+ViewportAnnotations EditNotification::Annotations(ID beg, ID end,
+                                                  ID focus) const {
+  ViewportAnnotations out;
+  AnnotationTracker<Tag> t_token(token_types);
+  AnnotationTracker<ID> t_diagnostic(diagnostic_ranges);
+  AnnotationTracker<SideBufferRef> t_side_buffer_ref(side_buffer_refs);
+  size_t offset = 0;
+  content.ForEachSpan(beg, end, [&](ID first, const char* chars, size_t n,
+                                    bool visible) {
+    t_token.EnterSpan(first, n);
+    t_diagnostic.EnterSpan(first, n);
+    t_side_buffer_ref.EnterSpan(first, n);
+    gutter_notes.ForEachValueInRange(
+        first, first.Offset(n), [&](ID at, const std::string& note) {
+          out.gutter_notes.emplace_back(
+              visible ? offset + (at.tick() - first.tick()) : offset, note);
+        });
+    for (size_t i = 0; i < n; i++) {
+      const ID id = first.Offset(i);
+      t_token.Enter(id);
+      t_diagnostic.Enter(id);
+      t_side_buffer_ref.Enter(id);
+      if (id == focus) {
+        out.focus_token = t_token.cur();
+        out.focus_diagnostic = t_diagnostic.cur();
+        out.focus_side_buffer_ref = t_side_buffer_ref.cur();
+      }
+      if (!visible) continue;
+      ExtendSpans(&out.tokens, offset, t_token.cur());
+      ExtendSpans(&out.diagnostics, offset, t_diagnostic.cur());
+      ExtendSpans(&out.side_buffer_refs, offset, t_side_buffer_ref.cur());
+      offset++;
+    }
+  });
+  return out;
+}
+
 void Buffer::UpdateState(Collaborator* collaborator, bool become_used,
-                         std::function<void(EditNotification& state)> f) {
+                         std::function<void(EditNotification& state)> f,
+                         std::shared_ptr<const EditResponse> response) {
   auto updatable = [this]() {
     mu_.AssertHeld();
     return !updating_;
@@ -168,6 +302,8 @@ void Buffer::UpdateState(Collaborator* collaborator, bool become_used,
   mu_.Lock();
   updating_ = false;
   version_++;
+  history_.emplace_back(version_, std::move(response));
+  if (history_.size() > kHistoryVersions) history_.pop_front();
   declared_no_edit_collaborators_ = done_collaborators_;
   state_ = state;
   if (become_used) {
@@ -177,17 +313,22 @@ void Buffer::UpdateState(Collaborator* collaborator, bool become_used,
 }
 
 void Buffer::SinkResponse(Collaborator* collaborator,
-                          const EditResponse& response) {
+                          EditResponse response) {
+  const bool done = response.done;
   {
     absl::MutexLock lock(&mu_);
     collaborator->MarkResponse();
   }
 
   if (HasUpdates(response)) {
-    UpdateState(collaborator, response.become_used, [&](EditNotification& state) {
-      Log() << collaborator->name() << " integrating";
-      IntegrateResponse(response, &state);
-    });
+    auto integrated = std::make_shared<const EditResponse>(std::move(response));
+    UpdateState(collaborator, integrated->become_used,
+                [&](EditNotification& state) {
+                  Log() << collaborator->name() << " integrating";
+                  IntegrateResponse(*integrated, &state);
+                  journal_->Append(integrated->content);
+                },
+                integrated);
   } else {
     Log() << collaborator->name() << " gives an empty update";
     absl::MutexLock lock(&mu_);
@@ -197,9 +338,11 @@ void Buffer::SinkResponse(Collaborator* collaborator,
     declared_no_edit_collaborators_.insert(collaborator);
   }
 
-  if (response.done) {
+  if (done) {
     absl::MutexLock lock(&mu_);
     done_collaborators_.insert(collaborator);
+    // it will never edit again: don't hold up shutdown waiting for it
+    declared_no_edit_collaborators_.insert(collaborator);
     throw Shutdown();
   }
 }
@@ -209,6 +352,8 @@ void Buffer::RunPush(AsyncCollaborator* collaborator) {
   try {
     for (;;) {
       collaborator->Push(NextNotification(collaborator, &processed_version));
+      absl::MutexLock lock(&mu_);
+      pushed_versions_[collaborator] = processed_version;
     }
   } catch (Shutdown) {
     return;
@@ -218,7 +363,13 @@ void Buffer::RunPush(AsyncCollaborator* collaborator) {
 void Buffer::RunPull(AsyncCollaborator* collaborator) {
   try {
     for (;;) {
+      uint64_t pushed_version;
+      {
+        absl::MutexLock lock(&mu_);
+        pushed_version = pushed_versions_[collaborator];
+      }
       SinkResponse(collaborator, collaborator->Pull());
+      Acknowledge(collaborator, pushed_version);
     }
   } catch (Shutdown) {
     return;
@@ -231,12 +382,82 @@ void Buffer::RunSync(SyncCollaborator* collaborator) {
     for (;;) {
       SinkResponse(collaborator, collaborator->Edit(NextNotification(
                                      collaborator, &processed_version)));
+      Acknowledge(collaborator, processed_version);
     }
   } catch (Shutdown) {
     return;
   }
 }
 
+void Buffer::Acknowledge(Collaborator* collaborator, uint64_t version) {
+  absl::MutexLock lock(&mu_);
+  acked_versions_[collaborator] = version;
+  notified_content_.erase(notified_content_.begin(),
+                          notified_content_.lower_bound(AckedVersion()));
+}
+
+uint64_t Buffer::AckedVersion() const {
+  uint64_t version = version_;
+  for (const auto& a : acked_versions_) {
+    if (done_collaborators_.count(a.first) == 0) {
+      version = std::min(version, a.second);
+    }
+  }
+  return version;
+}
+
+void Buffer::RunCompaction() {
+  uint64_t compacted_version = 0;
+  auto compactable = [&]() {
+    mu_.AssertHeld();
+    return state_.shutdown || (AckedVersion() > compacted_version &&
+                               state_.content.Tombstones() > 0);
+  };
+  auto updatable = [this]() {
+    mu_.AssertHeld();
+    return !updating_;
+  };
+  for (;;) {
+    mu_.LockWhen(absl::Condition(&compactable));
+    if (state_.shutdown) {
+      mu_.Unlock();
+      return;
+    }
+    compacted_version = AckedVersion();
+    auto acked = notified_content_.find(compacted_version);
+    if (acked == notified_content_.end()) {
+      mu_.Unlock();
+      continue;
+    }
+    const String acked_content = acked->second;
+    const String content = state_.content;
+    mu_.Unlock();
+
+    // find tombstones off the editing path...
+    const String::PurgeList runs = content.PurgeableRuns(acked_content);
+    if (!runs.empty()) {
+      // ...and drop them from the latest content under the update lock;
+      // the document is unchanged, so no new version for collaborators
+      mu_.LockWhen(absl::Condition(&updatable));
+      updating_ = true;
+      String latest = state_.content;
+      mu_.Unlock();
+      latest = latest.Purge(runs);
+      // in turn with the commands journaled under the same lock
+      journal_->AppendPurge(runs);
+      mu_.Lock();
+      updating_ = false;
+      state_.content = latest;
+      mu_.Unlock();
+      Log() << "compacted " << runs.size() << " tombstone runs";
+    }
+
+    mu_.Lock();
+    mu_.AwaitWithTimeout(absl::Condition(&state_.shutdown), absl::Seconds(1));
+    mu_.Unlock();
+  }
+}
+
 std::vector<std::string> Buffer::ProfileData() const {
   absl::MutexLock lock(&mu_);
   std::vector<std::string> out;
@@ -246,6 +467,14 @@ std::vector<std::string> Buffer::ProfileData() const {
     out.emplace_back(absl::StrCat("  rsp:", absl::FormatTime(c->last_response())));
     out.emplace_back(absl::StrCat("  req:", absl::FormatTime(c->last_request())));
   }
+  const size_t dead = state_.content.Tombstones();
+  const size_t stored = dead + state_.content.Length();
+  out.emplace_back(absl::StrCat("tombstones: ", dead, "/", stored, " (",
+                                stored ? dead * 100 / stored : 0, "%)"));
+  out.emplace_back(absl::StrCat("journal: ", journal_->bytes_written(),
+                                " bytes"));
+  out.emplace_back(absl::StrCat("reclaim queue: ",
+                                Reclaimer::Get()->queue_depth(), " subtrees"));
   return out;
 }
 
@@ -13,11 +13,15 @@
 // limitations under the License.
 #pragma once
 
+#include <deque>
+#include <map>
+#include <memory>
 #include <thread>
 #include "absl/synchronization/mutex.h"
 #include "absl/time/clock.h"
 #include "absl/types/any.h"
 #include "diagnostic.h"
+#include "journal.h"
 #include "selector.h"
 #include "side_buffer.h"
 #include "umap.h"
@@ -26,6 +30,7 @@
 
 template <class T>
 struct Annotation {
+  Annotation() = default;
   Annotation(ID e, T&& d) : end(e), data(std::move(d)) {}
   Annotation(ID e, const T& d) : end(e), data(d) {}
   ID end;
@@ -35,21 +40,48 @@ struct Annotation {
   }
 };
 
+template <class T>
+void Fingerprint(Fingerprinter* f, const Annotation<T>& annotation) {
+  Fingerprint(f, annotation.end);
+  Fingerprint(f, annotation.data);
+}
+
 template <class T>
 using AnnotationMap = UMap<ID, Annotation<T>>;
 
+// Follows the annotations in effect along a walk through the document, made
+// a span of consecutive ids at a time (String::ForEachSpan): the annotations
+// beginning in a span are one key range of the map, so they are found with a
+// range query per span rather than a lookup per character.
 template <class T>
 class AnnotationTracker {
  public:
   AnnotationTracker(const AnnotationMap<T>& map) : map_(map) {}
 
+  // the walk reached the n ids from first
+  void EnterSpan(ID first, size_t n) {
+    starts_.clear();
+    next_start_ = 0;
+    map_.ForEachValueInRange(
+        first, first.Offset(n),
+        [&](ID begin, const Annotation<T>& ann) {
+          starts_.emplace_back(begin, ann);
+        });
+  }
+
+  // the walk reached id, in the span last entered
   void Enter(ID id) {
-    active_.erase(
-        std::remove_if(active_.begin(), active_.end(),
-                       [id](const Annotation<T>& a) { return id == a.end; }),
-        active_.end());
-    map_.ForEachValue(
-        id, [&](const Annotation<T>& ann) { active_.push_back(ann); });
+    if (!active_.empty()) {
+      active_.erase(std::remove_if(
+                        active_.begin(), active_.end(),
+                        [id](const Annotation<T>& a) { return id == a.end; }),
+                    active_.end());
+    }
+    // ids in a span increase, as do the keys of starts_
+    for (; next_start_ < starts_.size() && starts_[next_start_].first == id;
+         next_start_++) {
+      active_.push_back(starts_[next_start_].second);
+    }
   }
 
   T cur() {
@@ -60,6 +92,9 @@ class AnnotationTracker {
  private:
   AnnotationMap<T> map_;
   std::vector<Annotation<T>> active_;
+  // annotations beginning in the span last entered, by id
+  std::vector<std::pair<ID, Annotation<T>>> starts_;
+  size_t next_start_ = 0;
 };
 
 struct SideBufferRef {
@@ -71,6 +106,53 @@ struct SideBufferRef {
   }
 };
 
+inline void Fingerprint(Fingerprinter* f, const SideBufferRef& ref) {
+  Fingerprint(f, ref.name);
+  Fingerprint(f, ref.lines);
+}
+
+// an annotation resolved onto a stretch of the document: in effect from
+// visible offset begin up to but excluding end, counted from the stretch start
+template <class T>
+struct AnnotationSpan {
+  size_t begin;
+  size_t end;
+  T data;
+};
+
+// the annotations in effect over a stretch of the document (say the lines a
+// renderer shows), each field sorted by offset with spans not overlapping;
+// where no annotation is in effect there is no span
+struct ViewportAnnotations {
+  std::vector<AnnotationSpan<Tag>> tokens;
+  std::vector<AnnotationSpan<ID>> diagnostics;
+  std::vector<AnnotationSpan<SideBufferRef>> side_buffer_refs;
+  // by the offset of the character they are attached at (or the next visible
+  // one)
+  std::vector<std::pair<size_t, std::string>> gutter_notes;
+  // in effect at the focus id asked for, which need not be visible
+  Tag focus_token;
+  ID focus_diagnostic;
+  SideBufferRef focus_side_buffer_ref;
+};
+
+// reads the data in effect from a span list, at offsets that never decrease
+template <class T>
+class SpanReader {
+ public:
+  SpanReader(const std::vector<AnnotationSpan<T>>& spans) : spans_(spans) {}
+
+  T At(size_t offset) {
+    while (next_ < spans_.size() && spans_[next_].end <= offset) next_++;
+    if (next_ == spans_.size() || spans_[next_].begin > offset) return T();
+    return spans_[next_].data;
+  }
+
+ private:
+  const std::vector<AnnotationSpan<T>>& spans_;
+  size_t next_ = 0;
+};
+
 template <template <class Type> class TypeTranslator>
 struct EditState {
   TypeTranslator<String> content;
@@ -88,10 +170,32 @@ struct EditState {
 template <class T>
 using NotifTrans = T;
 
+template <class T>
+using VersionTrans = uint64_t;
+
+struct EditResponse;
+
 struct EditNotification : public EditState<NotifTrans> {
   bool fully_loaded = false;
   bool shutdown = false;
   uint64_t referenced_file_version = 0;
+  // the buffer version this state is
+  uint64_t version = 0;
+  // per field, bumped by each integrated response that changes it: a field
+  // whose version is unchanged since the last notification can be skipped
+  EditState<VersionTrans> field_versions{};
+  // For collaborators that asked for them (Collaborator::RequestDeltas): the
+  // responses integrated since base_version, the version last sent to this
+  // collaborator, oldest first. Without has_delta (the first notification,
+  // or the collaborator fell behind the history kept) the state must be
+  // treated as new.
+  bool has_delta = false;
+  uint64_t base_version = 0;
+  std::vector<std::shared_ptr<const EditResponse>> delta;
+
+  // the annotations over the characters from beg up to but excluding end,
+  // gathered in one walk (that also passes focus, say a cursor)
+  ViewportAnnotations Annotations(ID beg, ID end, ID focus = ID()) const;
 };
 
 template <class T>
@@ -124,10 +228,15 @@ class Collaborator {
   const absl::Time& last_request() const { return last_request_; }
   const absl::Time& last_change() const { return last_change_; }
 
+  bool wants_deltas() const { return wants_deltas_; }
+
  protected:
   Collaborator(const char* name, absl::Duration push_delay_from_idle, absl::Duration push_delay_from_start)
       : name_(name), push_delay_from_idle_(push_delay_from_idle), push_delay_from_start_(push_delay_from_start) {}
 
+  // have notifications carry the responses integrated since the last one
+  void RequestDeltas() { wants_deltas_ = true; }
+
  private:
   const char* const name_;
   const absl::Duration push_delay_from_idle_;
@@ -136,11 +245,16 @@ class Collaborator {
   absl::Time last_request_ = absl::Now();
   absl::Time last_change_ = absl::Now();
   absl::Duration last_notify_ = absl::Seconds(0);
+  bool wants_deltas_ = false;
   Site site_;
 };
 
 typedef std::unique_ptr<Collaborator> CollaboratorPtr;
 
+// Edits made after Pull returns must be based on the notifications pushed
+// before it was called, or newer ones: tombstones removed before those may
+// be compacted away, leaving inserts next to them placed by their surviving
+// neighbours.
 class AsyncCollaborator : public Collaborator {
  public:
   virtual void Push(const EditNotification& notification) = 0;
@@ -189,14 +303,25 @@ class Buffer {
 
   EditNotification NextNotification(Collaborator* collaborator,
                                     uint64_t* last_processed);
-  void SinkResponse(Collaborator* collaborator, const EditResponse& response);
+  void SinkResponse(Collaborator* collaborator, EditResponse response);
 
   void RunPush(AsyncCollaborator* collaborator);
   void RunPull(AsyncCollaborator* collaborator);
   void RunSync(SyncCollaborator* collaborator);
 
+  // response: what f integrates, for delta notifications
   void UpdateState(Collaborator* collaborator, bool become_used,
-                   std::function<void(EditNotification& new_state)>);
+                   std::function<void(EditNotification& new_state)>,
+                   std::shared_ptr<const EditResponse> response = nullptr);
+  void AddDelta(uint64_t base_version, EditNotification* notification) const
+      EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  // tombstone compaction: tombstones already removed in the content of
+  // AckedVersion() are dropped from the document; ids of them that commands
+  // or other fields still hold are forwarded to surviving neighbours
+  void Acknowledge(Collaborator* collaborator, uint64_t version);
+  uint64_t AckedVersion() const EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  void RunCompaction();
 
 mutable  absl::Mutex mu_;
   uint64_t version_ GUARDED_BY(mu_);
@@ -208,4 +333,18 @@ mutable  absl::Mutex mu_;
   EditNotification state_ GUARDED_BY(mu_);
   std::vector<CollaboratorPtr> collaborators_ GUARDED_BY(mu_);
   std::vector<std::thread> collaborator_threads_ GUARDED_BY(mu_);
+  // oldest version each collaborator may still base edits on
+  std::map<Collaborator*, uint64_t> acked_versions_ GUARDED_BY(mu_);
+  // last version pushed to each async collaborator
+  std::map<Collaborator*, uint64_t> pushed_versions_ GUARDED_BY(mu_);
+  // notified content of versions from AckedVersion() on
+  std::map<uint64_t, String> notified_content_ GUARDED_BY(mu_);
+  std::thread compaction_thread_;
+  // the response integrated to make each of the last kHistoryVersions
+  // versions, oldest first; null where a version integrated none
+  static constexpr size_t kHistoryVersions = 256;
+  std::deque<std::pair<uint64_t, std::shared_ptr<const EditResponse>>>
+      history_ GUARDED_BY(mu_);
+  // content commands, in the order they were integrated
+  std::unique_ptr<Journal> journal_;
 };
@@ -12,6 +12,302 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "buffer.h"
+#include <algorithm>
+#include <string>
+#include <vector>
 #include "gtest/gtest.h"
+#include "temp_file.h"
 
-TEST(Buffer, NoOp) { Buffer b; }
+TEST(Buffer, NoOp) {
+  NamedTempFile tmp;
+  Buffer b(tmp.filename());
+}
+
+TEST(EditNotification, Annotations) {
+  Site site;
+  EditNotification state;
+  EditResponse r;
+  String::MakeRawInsert(&r.content, &site, "int x;\nint y;\n",
+                        String::Begin(), String::End());
+  IntegrateResponse(r, &state);
+  const String& content = state.content;
+
+  r = EditResponse();
+  // a token cut by a removal, and one nested in it
+  AnnotationMap<Tag>::MakeInsert(
+      &r.token_types, &site, content.IDAtOffset(0),
+      Annotation<Tag>(content.IDAtOffset(5), Tag().Push("line")));
+  AnnotationMap<Tag>::MakeInsert(
+      &r.token_types, &site, content.IDAtOffset(4),
+      Annotation<Tag>(content.IDAtOffset(5), Tag().Push("x")));
+  AnnotationMap<ID>::MakeInsert(
+      &r.diagnostic_ranges, &site, content.IDAtOffset(11),
+      Annotation<ID>(content.IDAtOffset(12), content.IDAtOffset(11)));
+  UMap<ID, std::string>::MakeInsert(&r.gutter_notes, &site,
+                                    content.IDAtOffset(8), "note");
+  AnnotationMap<SideBufferRef>::MakeInsert(
+      &r.side_buffer_refs, &site, String::Begin(),
+      Annotation<SideBufferRef>(String::End(), SideBufferRef{"disasm", {0}}));
+  content.MakeRemove(&r.content, content.IDAtOffset(1),
+                     content.IDAtOffset(3));
+  IntegrateResponse(r, &state);
+  ASSERT_EQ(state.content.Render(), "i x;\nint y;\n");
+
+  const ViewportAnnotations a =
+      state.Annotations(String::Begin(), String::End(), String::Begin());
+  ASSERT_EQ(a.tokens.size(), 2u);
+  EXPECT_EQ(a.tokens[0].begin, 0u);
+  EXPECT_EQ(a.tokens[0].end, 2u);
+  EXPECT_EQ(a.tokens[0].data.Head(), "line");
+  EXPECT_EQ(a.tokens[1].begin, 2u);
+  EXPECT_EQ(a.tokens[1].end, 3u);
+  EXPECT_EQ(a.tokens[1].data.Head(), "x");
+  ASSERT_EQ(a.diagnostics.size(), 1u);
+  EXPECT_EQ(a.diagnostics[0].begin, 9u);
+  EXPECT_EQ(a.diagnostics[0].end, 10u);
+  ASSERT_EQ(a.gutter_notes.size(), 1u);
+  EXPECT_EQ(a.gutter_notes[0].first, 6u);
+  ASSERT_EQ(a.side_buffer_refs.size(), 1u);
+  EXPECT_EQ(a.side_buffer_refs[0].begin, 0u);
+  EXPECT_EQ(a.side_buffer_refs[0].end, 12u);
+  EXPECT_EQ(a.focus_side_buffer_ref.name, "disasm");
+  EXPECT_TRUE(a.focus_token.Empty());
+
+  SpanReader<Tag> tokens(a.tokens);
+  EXPECT_EQ(tokens.At(1).Head(), "line");
+  EXPECT_EQ(tokens.At(2).Head(), "x");
+  EXPECT_TRUE(tokens.At(3).Empty());
+}
+
+TEST(EditNotification, FieldVersions) {
+  Site site;
+  EditNotification state;
+  EditResponse r;
+  String::MakeRawInsert(&r.content, &site, "int x;\n", String::Begin(),
+                        String::End());
+  IntegrateResponse(r, &state);
+  EXPECT_EQ(state.field_versions.content, 1u);
+  EXPECT_EQ(state.field_versions.token_types, 0u);
+
+  r = EditResponse();
+  AnnotationMap<Tag>::MakeInsert(
+      &r.token_types, &site, state.content.IDAtOffset(0),
+      Annotation<Tag>(state.content.IDAtOffset(3), Tag().Push("keyword")));
+  IntegrateResponse(r, &state);
+  EXPECT_EQ(state.field_versions.content, 1u);
+  EXPECT_EQ(state.field_versions.token_types, 1u);
+  EXPECT_EQ(state.field_versions.cursors, 0u);
+
+  IntegrateResponse(EditResponse(), &state);
+  EXPECT_EQ(state.field_versions.content, 1u);
+  EXPECT_EQ(state.field_versions.token_types, 1u);
+
+  // removing what is already gone changes nothing
+  r = EditResponse();
+  state.content.MakeRemove(&r.content, state.content.IDAtOffset(0));
+  IntegrateResponse(r, &state);
+  EXPECT_EQ(state.field_versions.content, 2u);
+  IntegrateResponse(r, &state);
+  EXPECT_EQ(state.field_versions.content, 2u);
+  EXPECT_EQ(state.field_versions.token_types, 1u);
+}
+
+namespace {
+
+// publishes a gutter note per response, numbered in order, as asked
+class Typist final : public AsyncCollaborator {
+ public:
+  Typist(const Buffer*)
+      : AsyncCollaborator("typist", absl::Seconds(0), absl::Seconds(0)) {}
+
+  void Type(int n) {
+    absl::MutexLock lock(&mu_);
+    queued_ += n;
+  }
+  void Stop() {
+    absl::MutexLock lock(&mu_);
+    stop_ = true;
+  }
+  // until a notification carried the first n notes
+  void AwaitSeen(uint64_t n) {
+    auto seen = [this, n]() {
+      mu_.AssertHeld();
+      return seen_ >= n;
+    };
+    mu_.LockWhen(absl::Condition(&seen));
+    mu_.Unlock();
+  }
+
+  void Push(const EditNotification& notification) override {
+    uint64_t notes = 0;
+    notification.gutter_notes.ForEach(
+        [&](ID, const ID&, const std::string&) { notes++; });
+    absl::MutexLock lock(&mu_);
+    seen_ = notes;
+  }
+  EditResponse Pull() override {
+    auto ready = [this]() {
+      mu_.AssertHeld();
+      return stop_ || queued_ > 0;
+    };
+    mu_.LockWhen(absl::Condition(&ready));
+    EditResponse r;
+    if (queued_ > 0) {
+      queued_--;
+      UMap<ID, std::string>::MakeInsert(&r.gutter_notes, site(),
+                                        String::Begin(),
+                                        std::to_string(++typed_));
+    } else {
+      r.done = true;
+    }
+    mu_.Unlock();
+    return r;
+  }
+
+ private:
+  absl::Mutex mu_;
+  int queued_ GUARDED_BY(mu_) = 0;
+  int typed_ GUARDED_BY(mu_) = 0;
+  uint64_t seen_ GUARDED_BY(mu_) = 0;
+  bool stop_ GUARDED_BY(mu_) = false;
+};
+
+// what each notification carried
+struct Received {
+  uint64_t version;
+  bool has_delta;
+  uint64_t base_version;
+  // the notes the delta added, in order
+  std::vector<int> notes;
+  // the last note in the state
+  int last_note;
+};
+
+class Recorder final : public SyncCollaborator {
+ public:
+  // held: the first notification is not answered until Release
+  Recorder(const Buffer*, bool held)
+      : SyncCollaborator("recorder", absl::Seconds(0), absl::Seconds(0)),
+        held_(held) {
+    RequestDeltas();
+  }
+
+  void Release() {
+    absl::MutexLock lock(&mu_);
+    held_ = false;
+  }
+  // until a notification carried note n
+  void AwaitNote(int n) {
+    auto seen = [this, n]() {
+      mu_.AssertHeld();
+      return last_note_ >= n;
+    };
+    mu_.LockWhen(absl::Condition(&seen));
+    mu_.Unlock();
+  }
+  // until n notifications arrived
+  void AwaitReceived(size_t n) {
+    auto arrived = [this, n]() {
+      mu_.AssertHeld();
+      return received_.size() >= n;
+    };
+    mu_.LockWhen(absl::Condition(&arrived));
+    mu_.Unlock();
+  }
+  std::vector<Received> received() {
+    absl::MutexLock lock(&mu_);
+    return received_;
+  }
+
+  EditResponse Edit(const EditNotification& notification) override {
+    Received r{notification.version, notification.has_delta,
+               notification.base_version, {}, 0};
+    for (const auto& response : notification.delta) {
+      for (const auto& cmd : response->gutter_notes) {
+        r.notes.push_back(std::stoi(response->gutter_notes.payload()
+                                        [cmd.op().index].second));
+      }
+    }
+    int last_note = 0;
+    notification.gutter_notes.ForEach(
+        [&](ID, const ID&, const std::string& note) {
+          last_note = std::max(last_note, std::stoi(note));
+        });
+    auto released = [this]() {
+      mu_.AssertHeld();
+      return !held_;
+    };
+    r.last_note = last_note;
+    mu_.Lock();
+    received_.push_back(r);
+    last_note_ = last_note;
+    mu_.Await(absl::Condition(&released));
+    mu_.Unlock();
+    EditResponse response;
+    response.done = notification.shutdown;
+    return response;
+  }
+
+ private:
+  absl::Mutex mu_;
+  bool held_ GUARDED_BY(mu_);
+  int last_note_ GUARDED_BY(mu_) = 0;
+  std::vector<Received> received_ GUARDED_BY(mu_);
+};
+
+}  // namespace
+
+TEST(Buffer, DeltasArriveInOrder) {
+  NamedTempFile tmp;
+  Buffer buffer(tmp.filename());
+  Recorder* recorder = buffer.MakeCollaborator<Recorder>(false);
+  Typist* typist = buffer.MakeCollaborator<Typist>();
+  typist->Type(50);
+  recorder->AwaitNote(50);
+  typist->Stop();
+
+  const std::vector<Received> received = recorder->received();
+  ASSERT_FALSE(received.empty());
+  // nothing came before the first
+  EXPECT_FALSE(received[0].has_delta);
+  std::vector<int> notes;
+  for (size_t i = 1; i < received.size(); i++) {
+    EXPECT_TRUE(received[i].has_delta);
+    EXPECT_EQ(received[i].base_version, received[i - 1].version);
+    EXPECT_GT(received[i].version, received[i].base_version);
+    notes.insert(notes.end(), received[i].notes.begin(),
+                 received[i].notes.end());
+  }
+  // every response since the first once, in the order integrated
+  ASSERT_EQ(received[0].last_note + notes.size(), 50u);
+  for (size_t i = 0; i < notes.size(); i++) {
+    EXPECT_EQ(notes[i], received[0].last_note + i + 1);
+  }
+}
+
+TEST(Buffer, LaggingPastHistoryGetsFullState) {
+  NamedTempFile tmp;
+  Buffer buffer(tmp.filename());
+  Recorder* recorder = buffer.MakeCollaborator<Recorder>(true);
+  Typist* typist = buffer.MakeCollaborator<Typist>();
+  // more versions than the buffer keeps history for, while the recorder is
+  // held on its first notification
+  recorder->AwaitReceived(1);
+  typist->Type(300);
+  typist->AwaitSeen(300);
+  recorder->Release();
+  recorder->AwaitNote(300);
+  typist->Type(1);
+  recorder->AwaitNote(301);
+  typist->Stop();
+
+  const std::vector<Received> received = recorder->received();
+  ASSERT_GE(received.size(), 3u);
+  EXPECT_FALSE(received[0].has_delta);
+  // fell behind: no delta, the state is new
+  EXPECT_FALSE(received[1].has_delta);
+  EXPECT_TRUE(received[1].notes.empty());
+  // and caught up again
+  EXPECT_TRUE(received.back().has_delta);
+  EXPECT_EQ(received.back().notes, std::vector<int>{301});
+}
@@ -57,32 +57,17 @@ EditResponse ClangFormatCollaborator::Edit(
                                        replacement.child_value()});
   }
 
-  int n = 0;
-  String::Iterator it(str, String::Begin());
-  it.MoveNext();
+  // replacement offsets all refer to the original text
   for (auto r : replacements) {
     Log() << "REPLACE: " << r.offset << "+" << r.length << " with '" << r.text
-          << "' starting from " << n;
-    for (; n < r.offset; n++) {
-      it.MoveNext();
-    }
-    auto refresh_it = [&]() {
-      ID curid = it.id();
-      str = str.Integrate(response.content.back());
-      it = String::Iterator(str, curid);
-    };
-    for (int i = 0; i < r.length; i++) {
-      auto del = it.id();
-      it.MoveNext();
-      n++;
-      str.MakeRemove(&response.content, del);
-      refresh_it();
-    }
-    auto after = it.Prev().id();
-    for (const char* p = r.text; *p; ++p) {
-      after = str.MakeInsert(&response.content, site(), *p, after);
-      refresh_it();
+          << "'";
+    ID del_begin = str.IDAtOffset(r.offset);
+    if (r.length > 0) {
+      str.MakeRemove(&response.content, del_begin,
+                     str.IDAtOffset(r.offset + r.length));
     }
+    ID after = r.offset == 0 ? String::Begin() : str.IDAtOffset(r.offset - 1);
+    String::MakeRawInsert(&response.content, site(), r.text, after, del_begin);
   }
 
   return response;
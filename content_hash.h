@@ -0,0 +1,108 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// 128-bit hash of a character sequence that composes: the hash of a
+// concatenation follows from the hashes of its parts, so a persistent map can
+// keep it as a subtree summary and equal text hashes equally whatever the
+// tree shape or run boundaries.
+// Two polynomial hashes modulo the Mersenne prime 2^61-1 with fixed bases, so
+// hashes are stable across runs and usable as persistent cache keys.
+class ContentHash {
+ public:
+  // the empty sequence
+  ContentHash() : h_{0, 0}, pow_{1, 1} {}
+
+  static ContentHash Of(const char* s, size_t n) {
+    ContentHash h;
+    for (size_t i = 0; i < n; i++) {
+      const uint64_t c = static_cast<unsigned char>(s[i]) + 1;
+      for (int k = 0; k < 2; k++) h.h_[k] = Add(Mul(h.h_[k], Base(k)), c);
+    }
+    for (int k = 0; k < 2; k++) h.pow_[k] = Pow(k, n);
+    return h;
+  }
+  static ContentHash Of(const std::string& s) { return Of(s.data(), s.size()); }
+
+  // hash of this sequence followed by other
+  ContentHash operator+(const ContentHash& other) const {
+    ContentHash h;
+    for (int k = 0; k < 2; k++) {
+      h.h_[k] = Add(Mul(h_[k], other.pow_[k]), other.h_[k]);
+      h.pow_[k] = Mul(pow_[k], other.pow_[k]);
+    }
+    return h;
+  }
+
+  uint64_t hi() const { return h_[0]; }
+  uint64_t lo() const { return h_[1]; }
+
+  bool operator==(const ContentHash& other) const {
+    return h_[0] == other.h_[0] && h_[1] == other.h_[1] &&
+           pow_[0] == other.pow_[0];
+  }
+  bool operator!=(const ContentHash& other) const { return !(*this == other); }
+  bool operator<(const ContentHash& other) const {
+    return h_[0] < other.h_[0] ||
+           (h_[0] == other.h_[0] &&
+            (h_[1] < other.h_[1] ||
+             (h_[1] == other.h_[1] && pow_[0] < other.pow_[0])));
+  }
+
+ private:
+  static constexpr uint64_t kMod = (uint64_t(1) << 61) - 1;
+  static uint64_t Base(int k) {
+    return k == 0 ? 0x1f3d5b79a2c4e6f1 % kMod : 0x0b7e151628aed2a7 % kMod;
+  }
+
+  // base^n: tabulated for short sequences (runs are short)
+  static uint64_t Pow(int k, size_t n) {
+    static constexpr size_t kTabulated = 128;
+    struct Table {
+      Table() {
+        for (int k = 0; k < 2; k++) {
+          pow[k][0] = 1;
+          for (size_t i = 1; i < kTabulated; i++) {
+            pow[k][i] = Mul(pow[k][i - 1], Base(k));
+          }
+        }
+      }
+      uint64_t pow[2][kTabulated];
+    };
+    static const Table table;
+    if (n < kTabulated) return table.pow[k][n];
+    uint64_t r = 1;
+    for (uint64_t b = Base(k); n; n >>= 1, b = Mul(b, b)) {
+      if (n & 1) r = Mul(r, b);
+    }
+    return r;
+  }
+
+  static uint64_t Add(uint64_t a, uint64_t b) {
+    uint64_t r = a + b;
+    return r >= kMod ? r - kMod : r;
+  }
+  static uint64_t Mul(uint64_t a, uint64_t b) {
+    const unsigned __int128 p = static_cast<unsigned __int128>(a) * b;
+    return Add(static_cast<uint64_t>(p & kMod), static_cast<uint64_t>(p >> 61));
+  }
+
+  // hash and base^length, per base
+  uint64_t h_[2];
+  uint64_t pow_[2];
+};
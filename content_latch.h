@@ -21,21 +21,34 @@ class ContentLatch {
   ContentLatch(bool consumes_dependents)
       : consumes_dependents_(consumes_dependents) {}
 
+  // true if the content is not the one seen by the last call
   bool IsNewContent(const EditNotification& notification) {
-    if (notification.content.SameIdentity(last_str_)) {
-      if (!consumes_dependents_) {
-        return false;
-      } else if (last_deps_ == notification.referenced_file_version) {
-        return false;
-      }
+    const bool same_deps =
+        !consumes_dependents_ ||
+        last_deps_ == notification.referenced_file_version;
+    if (notification.content.SameIdentity(last_str_) && same_deps) {
+      text_changed_ = false;
+      return false;
     }
+    const ContentHash hash = notification.content.Hash();
+    text_changed_ = !seen_ || !same_deps || hash != last_hash_;
+    seen_ = true;
     last_str_ = notification.content;
+    last_hash_ = hash;
     last_deps_ = notification.referenced_file_version;
     return true;
   }
 
+  // whether the last call saw new text (or referenced files): if not, only
+  // the ids changed, and results derived from the text alone can be reused
+  // once re-keyed by the new ids
+  bool text_changed() const { return text_changed_; }
+
  private:
   const bool consumes_dependents_;
+  bool seen_ = false;
+  bool text_changed_ = false;
   String last_str_;
+  ContentHash last_hash_;
   uint64_t last_deps_ = 0;
 };
@@ -0,0 +1,85 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "crdt.h"
+#include <map>
+#include <stdexcept>
+#include "absl/synchronization/mutex.h"
+
+std::atomic<uint64_t> Site::id_gen_{1};
+constexpr int ID::kClockBits;
+constexpr uint64_t ID::kClockMask;
+constexpr uint32_t SiteTable::kMaxEntries;
+constexpr uint32_t SiteTable::kChunkEntries;
+
+struct SiteTable::Table {
+  Table() {
+    for (auto& chunk : chunks) chunk.store(nullptr, std::memory_order_relaxed);
+    Add(0, 0);
+  }
+
+  uint32_t Add(uint64_t site, uint64_t epoch) EXCLUSIVE_LOCKS_REQUIRED(mu) {
+    const uint32_t entry = size.load(std::memory_order_relaxed);
+    if (entry == kMaxEntries) throw std::overflow_error("site table full");
+    std::atomic<Entry*>& slot = chunks[entry / kChunkEntries];
+    Entry* chunk = slot.load(std::memory_order_relaxed);
+    if (chunk == nullptr) chunk = new Entry[kChunkEntries];
+    chunk[entry % kChunkEntries] = Entry{site, epoch};
+    slot.store(chunk, std::memory_order_release);
+    size.store(entry + 1, std::memory_order_release);
+    index.emplace(std::make_pair(site, epoch), entry);
+    return entry;
+  }
+
+  absl::Mutex mu;
+  std::map<std::pair<uint64_t, uint64_t>, uint32_t> index GUARDED_BY(mu);
+  std::atomic<uint32_t> size{0};
+  std::atomic<Entry*> chunks[kMaxEntries / kChunkEntries];
+};
+
+SiteTable::Table& SiteTable::table() {
+  static Table* t = new Table;
+  return *t;
+}
+
+uint32_t SiteTable::Intern(uint64_t site, uint64_t epoch) {
+  // ids are decoded in runs from the same site: skip the lock for those
+  static thread_local Entry last{0, 0};
+  static thread_local uint32_t last_entry = 0;
+  if (last.site == site && last.epoch == epoch) return last_entry;
+  Table& t = table();
+  absl::MutexLock lock(&t.mu);
+  auto it = t.index.find(std::make_pair(site, epoch));
+  last = Entry{site, epoch};
+  last_entry = it != t.index.end() ? it->second : t.Add(site, epoch);
+  return last_entry;
+}
+
+bool SiteTable::Find(uint64_t site, uint64_t epoch, uint32_t* entry) {
+  Table& t = table();
+  absl::MutexLock lock(&t.mu);
+  auto it = t.index.find(std::make_pair(site, epoch));
+  if (it == t.index.end()) return false;
+  *entry = it->second;
+  return true;
+}
+
+uint32_t SiteTable::Size() {
+  return table().size.load(std::memory_order_acquire);
+}
+
+const SiteTable::Entry& SiteTable::Get(uint32_t entry) {
+  // ids reach readers after their entries were added, so the chunk is there
+  return table().chunks[entry / kChunkEntries].load(
+      std::memory_order_acquire)[entry % kChunkEntries];
+}
@@ -13,14 +13,113 @@
 // limitations under the License.
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
 #include <atomic>
-#include <memory>
-#include <tuple>
+#include <utility>
 #include <vector>
+#include "fingerprint.h"
 
-class Site;
+// Identifies a character or element: the site that created it, and that
+// site's clock when it did.
+//
+// Sites are few and their clocks dense, so an ID packs them into 64 bits: the
+// high bits index the process-wide SiteTable, whose entries hold a site and
+// the high bits of its clock, and the low bits hold the rest of the clock. A
+// site whose clock outgrows the low bits moves on to a fresh entry.
+//
+// IDs compare by their packing: consistent within a process, and keeping the
+// ids a site generated together adjacent and in clock order, but not the same
+// in another process - orders that replicas must agree on use Precedes.
+class ID {
+ public:
+  static constexpr int kClockBits = 44;
+  static constexpr uint64_t kClockMask = (uint64_t(1) << kClockBits) - 1;
+
+  // the null id, which no site generates
+  constexpr ID() : bits_(0) {}
+  ID(uint64_t site, uint64_t clock);
+
+  static ID FromBits(uint64_t bits) {
+    ID id;
+    id.bits_ = bits;
+    return id;
+  }
+  uint64_t bits() const { return bits_; }
+
+  uint64_t site() const;
+  uint64_t clock() const;
+
+  // the SiteTable entry, and the clock within it: ids on the same entry are
+  // clock() - clock() apart
+  uint32_t entry() const { return static_cast<uint32_t>(bits_ >> kClockBits); }
+  uint64_t tick() const { return bits_ & kClockMask; }
+  // the id n clock ticks later; ids generated together never straddle
+  // entries, so this stays on the entry
+  ID Offset(int64_t n) const { return FromBits(bits_ + n); }
+
+  // (site, clock) order: the same in every process
+  bool Precedes(ID other) const {
+    if (entry() == other.entry()) return bits_ < other.bits_;
+    const uint64_t a = site(), b = other.site();
+    return a < b || (a == b && clock() < other.clock());
+  }
+
+  bool operator==(ID other) const { return bits_ == other.bits_; }
+  bool operator!=(ID other) const { return bits_ != other.bits_; }
+  bool operator<(ID other) const { return bits_ < other.bits_; }
+  bool operator>(ID other) const { return bits_ > other.bits_; }
+  bool operator<=(ID other) const { return bits_ <= other.bits_; }
+  bool operator>=(ID other) const { return bits_ >= other.bits_; }
+
+ private:
+  uint64_t bits_;
+};
+
+inline void Fingerprint(Fingerprinter* f, ID id) { f->U64(id.bits()); }
+
+// The (site, clock >> ID::kClockBits) pairs that ids index. Entries are
+// added, never removed or changed, so reading them takes no lock; entry 0 is
+// (0, 0), so that ID() stands for site 0 clock 0, which no site generates.
+class SiteTable {
+ public:
+  static constexpr uint32_t kMaxEntries = uint32_t(1)
+                                          << (64 - ID::kClockBits);
+
+  // the entry for site and epoch, added if new; throws std::overflow_error
+  // once kMaxEntries are in use
+  static uint32_t Intern(uint64_t site, uint64_t epoch);
+  // the entry for site and epoch, if there is one; never adds
+  static bool Find(uint64_t site, uint64_t epoch, uint32_t* entry);
+
+  static uint64_t Site(uint32_t entry) { return Get(entry).site; }
+  static uint64_t Epoch(uint32_t entry) { return Get(entry).epoch; }
+
+  // entries in use
+  static uint32_t Size();
+
+ private:
+  struct Entry {
+    uint64_t site;
+    uint64_t epoch;
+  };
+  static constexpr uint32_t kChunkEntries = 1024;
+
+  struct Table;
+  static Table& table();
+  static const Entry& Get(uint32_t entry);
+};
+
+inline ID::ID(uint64_t site, uint64_t clock)
+    : bits_(uint64_t(SiteTable::Intern(site, clock >> kClockBits))
+                << kClockBits |
+            (clock & kClockMask)) {}
 
-typedef std::tuple<uint64_t, uint64_t> ID;
+inline uint64_t ID::site() const { return SiteTable::Site(entry()); }
+
+inline uint64_t ID::clock() const {
+  return SiteTable::Epoch(entry()) << kClockBits | tick();
+}
 
 class Site {
  public:
@@ -29,8 +128,28 @@ class Site {
   Site(const Site&) = delete;
   Site& operator=(const Site&) = delete;
 
-  ID GenerateID() {
-    return ID(id_, clock_.fetch_add(1, std::memory_order_relaxed));
+  ID GenerateID() { return GenerateIDs(1); }
+
+  // reserve n consecutive ids, returning the first
+  ID GenerateIDs(uint64_t n) {
+    uint64_t clock = clock_.load(std::memory_order_relaxed);
+    uint64_t first;
+    do {
+      first = clock;
+      // consecutive ids share an entry: skip to the next one if need be
+      if ((first & ID::kClockMask) + n > ID::kClockMask + 1) {
+        first = (first | ID::kClockMask) + 1;
+      }
+    } while (!clock_.compare_exchange_weak(clock, first + n,
+                                           std::memory_order_relaxed));
+    const uint64_t epoch = first >> ID::kClockBits;
+    uint64_t entry = entry_.load(std::memory_order_relaxed);
+    if (entry >> 32 != epoch) {
+      entry = epoch << 32 | SiteTable::Intern(id_, epoch);
+      entry_.store(entry, std::memory_order_relaxed);
+    }
+    return ID::FromBits((entry & 0xffffffff) << ID::kClockBits |
+                        (first & ID::kClockMask));
   }
 
   uint64_t site_id() const { return id_; }
@@ -39,50 +158,116 @@ class Site {
   Site(uint64_t id) : id_(id) {}
   const uint64_t id_;
   std::atomic<uint64_t> clock_{0};
+  // epoch << 32 | SiteTable entry of the clock values last generated
+  std::atomic<uint64_t> entry_{~uint64_t(0)};
+  // site 0 is the null id's
   static std::atomic<uint64_t> id_gen_;
 };
 
-template <class Derived>
-class CRDT {
+// Commands are plain records: each CRDT declares its command kinds as a
+// tagged record type, Op, carrying the command id. A CommandBuffer stores the
+// records contiguously and appends payload that does not fit a record (text,
+// map and set values) to an arena alongside, referenced by index - so
+// recording a command allocates nothing in the common case, and integrating a
+// batch streams through memory instead of chasing pointers and virtual calls.
+template <class Op, class Arena>
+class CommandBuffer {
  public:
+  // a recorded command
   class Command {
    public:
-    Command(ID id) : id_(id) {}
-    virtual ~Command() {}
+    Command(const Op* op, const Arena* arena) : op_(op), arena_(arena) {}
 
-    ID id() const { return id_; }
+    ID id() const { return op_->id; }
+    const Op& op() const { return *op_; }
+    const Arena& arena() const { return *arena_; }
 
-    virtual std::unique_ptr<Command> Clone() = 0;
+   private:
+    const Op* op_;
+    const Arena* arena_;
+  };
+
+  class const_iterator {
+   public:
+    const_iterator(const Op* op, const Arena* arena) : op_(op), arena_(arena) {}
+
+    Command operator*() const { return Command(op_, arena_); }
+    const_iterator& operator++() {
+      ++op_;
+      return *this;
+    }
+    bool operator!=(const const_iterator& other) const {
+      return op_ != other.op_;
+    }
 
    private:
-    friend class CRDT<Derived>;
-    virtual Derived Integrate(Derived string) = 0;
-    const ID id_;
+    const Op* op_;
+    const Arena* arena_;
   };
-  typedef std::unique_ptr<Command> CommandPtr;
-  typedef std::vector<CommandPtr> CommandBuf;
 
-  Derived Integrate(const CommandPtr& command) {
-    return command->Integrate(*static_cast<Derived*>(this));
+  size_t size() const { return ops_.size(); }
+  bool empty() const { return ops_.empty(); }
+  // keeps capacity, so a buffer reused for recording stops allocating
+  void clear() {
+    ops_.clear();
+    arena_.clear();
+  }
+  void swap(CommandBuffer& other) {
+    ops_.swap(other.ops_);
+    arena_.swap(other.arena_);
+  }
+
+  Command operator[](size_t i) const { return Command(&ops_[i], &arena_); }
+  const_iterator begin() const {
+    return const_iterator(ops_.data(), &arena_);
+  }
+  const_iterator end() const {
+    return const_iterator(ops_.data() + ops_.size(), &arena_);
   }
 
- protected:
-  template <class F>
-  static ID MakeCommand(CommandBuf* buf, ID id, F&& f) {
-    class Impl final : public Command {
-     public:
-      Impl(ID id, F&& f) : Command(id), f_(std::move(f)) {}
+  // recording
+  void Append(const Op& op) { ops_.push_back(op); }
+  Arena* arena() { return &arena_; }
 
-      CommandPtr Clone() override {
-        return CommandPtr(new Impl(this->id(), F(f_)));
-      }
+  // the records, contiguous, and the payload they index, for serialization
+  const Op* data() const { return ops_.data(); }
+  const Arena& payload() const { return arena_; }
 
-     private:
-      Derived Integrate(Derived s) override { return f_(s, this->id()); }
+  // bytes held, for accounting
+  size_t Bytes() const {
+    return ops_.capacity() * sizeof(Op) +
+           arena_.capacity() * sizeof(*arena_.data());
+  }
 
-      F f_;
-    };
-    buf->emplace_back(new Impl(id, std::move(f)));
-    return id;
+ private:
+  std::vector<Op> ops_;
+  Arena arena_;
+};
+
+// the command record of element containers (UMap, USet): insert the payload
+// entry at index under id, or remove the entry id inserted
+struct ElementOp {
+  enum Kind : uint8_t { INSERT, REMOVE } kind;
+  ID id;
+  uint32_t index;
+};
+
+// Derived declares its command record Op, a CommandBuf (a CommandBuffer of
+// Op) and, accessible to CRDT<Derived>, how to integrate a record:
+//   static Derived IntegrateOp(Derived d, const Op& op, const Arena& arena);
+template <class Derived>
+class CRDT {
+ public:
+  template <class Command>
+  Derived Integrate(const Command& command) const& {
+    return Derived::IntegrateOp(*static_cast<const Derived*>(this),
+                                command.op(), command.arena());
+  }
+  // integrate into an expiring value: structure it owns exclusively may be
+  // updated in place, which makes applying a batch of commands cheap
+  template <class Command>
+  Derived Integrate(const Command& command) && {
+    return Derived::IntegrateOp(std::move(*static_cast<Derived*>(this)),
+                                command.op(), command.arena());
   }
 };
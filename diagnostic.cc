@@ -12,7 +12,6 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "diagnostic.h"
-#include "absl/strings/str_join.h"
 #include "buffer.h"
 #include "umap.h"
 #include "uset.h"
@@ -120,7 +119,7 @@ void DiagnosticEditor::Publish(const String& content, EditResponse* response) {
         ID id = impl_->fixit_editor.Add(
             Fixit{fixit.type, diag.diag_id, idx, replacement.range.first,
                   replacement.range.second, replacement.new_text});
-        Log() << "PUBLISH FIXIT: " << absl::StrJoin(id, ":");
+        Log() << "PUBLISH FIXIT: " << id.site() << ":" << id.clock();
       }
     }
   }
@@ -45,6 +45,12 @@ struct Diagnostic {
   }
 };
 
+inline void Fingerprint(Fingerprinter* f, const Diagnostic& diagnostic) {
+  f->U64(diagnostic.index);
+  f->U64(static_cast<uint64_t>(diagnostic.severity));
+  Fingerprint(f, diagnostic.message);
+}
+
 struct Fixit {
   enum class Type {
     AUTOSUGGEST,
@@ -85,6 +91,15 @@ struct Fixit {
   }
 };
 
+inline void Fingerprint(Fingerprinter* f, const Fixit& fixit) {
+  f->U64(static_cast<uint64_t>(fixit.type));
+  Fingerprint(f, fixit.diagnostic);
+  f->U64(fixit.index);
+  Fingerprint(f, fixit.begin);
+  Fingerprint(f, fixit.end);
+  Fingerprint(f, fixit.replacement);
+}
+
 class DiagnosticEditor {
  public:
   DiagnosticEditor(Site* site);
@@ -202,10 +202,28 @@ void Editor::NextRenderMustHaveID(ID id) {
 
 void Editor::NextRenderMustNotHaveID(ID id) {
   check_most_recent_edit_ = [id](const EditNotification& state) {
-    return !String::AllIterator(state.content, id).is_visible();
+    return !state.content.Has(id) ||
+           !String::AllIterator(state.content, id).is_visible();
   };
 }
 
+void Editor::UpdateState(const EditNotification& state) {
+  // tombstones under the cursor or selection may be compacted away
+  cursor_ = SurvivingID(state.content, cursor_);
+  if (SelectMode()) {
+    selection_anchor_ = SurvivingID(state.content, selection_anchor_);
+  }
+  state_ = state;
+}
+
+ID Editor::SurvivingID(const String& content, ID id) const {
+  // ids this editor made itself may not have been integrated yet
+  if (content.Has(id) || !state_.content.Has(id)) return id;
+  String::AllIterator it(state_.content, id);
+  while (!content.Has(it.id())) it.MovePrev();
+  return it.id();
+}
+
 int Editor::RenderCommon(
     int window_height,
     std::function<void(LineInfo, const std::vector<CharInfo>&)> add_line) {
@@ -224,60 +242,72 @@ int Editor::RenderCommon(
     line_bk.MovePrev();
     line_fw.MoveNext();
   }
-  String::AllIterator it = line_bk.AsAllIterator();
-  AnnotationTracker<Tag> t_token(state_.token_types);
-  AnnotationTracker<ID> t_diagnostic(state_.diagnostic_ranges);
-  AnnotationTracker<SideBufferRef> t_side_buffer_ref(state_.side_buffer_refs);
+  const ViewportAnnotations annotations =
+      state_.Annotations(line_bk.id(), line_fw.id(), cursor_);
+  SpanReader<Tag> tokens(annotations.tokens);
+  SpanReader<ID> diagnostics(annotations.diagnostics);
+  size_t next_note = 0;
+  // visible characters walked so far
+  size_t offset = 0;
   bool in_selection = false;
   std::vector<CharInfo> ci;
   int nrow = 0;
   int ncol = 0;
-  auto last_was_cursor = [&]() {
-    return String::Iterator(state_.content, it.id()).Prev().id() == cursor_;
-  };
+  // the visible character before the next visible one: it holds the cursor
+  // if it is cursor_
+  ID last_visible;
+  {
+    String::Iterator first(state_.content, line_bk.id());
+    last_visible = first.id() == line_bk.id() ? first.Prev().id() : first.id();
+  }
   std::vector<std::string> gutter_annotations;
-  while (it.id() != line_fw.id()) {
-    t_token.Enter(it.id());
-    t_diagnostic.Enter(it.id());
-    t_side_buffer_ref.Enter(it.id());
-    if (SelectMode() && it.id() == selection_anchor_) {
-      in_selection = !in_selection;
-    }
-    if (it.id() == cursor_) {
-      if (SelectMode()) in_selection = !in_selection;
-      cursor_token_ = t_token.cur();
-      if (!t_side_buffer_ref.cur().name.empty()) {
-        active_side_buffer_ = t_side_buffer_ref.cur();
-      } else {
-        active_side_buffer_.lines.clear();
+  auto render_span = [&](ID first, const char* chars, size_t n,
+                         bool visible) {
+    for (size_t i = 0; i < n; i++) {
+      const ID id = first.Offset(i);
+      if (SelectMode() && id == selection_anchor_) {
+        in_selection = !in_selection;
+      }
+      if (id == cursor_) {
+        if (SelectMode()) in_selection = !in_selection;
+        cursor_token_ = annotations.focus_token;
+        if (!annotations.focus_side_buffer_ref.name.empty()) {
+          active_side_buffer_ = annotations.focus_side_buffer_ref;
+        } else {
+          active_side_buffer_.lines.clear();
+        }
       }
-    }
-    state_.gutter_notes.ForEachValue(it.id(), [&](const std::string& note) {
-      gutter_annotations.push_back(note);
-    });
 
-    if (it.is_visible()) {
-      if (it.value() == '\n') {
-        LineInfo li{it.id() == line_end_cr.id(),
+      if (!visible) continue;
+      for (; next_note < annotations.gutter_notes.size() &&
+             annotations.gutter_notes[next_note].first == offset;
+           next_note++) {
+        gutter_annotations.push_back(
+            annotations.gutter_notes[next_note].second);
+      }
+      const bool after_cursor = last_visible == cursor_;
+      last_visible = id;
+      if (chars[i] == '\n') {
+        LineInfo li{id == line_end_cr.id(),
                     absl::StrJoin(gutter_annotations, ",")};
         gutter_annotations.clear();
-        ci.emplace_back(CharInfo{' ', false, last_was_cursor(), Tag()});
+        ci.emplace_back(CharInfo{' ', false, after_cursor, Tag()});
         nrow++;
         ncol = 0;
         add_line(li, ci);
         ci.clear();
       } else {
         ncol++;
-        Tag tok = t_token.cur();
-        if (t_diagnostic.cur() != ID()) {
+        Tag tok = tokens.At(offset);
+        if (diagnostics.At(offset) != ID()) {
           tok = tok.Push("error");
         }
-        ci.emplace_back(
-            CharInfo{it.value(), in_selection, last_was_cursor(), tok});
+        ci.emplace_back(CharInfo{chars[i], in_selection, after_cursor, tok});
       }
+      offset++;
     }
-    it.MoveNext();
-  }
+  };
+  state_.content.ForEachSpan(line_bk.id(), line_fw.id(), render_span);
   return -1;
 }
 
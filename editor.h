@@ -29,7 +29,7 @@ class Editor {
   Editor(Site* site) : site_(site), cursor_editor_(site) {}
 
   // state management
-  void UpdateState(const EditNotification& state) { state_ = state; }
+  void UpdateState(const EditNotification& state);
   const EditNotification& CurrentState() { return state_; }
 
   bool HasMostRecentEdit() {
@@ -126,6 +126,10 @@ class Editor {
   void NextRenderMustHaveID(ID id);
   void NextRenderMustNotHaveID(ID id);
 
+  // id, or if it has since been purged from content, the nearest character
+  // before it that survived
+  ID SurvivingID(const String& content, ID id) const;
+
   template <class RC>
   struct EditRenderContext {
     RC* parent_context;
@@ -223,7 +227,7 @@ class Editor {
   ID cursor_ = String::Begin();
   ID selection_anchor_ = ID();
   EditNotification state_;
-  std::vector<String::CommandPtr> commands_;
+  String::CommandBuf commands_;
   Tag cursor_token_;
   SideBufferRef active_side_buffer_;
   int last_sb_offset_ = 0;
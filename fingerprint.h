@@ -0,0 +1,84 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+// 64-bit fingerprints of values, so that large values (whole side buffers,
+// tag lists) can be found in a hash table instead of compared down a tree.
+// Values that are equivalent (neither is < the other) fingerprint the same;
+// different values almost never do, so a match still needs a compare.
+// Fingerprints of ids only mean something within one process.
+//
+// A type is fingerprinted by a Fingerprint(Fingerprinter*, const T&)
+// overload next to it, feeding in what its operator< compares.
+class Fingerprinter {
+ public:
+  void U64(uint64_t x) {
+    h_ = (h_ ^ x) * 0x9e3779b97f4a7c15;
+    h_ ^= h_ >> 32;
+  }
+  void Bytes(const char* p, size_t n) {
+    U64(n);
+    for (; n >= 8; p += 8, n -= 8) {
+      uint64_t x;
+      memcpy(&x, p, 8);
+      U64(x);
+    }
+    uint64_t x = 0;
+    memcpy(&x, p, n);
+    U64(x);
+  }
+
+  uint64_t value() const {
+    uint64_t h = h_;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111eb;
+    return h ^ (h >> 31);
+  }
+
+ private:
+  uint64_t h_ = 0x243f6a8885a308d3;
+};
+
+// the equality ordered containers use
+template <class T>
+bool Equivalent(const T& a, const T& b) {
+  return !(a < b) && !(b < a);
+}
+
+inline void Fingerprint(Fingerprinter* f, uint64_t x) { f->U64(x); }
+inline void Fingerprint(Fingerprinter* f, const std::string& s) {
+  f->Bytes(s.data(), s.size());
+}
+inline void Fingerprint(Fingerprinter* f, const std::vector<char>& v) {
+  f->Bytes(v.data(), v.size());
+}
+
+template <class A, class B>
+void Fingerprint(Fingerprinter* f, const std::pair<A, B>& pair) {
+  Fingerprint(f, pair.first);
+  Fingerprint(f, pair.second);
+}
+
+template <class T>
+void Fingerprint(Fingerprinter* f, const std::vector<T>& v) {
+  f->U64(v.size());
+  for (const auto& x : v) Fingerprint(f, x);
+}
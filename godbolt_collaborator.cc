@@ -13,7 +13,6 @@
 // limitations under the License.
 #include "godbolt_collaborator.h"
 #include "absl/strings/str_join.h"
-#include "asm_parser.h"
 #include "clang_config.h"
 #include "log.h"
 #include "run.h"
@@ -32,48 +31,49 @@ EditResponse GodboltCollaborator::Edit(const EditNotification& notification) {
   if (!notification.fully_loaded) return response;
   if (!content_latch_.IsNewContent(notification)) return response;
   auto str = notification.content;
-  auto text = str.Render();
-  NamedTempFile tmpf;
-  std::vector<std::string> args;
-  auto cmd =
-      ClangCompileCommand(buffer_->filename(), "-", tmpf.filename(), &args);
-  Log() << cmd << " " << absl::StrJoin(args, " ");
-  if (run(cmd, args, text).status != 0) {
-    return response;
-  }
+  if (content_latch_.text_changed() || !have_asm_) {
+    auto text = str.Render();
+    NamedTempFile tmpf;
+    std::vector<std::string> args;
+    auto cmd =
+        ClangCompileCommand(buffer_->filename(), "-", tmpf.filename(), &args);
+    Log() << cmd << " " << absl::StrJoin(args, " ");
+    if (run(cmd, args, text).status != 0) {
+      // the asm we have is for other text: don't rekey it onto this one
+      have_asm_ = false;
+      return response;
+    }
+
+    Log() << "objdump: " << tmpf.filename();
+    auto dump = run(OBJDUMP_BIN,
+                    {"-d", "-l", "-M", "intel", "-C", "--no-show-raw-insn",
+                     tmpf.filename()},
+                    "");
 
-  Log() << "objdump: " << tmpf.filename();
-  auto dump = run(
-      OBJDUMP_BIN,
-      {"-d", "-l", "-M", "intel", "-C", "--no-show-raw-insn", tmpf.filename()},
-      "");
+    parsed_asm_ = AsmParse(dump.out);
+    have_asm_ = true;
 
-  AsmParseResult parsed_asm = AsmParse(dump.out);
+    side_buffer_editor_.BeginEdit(&response.side_buffers);
+    SideBuffer buf;
+    buf.content.insert(buf.content.end(), parsed_asm_.body.begin(),
+                       parsed_asm_.body.end());
+    buf.tokens.resize(buf.content.size());
+    buf.CalcLines();
+    side_buffer_editor_.Add("disasm", std::move(buf));
+    side_buffer_editor_.Publish();
+  } else {
+    Log() << "godbolt: same text, rekeying line references";
+  }
 
   side_buffer_ref_editor_.BeginEdit(&response.side_buffer_refs);
-  String::LineIterator line_it(notification.content, String::Begin());
-  int line_idx = 0;
-  for (const auto& m : parsed_asm.src_to_asm_line) {
-    Log() << "line_idx=" << line_idx << " m.first=" << m.first;
-    while (line_idx < m.first) {
-      line_it.MoveNext();
-      line_idx++;
-    }
+  for (const auto& m : parsed_asm_.src_to_asm_line) {
+    Log() << "m.first=" << m.first;
     side_buffer_ref_editor_.Add(
-        line_it.id(),
-        Annotation<SideBufferRef>(line_it.Next().id(),
+        str.IDAtLine(m.first),
+        Annotation<SideBufferRef>(str.IDAtLine(m.first + 1),
                                   SideBufferRef{"disasm", m.second}));
   }
   side_buffer_ref_editor_.Publish();
 
-  side_buffer_editor_.BeginEdit(&response.side_buffers);
-  SideBuffer buf;
-  buf.content.insert(buf.content.end(), parsed_asm.body.begin(),
-                     parsed_asm.body.end());
-  buf.tokens.resize(buf.content.size());
-  buf.CalcLines();
-  side_buffer_editor_.Add("disasm", std::move(buf));
-  side_buffer_editor_.Publish();
-
   return response;
 }
@@ -13,6 +13,7 @@
 // limitations under the License.
 #pragma once
 
+#include "asm_parser.h"
 #include "buffer.h"
 #include "content_latch.h"
 
@@ -30,6 +31,9 @@ class GodboltCollaborator final : public SyncCollaborator {
  private:
   const Buffer* const buffer_;
   ContentLatch content_latch_;
+  // from the last compile, reused while only ids change
+  bool have_asm_ = false;
+  AsmParseResult parsed_asm_;
   UMapEditor<std::string, SideBuffer> side_buffer_editor_;
   UMapEditor<ID, Annotation<SideBufferRef>> side_buffer_ref_editor_;
 };
@@ -19,9 +19,11 @@
 #include "temp_file.h"
 #include "wrap_syscall.h"
 
-IOCollaborator::IOCollaborator(const Buffer* buffer)
+IOCollaborator::IOCollaborator(const Buffer* buffer,
+                               std::unique_ptr<std::string> recovered)
     : AsyncCollaborator("io", absl::Milliseconds(100),absl::Milliseconds(500)),
       filename_(buffer->filename()),
+      recovered_(std::move(recovered)),
       last_char_id_(String::Begin()) {
   fd_ = WrapSyscall("open",
                     [this]() { return open(filename_.c_str(), O_RDONLY); });
@@ -52,23 +54,30 @@ void IOCollaborator::Push(const EditNotification& notification) {
 }
 
 EditResponse IOCollaborator::Pull() {
-  static constexpr const int kChunkSize = 4096;
+  // load the whole file as one insert: String builds it in linear time
+  static constexpr const int kChunkSize = 65536;
   char buf[kChunkSize];
-  const int n = WrapSyscall(
-      "read", [this, &buf]() { return read(fd_, buf, sizeof(buf)); });
+  std::string content;
+  if (recovered_) {
+    content.swap(*recovered_);
+  } else {
+    for (;;) {
+      const int n = WrapSyscall(
+          "read", [this, &buf]() { return read(fd_, buf, sizeof(buf)); });
+      if (n == 0) break;
+      content.append(buf, n);
+    }
+  }
+  close(fd_);
+  fd_ = 0;
 
   EditResponse r;
-
-  if (n != sizeof(buf)) {
-    r.done = true;
-    r.become_loaded = true;
-    close(fd_);
-    fd_ = 0;
-  }
+  r.done = true;
+  r.become_loaded = true;
 
   absl::MutexLock lock(&mu_);
 
-  last_char_id_ = String::MakeRawInsert(&r.content, site(), std::string(buf, n),
+  last_char_id_ = String::MakeRawInsert(&r.content, site(), content,
                                         last_char_id_, String::End());
 
   return r;
@@ -17,7 +17,9 @@
 
 class IOCollaborator final : public AsyncCollaborator {
  public:
-  IOCollaborator(const Buffer* buffer);
+  // loads *recovered, if given, in place of the file's text
+  IOCollaborator(const Buffer* buffer,
+                 std::unique_ptr<std::string> recovered = nullptr);
   void Push(const EditNotification& notification) override;
   EditResponse Pull() override;
 
@@ -26,6 +28,7 @@ class IOCollaborator final : public AsyncCollaborator {
   const std::string filename_;
   int attributes_;
   int fd_;
+  std::unique_ptr<std::string> recovered_;
   ID last_char_id_ GUARDED_BY(mu_);
   String last_saved_ GUARDED_BY(mu_);
 };
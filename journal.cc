@@ -0,0 +1,464 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "journal.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include "content_hash.h"
+#include "log.h"
+#include "wrap_syscall.h"
+
+namespace {
+
+struct FileHeader {
+  char magic[8];
+  // refuse journals whose records are laid out differently
+  uint32_t op_size;
+  uint32_t reserved;
+};
+
+// followed by sites records, ops records, purge records, then text chars
+// padded to keep records aligned
+struct BatchHeader {
+  uint32_t sites;
+  uint32_t ops;
+  uint32_t text;
+  uint32_t purges;
+  // of the records and text; filled in by the writer
+  uint64_t checksum;
+};
+
+// Ids index the writing process's SiteTable: each batch first records the
+// entries its ids use that no earlier batch did
+struct SiteRecord {
+  uint64_t entry;
+  uint64_t site;
+  uint64_t epoch;
+};
+
+// a String::Op with every byte spelled out, so that padding and the unused
+// part of its union never carry stray memory to disk
+struct OpRecord {
+  uint64_t id;
+  uint64_t after;
+  uint64_t before;
+  uint32_t kind;
+  // INSERT_CHAR: the char; INSERT_RUN: text offset; REMOVE: count
+  uint32_t arg;
+  // INSERT_RUN: text length
+  uint32_t length;
+  uint32_t reserved;
+};
+
+// tombstones compacted away at this point of the journal: replaying the
+// commands after it needs them gone, as they were when those integrated
+struct PurgeRecord {
+  uint64_t id;
+  uint64_t length;
+};
+
+constexpr char kMagic[8] = {'c', 'e', 'd', 'j', 'r', 'n', 'l', '3'};
+
+static_assert(sizeof(FileHeader) % 8 == 0, "headers keep records aligned");
+static_assert(sizeof(BatchHeader) % 8 == 0, "headers keep records aligned");
+static_assert(sizeof(OpRecord) % 8 == 0, "records stay aligned back to back");
+
+size_t Padded(size_t n) { return (n + 7) & ~size_t(7); }
+
+size_t RecordsSize(const BatchHeader& batch) {
+  return batch.sites * sizeof(SiteRecord) + batch.ops * sizeof(OpRecord) +
+         batch.purges * sizeof(PurgeRecord);
+}
+
+size_t PayloadSize(const BatchHeader& batch) {
+  return RecordsSize(batch) + Padded(batch.text);
+}
+
+uint64_t Checksum(const char* payload, const BatchHeader& batch) {
+  return ContentHash::Of(payload, RecordsSize(batch) + batch.text).lo();
+}
+
+ID OffsetID(ID id, uint64_t n) { return id.Offset(n); }
+
+OpRecord Encode(const String::Op& op) {
+  OpRecord rec{op.id.bits(), op.after.bits(), op.before.bits(), op.kind,
+               0,            0,               0};
+  switch (op.kind) {
+    case String::Op::INSERT_CHAR:
+      rec.arg = static_cast<uint8_t>(op.chr);
+      break;
+    case String::Op::INSERT_RUN:
+      rec.arg = op.text.offset;
+      rec.length = op.text.length;
+      break;
+    case String::Op::REMOVE:
+      rec.arg = op.count;
+      break;
+  }
+  return rec;
+}
+
+String::Op Decode(const OpRecord& rec) {
+  String::Op op;
+  op.kind = static_cast<String::Op::Kind>(rec.kind);
+  op.id = ID::FromBits(rec.id);
+  op.after = ID::FromBits(rec.after);
+  op.before = ID::FromBits(rec.before);
+  switch (op.kind) {
+    case String::Op::INSERT_CHAR:
+      op.chr = static_cast<char>(rec.arg);
+      break;
+    case String::Op::INSERT_RUN:
+      op.text = String::TextRef{rec.arg, rec.length};
+      break;
+    case String::Op::REMOVE:
+      op.count = rec.arg;
+      break;
+  }
+  return op;
+}
+
+constexpr uint32_t kUnknownEntry = ~uint32_t(0);
+
+// SiteTable entries of the journal to entries of this process
+class SiteMap {
+ public:
+  void Add(const SiteRecord& record) {
+    if (record.entry >= SiteTable::kMaxEntries) return;
+    if (record.entry >= entries_.size()) {
+      entries_.resize(record.entry + 1, kUnknownEntry);
+    }
+    entries_[record.entry] = SiteTable::Intern(record.site, record.epoch);
+  }
+
+  // false if id's entry was never recorded
+  bool Translate(ID* id) const {
+    if (id->entry() >= entries_.size() ||
+        entries_[id->entry()] == kUnknownEntry) {
+      return false;
+    }
+    *id = ID::FromBits(uint64_t(entries_[id->entry()]) << ID::kClockBits |
+                       id->tick());
+    return true;
+  }
+
+ private:
+  std::vector<uint32_t> entries_;
+};
+
+// Typing journals a batch per keystroke. Replaying keystrokes one by one
+// would dominate recovery, so chains of single character inserts, each
+// inserted after the one before, are gathered and replayed as runs.
+class Replay {
+ public:
+  void Integrate(const String::Op& op, const std::string& text) {
+    if (op.kind == String::Op::INSERT_CHAR) {
+      if (!run_.empty() && op.id == OffsetID(run_op_.id, run_.size()) &&
+          op.after == OffsetID(run_op_.id, run_.size() - 1) &&
+          op.before == run_op_.before) {
+        run_ += op.chr;
+        return;
+      }
+      Flush();
+      run_op_ = op;
+      run_op_.kind = String::Op::INSERT_RUN;
+      run_ = op.chr;
+      return;
+    }
+    Flush();
+    content_ =
+        std::move(content_).Integrate(String::CommandBuf::Command(&op, &text));
+  }
+
+  void Purge(const String::PurgeList& runs) {
+    Flush();
+    content_ = content_.Purge(runs);
+  }
+
+  String Finish() {
+    Flush();
+    return std::move(content_);
+  }
+
+ private:
+  void Flush() {
+    if (run_.empty()) return;
+    run_op_.text = String::TextRef{0, static_cast<uint32_t>(run_.size())};
+    content_ = std::move(content_).Integrate(
+        String::CommandBuf::Command(&run_op_, &run_));
+    run_.clear();
+  }
+
+  String content_;
+  // the chain gathered so far
+  String::Op run_op_;
+  std::string run_;
+};
+
+// a journal is written here first, and renamed over any journal at path
+// once its first batch is on disk
+std::string TempPath(const std::string& path) { return path + ".new"; }
+
+int OpenJournal(const std::string& path) {
+  const int fd =
+      open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd == -1) return -1;
+  FileHeader header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.op_size = sizeof(OpRecord);
+  header.reserved = 0;
+  if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+}  // namespace
+
+Journal::Journal(const std::string& path)
+    : path_(path), fd_(OpenJournal(TempPath(path))) {
+  if (fd_ == -1) {
+    Log() << "journal " << path_ << " unavailable: " << strerror(errno);
+    absl::MutexLock lock(&mu_);
+    failed_ = true;
+    return;
+  }
+  writer_ = std::thread([this]() { RunWriter(); });
+}
+
+Journal::~Journal() {
+  {
+    absl::MutexLock lock(&mu_);
+    quit_ = true;
+  }
+  if (writer_.joinable()) writer_.join();
+  if (fd_ != -1) close(fd_);
+  // nothing ever reached the disk: leave any journal at path_ alone
+  if (!installed_) unlink(TempPath(path_).c_str());
+}
+
+std::string Journal::PathFor(const std::string& filename) {
+  const size_t slash = filename.rfind('/');
+  const size_t base = slash == std::string::npos ? 0 : slash + 1;
+  return filename.substr(0, base) + "." + filename.substr(base) +
+         ".ced-journal";
+}
+
+bool Journal::Recover(const std::string& path, String* content) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+  struct stat st;
+  if (fstat(fd, &st) == -1 ||
+      static_cast<size_t>(st.st_size) < sizeof(FileHeader)) {
+    close(fd);
+    return false;
+  }
+  const size_t size = st.st_size;
+  void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+  madvise(map, size, MADV_SEQUENTIAL);
+
+  const char* p = static_cast<const char*>(map);
+  const char* const end = p + size;
+  FileHeader header;
+  memcpy(&header, p, sizeof(header));
+  const bool readable = memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 &&
+                        header.op_size == sizeof(OpRecord);
+  bool replayed = false;
+  if (readable) {
+    Replay replay;
+    SiteMap sites;
+    std::string text;
+    for (p += sizeof(header);
+         static_cast<size_t>(end - p) >= sizeof(BatchHeader);) {
+      BatchHeader batch;
+      memcpy(&batch, p, sizeof(batch));
+      const char* payload = p + sizeof(batch);
+      // the session died mid-write: what came before is all there is
+      if (static_cast<size_t>(end - payload) < PayloadSize(batch) ||
+          Checksum(payload, batch) != batch.checksum) {
+        Log() << "journal " << path << " torn after "
+              << (p - static_cast<const char*>(map)) << " bytes";
+        break;
+      }
+      // records are read in place; their text needs to be in an arena
+      const SiteRecord* site_records =
+          reinterpret_cast<const SiteRecord*>(payload);
+      for (uint32_t i = 0; i < batch.sites; i++) sites.Add(site_records[i]);
+      const OpRecord* ops = reinterpret_cast<const OpRecord*>(
+          payload + batch.sites * sizeof(SiteRecord));
+      const PurgeRecord* purges = reinterpret_cast<const PurgeRecord*>(
+          payload + batch.sites * sizeof(SiteRecord) +
+          batch.ops * sizeof(OpRecord));
+      text.assign(payload + RecordsSize(batch), batch.text);
+      bool translated = true;
+      for (uint32_t i = 0; i < batch.ops && translated; i++) {
+        String::Op op = Decode(ops[i]);
+        translated = sites.Translate(&op.id) && sites.Translate(&op.after) &&
+                     sites.Translate(&op.before);
+        if (translated) replay.Integrate(op, text);
+      }
+      String::PurgeList runs;
+      for (uint32_t i = 0; i < batch.purges && translated; i++) {
+        ID id = ID::FromBits(purges[i].id);
+        translated = sites.Translate(&id);
+        runs.emplace_back(id, purges[i].length);
+      }
+      if (!translated) {
+        Log() << "journal " << path << " refers to unrecorded sites";
+        break;
+      }
+      if (!runs.empty()) replay.Purge(runs);
+      replayed = true;
+      p = payload + PayloadSize(batch);
+    }
+    *content = replay.Finish();
+  }
+  munmap(map, size);
+  return replayed;
+}
+
+void Journal::Append(const String::CommandBuf& commands) {
+  if (commands.empty()) return;
+  AppendBatch(commands, String::PurgeList());
+}
+
+void Journal::AppendPurge(const String::PurgeList& runs) {
+  if (runs.empty()) return;
+  AppendBatch(String::CommandBuf(), runs);
+}
+
+void Journal::AppendBatch(const String::CommandBuf& commands,
+                          const String::PurgeList& runs) {
+  const std::string& text = commands.payload();
+  absl::MutexLock lock(&mu_);
+  if (failed_) return;
+  // entries no earlier batch recorded: rare, so usually never allocated
+  std::vector<SiteRecord> new_sites;
+  auto record = [this, &new_sites](ID id) {
+    mu_.AssertHeld();
+    const uint32_t entry = id.entry();
+    if (entry >= journaled_sites_.size()) {
+      journaled_sites_.resize(entry + 1, false);
+    }
+    if (journaled_sites_[entry]) return;
+    journaled_sites_[entry] = true;
+    new_sites.push_back(SiteRecord{entry, SiteTable::Site(entry),
+                                    SiteTable::Epoch(entry)});
+  };
+  for (size_t i = 0; i < commands.size(); i++) {
+    const String::Op& op = commands.data()[i];
+    record(op.id);
+    record(op.after);
+    record(op.before);
+  }
+  for (const auto& run : runs) record(run.first);
+  BatchHeader batch{static_cast<uint32_t>(new_sites.size()),
+                    static_cast<uint32_t>(commands.size()),
+                    static_cast<uint32_t>(text.size()),
+                    static_cast<uint32_t>(runs.size()), 0};
+  const size_t start = pending_.size();
+  pending_.append(reinterpret_cast<const char*>(&batch), sizeof(batch));
+  pending_.append(reinterpret_cast<const char*>(new_sites.data()),
+                  new_sites.size() * sizeof(SiteRecord));
+  for (size_t i = 0; i < commands.size(); i++) {
+    const OpRecord rec = Encode(commands.data()[i]);
+    pending_.append(reinterpret_cast<const char*>(&rec), sizeof(rec));
+  }
+  for (const auto& run : runs) {
+    const PurgeRecord rec{run.first.bits(), run.second};
+    pending_.append(reinterpret_cast<const char*>(&rec), sizeof(rec));
+  }
+  pending_.append(text);
+  pending_.append(Padded(text.size()) - text.size(), '\0');
+  bytes_appended_ += pending_.size() - start;
+}
+
+void Journal::Flush() {
+  auto flushed = [this]() {
+    mu_.AssertHeld();
+    return failed_ || bytes_written_ == bytes_appended_;
+  };
+  mu_.LockWhen(absl::Condition(&flushed));
+  mu_.Unlock();
+}
+
+void Journal::Discard() {
+  Flush();
+  unlink(path_.c_str());
+  unlink(TempPath(path_).c_str());
+}
+
+uint64_t Journal::bytes_written() const {
+  absl::MutexLock lock(&mu_);
+  return bytes_written_;
+}
+
+void Journal::RunWriter() {
+  auto writable = [this]() {
+    mu_.AssertHeld();
+    return quit_ || !pending_.empty();
+  };
+  std::string batches;
+  for (;;) {
+    mu_.LockWhen(absl::Condition(&writable));
+    if (pending_.empty()) {
+      mu_.Unlock();
+      return;
+    }
+    // take everything appended since the last commit
+    batches.swap(pending_);
+    const uint64_t appended = bytes_appended_;
+    mu_.Unlock();
+
+    for (size_t pos = 0; pos < batches.size();) {
+      BatchHeader batch;
+      memcpy(&batch, &batches[pos], sizeof(batch));
+      batch.checksum = Checksum(&batches[pos + sizeof(batch)], batch);
+      memcpy(&batches[pos], &batch, sizeof(batch));
+      pos += sizeof(batch) + PayloadSize(batch);
+    }
+    try {
+      for (size_t done = 0; done < batches.size();) {
+        done += WrapSyscall("write", [&]() {
+          return write(fd_, batches.data() + done, batches.size() - done);
+        });
+      }
+      WrapSyscall("fdatasync", [this]() { return fdatasync(fd_); });
+      // only now may the journal this one replaces go: it holds edits that
+      // were just loaded again, until they are on disk here
+      if (!installed_) {
+        WrapSyscall("rename", [this]() {
+          return rename(TempPath(path_).c_str(), path_.c_str());
+        });
+        installed_ = true;
+      }
+    } catch (std::exception& e) {
+      Log() << "journal " << path_ << " broke: " << e.what();
+      absl::MutexLock lock(&mu_);
+      failed_ = true;
+      pending_.clear();
+      return;
+    }
+    batches.clear();
+
+    absl::MutexLock lock(&mu_);
+    bytes_written_ = appended;
+  }
+}
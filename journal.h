@@ -0,0 +1,85 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "absl/synchronization/mutex.h"
+#include "woot.h"
+
+// Append-only log of the content commands integrated into a buffer, so that
+// edits outlive a crashed session.
+//
+// Appending never touches the disk: a batch is encoded into memory and a
+// writer thread commits everything pending with one write and one fdatasync
+// (group commit), however many batches arrived meanwhile.
+//
+// A journal is a header followed by batches, each checksummed, with command
+// records in host byte order: it is only for the machine that wrote it to
+// recover from, and a torn last batch is ignored. Batches also record the
+// SiteTable entries their ids use, so recovery can map the ids into its own
+// process, and the tombstones compacted away between commands, so recovery
+// integrates each command into the document it was integrated into live.
+class Journal {
+ public:
+  // start an empty journal at path, replacing any there once something is
+  // appended and on disk
+  explicit Journal(const std::string& path);
+  // flushes
+  ~Journal();
+
+  Journal(const Journal&) = delete;
+  Journal& operator=(const Journal&) = delete;
+
+  // where the journal of filename lives: a hidden file next to it
+  static std::string PathFor(const std::string& filename);
+
+  // replays the journal at path into *content through bulk integration;
+  // false if there is no journal there that this build can read, or it
+  // holds no intact batch
+  static bool Recover(const std::string& path, String* content);
+
+  void Append(const String::CommandBuf& commands);
+  // runs String::Purge dropped after everything appended so far
+  void AppendPurge(const String::PurgeList& runs);
+  // block until everything appended so far is on disk
+  void Flush();
+  // flush, then delete the journal: its edits are safe elsewhere
+  void Discard();
+
+  uint64_t bytes_written() const;
+
+ private:
+  void AppendBatch(const String::CommandBuf& commands,
+                   const String::PurgeList& runs);
+  void RunWriter();
+
+  const std::string path_;
+  const int fd_;
+  mutable absl::Mutex mu_;
+  // encoded batches not yet handed to the writer
+  std::string pending_ GUARDED_BY(mu_);
+  uint64_t bytes_appended_ GUARDED_BY(mu_) = 0;
+  uint64_t bytes_written_ GUARDED_BY(mu_) = 0;
+  // SiteTable entries recorded in the journal
+  std::vector<bool> journaled_sites_ GUARDED_BY(mu_);
+  // writing failed: stop journaling rather than take the editor down
+  bool failed_ GUARDED_BY(mu_) = false;
+  bool quit_ GUARDED_BY(mu_) = false;
+  // renamed over path_; writer thread only
+  bool installed_ = false;
+  std::thread writer_;
+};
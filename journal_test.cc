@@ -0,0 +1,202 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "journal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "gtest/gtest.h"
+#include "temp_file.h"
+
+static String Apply(String s, const String::CommandBuf& buf) {
+  for (const auto& cmd : buf) {
+    s = s.Integrate(cmd);
+  }
+  return s;
+}
+
+TEST(Journal, RecoverReplaysCommands) {
+  NamedTempFile tmp;
+  Site site;
+  String s;
+  {
+    Journal journal(tmp.filename());
+    String::CommandBuf buf;
+    String::MakeRawInsert(&buf, &site, "hello world", String::Begin(),
+                          String::End());
+    s = Apply(s, buf);
+    journal.Append(buf);
+    buf.clear();
+    s.MakeRemove(&buf, s.IDAtOffset(0), s.IDAtOffset(6));
+    s.MakeInsert(&buf, &site, 'W', s.IDAtOffset(5));
+    s = Apply(s, buf);
+    journal.Append(buf);
+    // typing, a keystroke at a time
+    ID after = s.IDAtOffset(0);
+    for (char c : std::string("ide ")) {
+      buf.clear();
+      after = s.MakeInsert(&buf, &site, c, after);
+      s = Apply(s, buf);
+      journal.Append(buf);
+    }
+    journal.Flush();
+  }
+  String recovered;
+  ASSERT_TRUE(Journal::Recover(tmp.filename(), &recovered));
+  EXPECT_EQ(recovered.Render(), "Wide world");
+  EXPECT_EQ(recovered.Hash(), s.Hash());
+}
+
+TEST(Journal, TornBatchIsIgnored) {
+  NamedTempFile tmp;
+  Site site;
+  {
+    Journal journal(tmp.filename());
+    String::CommandBuf buf;
+    String::MakeRawInsert(&buf, &site, "kept", String::Begin(),
+                          String::End());
+    journal.Append(buf);
+    journal.Flush();
+    buf.clear();
+    String::MakeRawInsert(&buf, &site, "lost", String::Begin(),
+                          String::End());
+    journal.Append(buf);
+  }
+  // the session died while writing the last batch
+  struct stat st;
+  ASSERT_EQ(stat(tmp.filename().c_str(), &st), 0);
+  ASSERT_EQ(truncate(tmp.filename().c_str(), st.st_size - 3), 0);
+  String recovered;
+  ASSERT_TRUE(Journal::Recover(tmp.filename(), &recovered));
+  EXPECT_EQ(recovered.Render(), "kept");
+}
+
+TEST(Journal, RecoverInAnotherProcess) {
+  NamedTempFile tmp;
+  const pid_t pid = fork();
+  ASSERT_NE(pid, -1);
+  if (pid == 0) {
+    // sites the recovering process never saw, so ids here index SiteTable
+    // entries that mean something else there
+    for (int i = 0; i < 3; i++) Site().GenerateID();
+    Site site;
+    String s;
+    Journal journal(tmp.filename());
+    String::CommandBuf buf;
+    String::MakeRawInsert(&buf, &site, "elsewhere", String::Begin(),
+                          String::End());
+    s = Apply(s, buf);
+    journal.Append(buf);
+    buf.clear();
+    s.MakeRemove(&buf, s.IDAtOffset(0), s.IDAtOffset(4));
+    journal.Append(buf);
+    journal.Flush();
+    _exit(0);
+  }
+  int status;
+  ASSERT_EQ(waitpid(pid, &status, 0), pid);
+  ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  String recovered;
+  ASSERT_TRUE(Journal::Recover(tmp.filename(), &recovered));
+  EXPECT_EQ(recovered.Render(), "where");
+}
+
+TEST(Journal, ReplacedOnlyOnceOnDisk) {
+  NamedTempFile tmp;
+  Site site;
+  String::CommandBuf buf;
+  {
+    Journal journal(tmp.filename());
+    String::MakeRawInsert(&buf, &site, "old", String::Begin(), String::End());
+    journal.Append(buf);
+    journal.Flush();
+  }
+  String recovered;
+  {
+    // a session recovering the journal dies before reloading it
+    Journal journal(tmp.filename());
+    ASSERT_TRUE(Journal::Recover(tmp.filename(), &recovered));
+    EXPECT_EQ(recovered.Render(), "old");
+    buf.clear();
+    String::MakeRawInsert(&buf, &site, "new", String::Begin(), String::End());
+    journal.Append(buf);
+    journal.Flush();
+  }
+  ASSERT_TRUE(Journal::Recover(tmp.filename(), &recovered));
+  EXPECT_EQ(recovered.Render(), "new");
+}
+
+TEST(Journal, ReplaysCompaction) {
+  NamedTempFile tmp;
+  Site site;
+  String s;
+  String::CommandBuf buf;
+  {
+    Journal journal(tmp.filename());
+    ID after = String::Begin();
+    for (char c : std::string("a few words")) {
+      buf.clear();
+      after = s.MakeInsert(&buf, &site, c, after);
+      s = Apply(s, buf);
+      journal.Append(buf);
+    }
+    const String typed = s;
+    buf.clear();
+    s.MakeRemove(&buf, s.IDAtOffset(1), s.IDAtOffset(5));
+    s = Apply(s, buf);
+    journal.Append(buf);
+    const String::PurgeList runs = s.PurgeableRuns(s);
+    ASSERT_FALSE(runs.empty());
+    s = s.Purge(runs);
+    journal.AppendPurge(runs);
+    // made before the remove: names a purged character
+    buf.clear();
+    typed.MakeInsert(&buf, &site, '-', typed.IDAtOffset(2));
+    s = Apply(s, buf);
+    journal.Append(buf);
+    journal.Flush();
+  }
+  EXPECT_EQ(s.Render(), "a- words");
+  String recovered;
+  ASSERT_TRUE(Journal::Recover(tmp.filename(), &recovered));
+  EXPECT_EQ(recovered.Render(), s.Render());
+  EXPECT_EQ(recovered.Tombstones(), 0u);
+  EXPECT_EQ(recovered.Hash(), s.Hash());
+}
+
+TEST(Journal, NoIntactBatchRecoversNothing) {
+  NamedTempFile tmp;
+  Site site;
+  {
+    Journal journal(tmp.filename());
+    String::CommandBuf buf;
+    String::MakeRawInsert(&buf, &site, "lost", String::Begin(),
+                          String::End());
+    journal.Append(buf);
+    journal.Flush();
+  }
+  struct stat st;
+  ASSERT_EQ(stat(tmp.filename().c_str(), &st), 0);
+  ASSERT_EQ(truncate(tmp.filename().c_str(), st.st_size - 3), 0);
+  String recovered;
+  EXPECT_FALSE(Journal::Recover(tmp.filename(), &recovered));
+}
+
+TEST(Journal, NothingToRecover) {
+  String recovered;
+  EXPECT_FALSE(Journal::Recover("/nonexistent/.x.ced-journal", &recovered));
+  EXPECT_EQ(Journal::PathFor("src/foo.cc"), "src/.foo.cc.ced-journal");
+  EXPECT_EQ(Journal::PathFor("foo.cc"), ".foo.cc.ced-journal");
+}
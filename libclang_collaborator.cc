@@ -83,6 +83,7 @@ LibClangCollaborator::LibClangCollaborator(const Buffer* buffer)
 LibClangCollaborator::~LibClangCollaborator() {
   ClangEnv* env = ClangEnv::Get();
   absl::MutexLock lock(env->mu());
+  if (tu_ != NULL) env->clang_disposeTranslationUnit(tu_);
   env->ClearUnsavedFile(buffer_->filename());
 }
 
@@ -153,80 +154,15 @@ static bool IsPunctuation(char c) {
   }
 }
 
-EditResponse LibClangCollaborator::Edit(const EditNotification& notification) {
-  EditResponse response;
-
-  bool content_changed = content_latch_.IsNewContent(notification);
-  bool cursors_changed = !last_cursors_.SameIdentity(notification.cursors);
-
-  if (!content_changed && !cursors_changed) {
-    return response;
-  }
-
-  last_cursors_ = notification.cursors;
-
-  struct AutoCompleteCursor {
-    int offset = -1;
-    int line = -1;
-    int column = -1;
-    std::set<ID> cursor_ids;
-  };
-
-  std::map<ID, AutoCompleteCursor> autocomplete_ids;
-  notification.cursors.ForEach([&](ID cursor_id, ID id) {
-    String::Iterator it(notification.content, id);
-    while (!it.is_begin() && !IsPunctuation(it.value())) it.MovePrev();
-    autocomplete_ids[it.id()].cursor_ids.insert(cursor_id);
-  });
-
-  auto filename = buffer_->filename();
-
+bool LibClangCollaborator::AnnotateContent(
+    CXTranslationUnit tu, const EditNotification& notification,
+    const std::string& str, EditResponse* response) {
   ClangEnv* env = ClangEnv::Get();
-
-  std::string str;
-  std::vector<ID> ids;
-  String::Iterator it(notification.content, String::Begin());
-  it.MoveNext();
-  int line = 1;
-  int col = 1;
-  while (!it.is_end()) {
-    auto sit = autocomplete_ids.find(it.id());
-    if (sit != autocomplete_ids.end()) {
-      sit->second.offset = ids.size();
-      sit->second.line = line;
-      sit->second.column = col;
-    }
-    if (it.value() == '\n') {
-      line++;
-      col = 0;
-    } else {
-      col++;
-    }
-    str += it.value();
-    ids.push_back(it.id());
-    it.MoveNext();
-  }
-
-  absl::MutexLock lock(env->mu());
-  env->UpdateUnsavedFile(filename, str);
-  std::vector<std::string> cmd_args_strs;
-  ClangCompileArgs(filename, &cmd_args_strs);
-  std::vector<const char*> cmd_args;
-  for (auto& arg : cmd_args_strs) {
-    cmd_args.push_back(arg.c_str());
-  }
-  Log() << "libclang args: " << absl::StrJoin(cmd_args, " ");
-  std::vector<CXUnsavedFile> unsaved_files = env->GetUnsavedFiles();
-  const int options = env->clang_defaultEditingTranslationUnitOptions() |
-                      CXTranslationUnit_KeepGoing |
-                      CXTranslationUnit_DetailedPreprocessingRecord;
-  CXTranslationUnit tu = env->clang_parseTranslationUnit(
-      env->index(), filename.c_str(), cmd_args.data(), cmd_args.size(),
-      unsaved_files.data(), unsaved_files.size(), options);
-  if (tu == NULL) {
-    Log() << "Cannot parse translation unit";
-  }
-  Log() << "Parsed: " << tu;
+  const std::string& filename = buffer_->filename();
+  const String& content = notification.content;
+  auto id_at = [&content](unsigned offset) {
+    return content.IDAtOffset(offset);
+  };
 
   CXFile file = env->clang_getFile(tu, filename.c_str());
 
@@ -237,16 +173,14 @@ EditResponse LibClangCollaborator::Edit(const EditNotification& notification) {
   if (env->clang_equalLocations(topLoc, env->clang_getNullLocation()) ||
       env->clang_equalLocations(lastLoc, env->clang_getNullLocation())) {
     Log() << "cannot retrieve location";
-    env->clang_disposeTranslationUnit(tu);
-    return response;
+    return false;
   }
 
   // make a range from locations
   CXSourceRange range = env->clang_getRange(topLoc, lastLoc);
   if (env->clang_Range_isNull(range)) {
     Log() << "cannot retrieve range";
-    env->clang_disposeTranslationUnit(tu);
-    return response;
+    return false;
   }
 
   /*
@@ -259,13 +193,23 @@ EditResponse LibClangCollaborator::Edit(const EditNotification& notification) {
   std::unique_ptr<CXCursor[]> tok_cursors(new CXCursor[numTokens]);
   env->clang_annotateTokens(tu, tokens, numTokens, tok_cursors.get());
 
-  token_editor_.BeginEdit(&response.token_types);
-
-  std::function<Tag(Tag, CXCursor)> f_add = [&f_add, env](Tag t,
-                                                          CXCursor cursor) {
-    if (!env->clang_Cursor_isNull(cursor)) {
-      t = f_add(t, env->clang_getCursorLexicalParent(cursor));
+  token_editor_.BeginEdit(&response->token_types);
+
+  // a token's tag follows from its cursor and the cursor's lexical parents:
+  // tag each cursor once per parse, not once per token under it
+  std::unordered_multimap<unsigned, std::pair<CXCursor, Tag>> cursor_tags;
+  std::function<Tag(CXCursor)> f_add = [&f_add, &cursor_tags,
+                                        env](CXCursor cursor) {
+    const unsigned hash = env->clang_hashCursor(cursor);
+    auto range = cursor_tags.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (env->clang_equalCursors(it->second.first, cursor)) {
+        return it->second.second;
+      }
     }
+    Tag t = env->clang_Cursor_isNull(cursor)
+                ? Tag().Push("source.c++")
+                : f_add(env->clang_getCursorLexicalParent(cursor));
     CXCursorKind kind = env->clang_getCursorKind(cursor);
     auto it = tok_cursor_rules.find(kind);
     if (it != tok_cursor_rules.end()) {
@@ -274,6 +218,7 @@ EditResponse LibClangCollaborator::Edit(const EditNotification& notification) {
     t = t.Push(absl::StrCat(
         "LIBCLANG-",
         env->clang_getCString(env->clang_getCursorKindSpelling(kind))));
+    cursor_tags.emplace(hash, std::make_pair(cursor, t));
     return t;
   };
   std::function<Tag(Tag, CXToken)> f_tidy = [env](Tag t, CXToken token) {
@@ -288,7 +233,7 @@ EditResponse LibClangCollaborator::Edit(const EditNotification& notification) {
   };
 
   std::map<unsigned, long long> ofs_annotation;
-  gutter_notes_editor_.BeginEdit(&response.gutter_notes);
+  gutter_notes_editor_.BeginEdit(&response->gutter_notes);
 
   for (unsigned i = 0; i < numTokens; i++) {
     CXToken token = tokens[i];
@@ -306,10 +251,10 @@ EditResponse LibClangCollaborator::Edit(const EditNotification& notification) {
       if (ofs >= 0) {
         ofs_annotation[line] = ofs;
         if (ofs % 8 == 0) {
-          gutter_notes_editor_.Add(ids[offset_start],
+          gutter_notes_editor_.Add(id_at(offset_start),
                                    absl::StrCat("@", ofs / 8));
         } else {
-          gutter_notes_editor_.Add(ids[offset_start],
+          gutter_notes_editor_.Add(id_at(offset_start),
                                    absl::StrCat("@", ofs / 8, ".", ofs % 8));
         }
       }
@@ -317,21 +262,19 @@ EditResponse LibClangCollaborator::Edit(const EditNotification& notification) {
 
     env->clang_getFileLocation(end, &file, &line, &col, &offset_end);
 
-    token_editor_.Add(
-        ids[offset_start],
-        Annotation<Tag>(
-            ids[offset_end],
-            f_tidy(f_add(Tag().Push("source.c++"), cursor), token)));
+    token_editor_.Add(id_at(offset_start), id_at(offset_end),
+                      f_tidy(f_add(cursor), token));
   }
 
   env->clang_disposeTokens(tu, tokens, numTokens);
+  token_editor_.Publish();
   gutter_notes_editor_.Publish();
 
   /*
    * REFERENCED FILE DISCOVERY
    */
 
-  ref_editor_.BeginEdit(&response.referenced_files);
+  ref_editor_.BeginEdit(&response->referenced_files);
   env->clang_visitChildren(
       env->clang_getTranslationUnitCursor(tu),
       +[](CXCursor cursor, CXCursor parent, CXClientData client_data) {
@@ -374,7 +317,7 @@ EditResponse LibClangCollaborator::Edit(const EditNotification& notification) {
         env->clang_getFileLocation(end, &file, &line, &col, &offset_end);
         if (file &&
             filename == env->clang_getCString(env->clang_getFileName(file))) {
-          diagnostic_editor_.AddRange(ids[offset_start], ids[offset_end]);
+          diagnostic_editor_.AddRange(id_at(offset_start), id_at(offset_end));
         }
       }
       CXFile file;
@@ -383,7 +326,7 @@ EditResponse LibClangCollaborator::Edit(const EditNotification& notification) {
       env->clang_getFileLocation(loc, &file, &line, &col, &offset);
       if (file &&
           filename == env->clang_getCString(env->clang_getFileName(file))) {
-        diagnostic_editor_.AddPoint(ids[offset]);
+        diagnostic_editor_.AddPoint(id_at(offset));
       }
       unsigned num_fixits = env->clang_getDiagnosticNumFixIts(diag);
       Log() << "num_fixits:" << num_fixits;
@@ -399,7 +342,7 @@ EditResponse LibClangCollaborator::Edit(const EditNotification& notification) {
         if (file &&
             filename == env->clang_getCString(env->clang_getFileName(file))) {
           diagnostic_editor_.StartFixit(Fixit::Type::COMPILE_FIX)
-              .AddReplacement(ids[offset_start], ids[offset_end],
+              .AddReplacement(id_at(offset_start), id_at(offset_end),
                               env->clang_getCString(repl));
         }
       }
@@ -408,6 +351,86 @@ EditResponse LibClangCollaborator::Edit(const EditNotification& notification) {
       env->clang_disposeDiagnostic(diag);
     }
   }
+  diagnostic_editor_.Publish(notification.content, response);
+  return true;
+}
+
+EditResponse LibClangCollaborator::Edit(const EditNotification& notification) {
+  EditResponse response;
+
+  // with only the cursors moved, the annotations stand: just complete
+  bool content_changed = content_latch_.IsNewContent(notification);
+  bool cursors_changed =
+      notification.field_versions.cursors != cursors_version_;
+
+  if (!content_changed && !cursors_changed) {
+    return response;
+  }
+
+  cursors_version_ = notification.field_versions.cursors;
+
+  struct AutoCompleteCursor {
+    int offset = -1;
+    int line = -1;
+    int column = -1;
+    std::set<ID> cursor_ids;
+  };
+
+  std::map<ID, AutoCompleteCursor> autocomplete_ids;
+  notification.cursors.ForEach([&](ID cursor_id, ID id) {
+    String::Iterator it(notification.content, id);
+    while (!it.is_begin() && !IsPunctuation(it.value())) it.MovePrev();
+    autocomplete_ids[it.id()].cursor_ids.insert(cursor_id);
+  });
+
+  auto filename = buffer_->filename();
+
+  ClangEnv* env = ClangEnv::Get();
+
+  const String& content = notification.content;
+  std::string str = content.Render();
+  for (auto& ac : autocomplete_ids) {
+    if (ac.first == String::Begin()) continue;
+    // clang counts lines and columns from 1
+    size_t line = content.LineOf(ac.first);
+    ID line_start = content.IDAtLine(line);
+    ac.second.offset = content.OffsetOf(ac.first);
+    ac.second.line = line + 1;
+    ac.second.column =
+        ac.second.offset + 1 -
+        (line_start == String::Begin() ? 0 : content.OffsetOf(line_start) + 1);
+  }
+
+  absl::MutexLock lock(env->mu());
+  // same text as last parse (only ids or cursors changed): reuse it
+  if (tu_ == NULL || content_latch_.text_changed()) {
+    env->UpdateUnsavedFile(filename, str);
+    std::vector<std::string> cmd_args_strs;
+    ClangCompileArgs(filename, &cmd_args_strs);
+    std::vector<const char*> cmd_args;
+    for (auto& arg : cmd_args_strs) {
+      cmd_args.push_back(arg.c_str());
+    }
+    Log() << "libclang args: " << absl::StrJoin(cmd_args, " ");
+    std::vector<CXUnsavedFile> unsaved_files = env->GetUnsavedFiles();
+    const int options = env->clang_defaultEditingTranslationUnitOptions() |
+                        CXTranslationUnit_KeepGoing |
+                        CXTranslationUnit_DetailedPreprocessingRecord;
+    if (tu_ != NULL) env->clang_disposeTranslationUnit(tu_);
+    tu_ = env->clang_parseTranslationUnit(
+        env->index(), filename.c_str(), cmd_args.data(), cmd_args.size(),
+        unsaved_files.data(), unsaved_files.size(), options);
+    if (tu_ == NULL) {
+      Log() << "Cannot parse translation unit";
+    }
+    Log() << "Parsed: " << tu_;
+  }
+  CXTranslationUnit tu = tu_;
+  std::vector<CXUnsavedFile> unsaved_files = env->GetUnsavedFiles();
+
+  if (content_changed && !AnnotateContent(tu, notification, str, &response)) {
+    return response;
+  }
 
   /*
    * autocomplete suggestions
@@ -438,9 +461,5 @@ EditResponse LibClangCollaborator::Edit(const EditNotification& notification) {
     env->clang_disposeCodeCompleteResults(results);
   }
 
-  env->clang_disposeTranslationUnit(tu);
-
-  token_editor_.Publish();
-  diagnostic_editor_.Publish(notification.content, &response);
   return response;
 }
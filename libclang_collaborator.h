@@ -15,8 +15,10 @@
 
 #include <memory>
 #include "buffer.h"
+#include "clang-c/Index.h"
 #include "content_latch.h"
 #include "diagnostic.h"
+#include "token_span_editor.h"
 
 class LibClangCollaborator final : public SyncCollaborator {
  public:
@@ -26,10 +28,18 @@ class LibClangCollaborator final : public SyncCollaborator {
   EditResponse Edit(const EditNotification& notification) override;
 
  private:
+  // publishes tokens, gutter notes, referenced files and diagnostics of the
+  // parse tu of str; false if the file's range could not be found
+  bool AnnotateContent(CXTranslationUnit tu,
+                       const EditNotification& notification,
+                       const std::string& str, EditResponse* response);
+
   const Buffer* const buffer_;
   ContentLatch content_latch_;
-  USet<ID> last_cursors_;
-  UMapEditor<ID, Annotation<Tag>> token_editor_;
+  // parse of the last text seen, kept while only ids change
+  CXTranslationUnit tu_ = nullptr;
+  uint64_t cursors_version_ = 0;
+  TokenSpanEditor token_editor_;
   DiagnosticEditor diagnostic_editor_;
   USetEditor<std::string> ref_editor_;
   UMapEditor<ID, std::string> gutter_notes_editor_;
@@ -14,6 +14,7 @@
 #pragma once
 
 #include <memory>
+#include "fingerprint.h"
 
 template <class T>
 class List {
@@ -23,7 +24,7 @@ class List {
   List Push(const T& value) { return List(NodePtr(new Node{value, root_})); }
 
   template <class F>
-  void ForEach(F&& f) {
+  void ForEach(F&& f) const {
     Node* n = root_.get();
     while (n) {
       f(n->value);
@@ -64,3 +65,13 @@ class List {
 
   List(NodePtr n) : root_(n) {}
 };
+
+template <class T>
+void Fingerprint(Fingerprinter* f, const List<T>& list) {
+  size_t n = 0;
+  list.ForEach([&](const T& value) {
+    Fingerprint(f, value);
+    n++;
+  });
+  f->U64(n);
+}
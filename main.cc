@@ -18,8 +18,10 @@
 #include "fixit_collaborator.h"
 #include "godbolt_collaborator.h"
 #include "libclang_collaborator.h"
+#include "reclaimer.h"
 #include "referenced_file_collaborator.h"
 #include "render.h"
+#include "snapshot_collaborator.h"
 #include "terminal_collaborator.h"
 #include "terminal_color.h"
 
@@ -46,6 +48,7 @@ class Application {
     buffer_.MakeCollaborator<GodboltCollaborator>();
     buffer_.MakeCollaborator<FixitCollaborator>();
     buffer_.MakeCollaborator<ReferencedFileCollaborator>();
+    buffer_.MakeCollaborator<SnapshotCollaborator>();
   }
 
   ~Application() { endwin(); }
@@ -151,5 +154,7 @@ int main(int argc, char** argv) {
     fprintf(stderr, "ERROR: %s", e.what());
     _exit(1);
   }
+  // don't leave its thread dropping nodes while the process is torn down
+  Reclaimer::Get()->Stop();
   return 0;
 }
@@ -0,0 +1,27 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+// The persistent ordered map used by String, UMap and USet.
+// Defaults to AVL; build with --define map=btree (CED_BTREE) to use BTree.
+
+#ifdef CED_BTREE
+#include "btree.h"
+template <class K, class V, class Summary = NoSummary>
+using PMap = BTree<K, V, Summary>;
+#else
+#include "avl.h"
+template <class K, class V, class Summary = NoSummary>
+using PMap = AVL<K, V, Summary>;
+#endif
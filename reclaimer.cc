@@ -0,0 +1,87 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "reclaimer.h"
+#include <thread>
+
+namespace {
+thread_local bool on_reclaimer_thread = false;
+}  // namespace
+
+constexpr size_t Reclaimer::kTickBudget;
+
+Reclaimer::Reclaimer() : thread_([this]() { Run(); }) {}
+
+Reclaimer* Reclaimer::Get() {
+  static Reclaimer* reclaimer = new Reclaimer;
+  return reclaimer;
+}
+
+bool Reclaimer::OnReclaimerThread() { return on_reclaimer_thread; }
+
+void Reclaimer::Register(Source* source) {
+  absl::MutexLock lock(&mu_);
+  sources_.push_back(source);
+}
+
+size_t Reclaimer::queue_depth() const {
+  absl::MutexLock lock(&mu_);
+  return queued_ > 0 ? queued_ : 0;
+}
+
+void Reclaimer::Drain() {
+  auto drained = [this]() {
+    mu_.AssertHeld();
+    return queued_ <= 0;
+  };
+  mu_.LockWhen(absl::Condition(&drained));
+  mu_.Unlock();
+}
+
+void Reclaimer::Stop() {
+  bool join;
+  {
+    absl::MutexLock lock(&mu_);
+    join = !stopping_;
+    stopping_ = true;
+  }
+  if (join) thread_.join();
+}
+
+void Reclaimer::Run() {
+  on_reclaimer_thread = true;
+  auto wakeable = [this]() {
+    mu_.AssertHeld();
+    return queued_ > 0 || stopping_;
+  };
+  std::vector<Source*> sources;
+  for (;;) {
+    mu_.LockWhen(absl::Condition(&wakeable));
+    if (queued_ <= 0) {
+      // stopping, and all dropped
+      stopped_ = true;
+      mu_.Unlock();
+      return;
+    }
+    sources = sources_;
+    mu_.Unlock();
+    size_t dropped = 0;
+    for (Source* source : sources) dropped += source->Reclaim(kTickBudget);
+    {
+      absl::MutexLock lock(&mu_);
+      queued_ += static_cast<long>(requeued_) - static_cast<long>(dropped);
+    }
+    requeued_ = 0;
+    std::this_thread::yield();
+  }
+}
@@ -0,0 +1,141 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <stddef.h>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "absl/synchronization/mutex.h"
+
+// Dropping the last reference to a version of a persistent structure frees
+// every node no other version shares: after a large edit, that can be
+// millions of nodes, freed on whichever thread happened to let go last
+// (often one drawing the screen). Instead, node destructors hand the subtrees
+// they were the last owner of to a Graveyard, and a background thread drops
+// them a bounded number per tick.
+class Reclaimer {
+ public:
+  // somewhere dead objects wait
+  class Source {
+   public:
+    // drop up to budget objects (dropping one may queue more, through
+    // Requeued); returns the number dropped
+    virtual size_t Reclaim(size_t budget) = 0;
+
+   protected:
+    ~Source() = default;
+  };
+
+  static Reclaimer* Get();
+
+  void Register(Source* source);
+  // n more objects for a source: push queues them under the reclaimer's
+  // lock, which also guards the sources' incoming queues, so handing a batch
+  // over takes one lock. False once stopped: push is not run, and the caller
+  // drops the objects itself.
+  template <class F>
+  bool Queue(size_t n, F&& push) {
+    absl::MutexLock lock(&mu_);
+    if (stopped_) return false;
+    push();
+    queued_ += n;
+    return true;
+  }
+  // take what was pushed by Queue, under the same lock
+  template <class F>
+  void Collect(F&& take) {
+    absl::MutexLock lock(&mu_);
+    take();
+  }
+  // n objects were queued by the reclaimer thread itself, while reclaiming
+  void Requeued(size_t n) { requeued_ += n; }
+  // objects queued and not yet dropped
+  size_t queue_depth() const;
+  // block until nothing is queued
+  void Drain();
+  // drop everything queued and stop the reclaimer thread, say before exit:
+  // objects buried afterwards are dropped by whoever buries them
+  void Stop();
+
+  static bool OnReclaimerThread();
+
+ private:
+  // objects dropped per tick: between ticks, other threads get the sources'
+  // locks and the allocator
+  static constexpr size_t kTickBudget = 4096;
+
+  Reclaimer();
+  void Run();
+
+  mutable absl::Mutex mu_;
+  std::vector<Source*> sources_ GUARDED_BY(mu_);
+  long queued_ GUARDED_BY(mu_) = 0;
+  bool stopping_ GUARDED_BY(mu_) = false;
+  bool stopped_ GUARDED_BY(mu_) = false;
+  // only touched by the reclaimer thread
+  size_t requeued_ = 0;
+  std::thread thread_;
+};
+
+// Objects of type T, typically references to nodes, whose destruction is left
+// to the reclaimer thread
+template <class T>
+class Graveyard final : public Reclaimer::Source {
+ public:
+  static Graveyard* Get() {
+    static Graveyard* graveyard = new Graveyard;
+    return graveyard;
+  }
+
+  // xs[0], ..., xs[n - 1], handed over together
+  void Bury(T* xs, size_t n) {
+    if (Reclaimer::OnReclaimerThread()) {
+      // while reclaiming: joins the work in hand
+      for (size_t i = 0; i < n; i++) dead_.push_back(std::move(xs[i]));
+      Reclaimer::Get()->Requeued(n);
+      return;
+    }
+    Reclaimer::Get()->Queue(n, [this, xs, n]() {
+      for (size_t i = 0; i < n; i++) incoming_.push_back(std::move(xs[i]));
+    });
+  }
+  void Bury(T x) { Bury(&x, 1); }
+
+  size_t Reclaim(size_t budget) override {
+    Reclaimer::Get()->Collect([this]() {
+      if (dead_.empty()) {
+        dead_.swap(incoming_);
+      } else {
+        for (auto& x : incoming_) dead_.push_back(std::move(x));
+        incoming_.clear();
+      }
+    });
+    size_t dropped = 0;
+    while (dropped < budget && !dead_.empty()) {
+      T x = std::move(dead_.back());
+      dead_.pop_back();
+      dropped++;
+    }
+    return dropped;
+  }
+
+ private:
+  Graveyard() { Reclaimer::Get()->Register(this); }
+
+  // guarded by the reclaimer's lock
+  std::vector<T> incoming_;
+  // only touched by the reclaimer thread
+  std::vector<T> dead_;
+};
@@ -28,3 +28,8 @@ struct SideBuffer {
     return content < other.content;
   }
 };
+
+// as operator<: the content alone
+inline void Fingerprint(Fingerprinter* f, const SideBuffer& side_buffer) {
+  Fingerprint(f, side_buffer.content);
+}
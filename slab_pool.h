@@ -0,0 +1,139 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <mutex>
+#include <new>
+
+// Fixed size-class allocator for small, frequently churned objects (AVL
+// nodes). Each thread keeps a free list; blocks freed on another thread
+// simply join that thread's list. Surplus blocks are handed back to a
+// shared depot in batches, and slabs are never returned to the system.
+template <size_t kSize>
+class SlabPool {
+ public:
+  static_assert(kSize >= 2 * sizeof(void*) &&
+                    kSize % alignof(max_align_t) == 0,
+                "size class must hold two pointers and keep alignment");
+
+  static void* Allocate() {
+    Cache& c = cache();
+    if (c.head == nullptr) c.Refill();
+    Block* b = c.head;
+    c.head = b->next;
+    c.count--;
+    return b;
+  }
+
+  static void Free(void* p) {
+    Cache& c = cache();
+    Block* b = static_cast<Block*>(p);
+    b->next = c.head;
+    c.head = b;
+    if (++c.count >= 2 * kBatch) c.Drain(kBatch);
+  }
+
+ private:
+  struct Block {
+    Block* next;
+  };
+
+  static constexpr size_t kBatch = 256;
+  static constexpr size_t kSlabBytes = 64 * 1024;
+
+  // blocks shared between threads, as a list of batches linked through the
+  // first block of each batch; partial holds the short batches threads
+  // leave behind when they exit
+  struct Depot {
+    std::mutex mu;
+    Block* batches = nullptr;
+    Block* partial = nullptr;
+  };
+
+  static Depot& depot() {
+    static Depot* d = new Depot;
+    return *d;
+  }
+
+  struct Cache {
+    Block* head = nullptr;
+    size_t count = 0;
+
+    ~Cache() {
+      Drain(count);
+      if (head == nullptr) return;
+      // the remainder: fewer than kBatch blocks
+      Depot& d = depot();
+      std::lock_guard<std::mutex> lock(d.mu);
+      *reinterpret_cast<Block**>(head + 1) = d.partial;
+      d.partial = head;
+      head = nullptr;
+      count = 0;
+    }
+
+    void Refill() {
+      Depot& d = depot();
+      {
+        std::lock_guard<std::mutex> lock(d.mu);
+        if (d.batches != nullptr) {
+          Block* batch = d.batches;
+          d.batches = *reinterpret_cast<Block**>(batch + 1);
+          head = batch;
+          count = kBatch;
+          return;
+        }
+        if (d.partial != nullptr) {
+          Block* batch = d.partial;
+          d.partial = *reinterpret_cast<Block**>(batch + 1);
+          head = batch;
+          for (Block* b = batch; b != nullptr; b = b->next) count++;
+          return;
+        }
+      }
+      char* slab = static_cast<char*>(malloc(kSlabBytes));
+      if (slab == nullptr) throw std::bad_alloc();
+      for (size_t i = 0; i + kSize <= kSlabBytes; i += kSize) {
+        Block* b = reinterpret_cast<Block*>(slab + i);
+        b->next = head;
+        head = b;
+        count++;
+      }
+    }
+
+    // return n blocks to the depot, n/kBatch batches at a time (any
+    // remainder stays on the thread until it exits)
+    void Drain(size_t n) {
+      Depot& d = depot();
+      while (n >= kBatch) {
+        Block* batch = head;
+        Block* tail = head;
+        for (size_t i = 1; i < kBatch; i++) tail = tail->next;
+        head = tail->next;
+        tail->next = nullptr;
+        count -= kBatch;
+        n -= kBatch;
+        std::lock_guard<std::mutex> lock(d.mu);
+        *reinterpret_cast<Block**>(batch + 1) = d.batches;
+        d.batches = batch;
+      }
+    }
+  };
+
+  static Cache& cache() {
+    static thread_local Cache c;
+    return c;
+  }
+};
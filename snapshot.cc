@@ -0,0 +1,338 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "snapshot.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <map>
+#include "log.h"
+#include "wire.h"
+
+namespace {
+
+constexpr char kMagic[4] = {'c', 'e', 'd', 's'};
+
+// magic, version, content hash (hi, lo) and length, then (offset, size) per
+// section
+constexpr size_t kHeaderSize = 8 + 3 * 8;
+
+constexpr uint64_t kBeginPosition = Snapshot::kBeginPosition;
+constexpr uint64_t kEndPosition = Snapshot::kEndPosition;
+
+// characters that are not visible (annotations can outlive the text they
+// were made on) take the position of the next visible one
+uint64_t Position(const String& content, ID id) {
+  if (id == String::Begin()) return kBeginPosition;
+  if (id == String::End()) return kEndPosition;
+  return content.OffsetOf(id);
+}
+
+ID Resolve(const String& content, uint64_t position) {
+  if (position == kBeginPosition) return String::Begin();
+  if (position == kEndPosition) return String::End();
+  return content.IDAtOffset(position);
+}
+
+// ids not in content (yet, or any more) belong to no position
+bool Known(const String& content, ID id) { return content.Has(id); }
+
+void EncodeSpan(WireWriter* w, const String& content, ID begin, ID end) {
+  w->U64(Position(content, begin));
+  w->U64(Position(content, end));
+}
+
+bool DecodeSpan(WireReader* r, const String& content, ID* begin, ID* end) {
+  uint64_t b, e;
+  if (!r->U64(&b) || !r->U64(&e)) return false;
+  *begin = Resolve(content, b);
+  *end = Resolve(content, e);
+  return true;
+}
+
+// a sequence whose length is only known once encoded: reserve the count
+class Counted {
+ public:
+  Counted(std::string* out) : out_(out), at_(out->size()) {
+    WireWriter(out).U32(0);
+  }
+  void Add() { n_++; }
+  ~Counted() {
+    for (int i = 0; i < 4; i++) {
+      (*out_)[at_ + i] = static_cast<char>(n_ >> (8 * i));
+    }
+  }
+
+ private:
+  std::string* const out_;
+  const size_t at_;
+  uint32_t n_ = 0;
+};
+
+template <class T>
+void EncodeAnnotations(std::string* out, const String& content,
+                       const AnnotationMap<T>& annotations) {
+  WireWriter w(out);
+  Counted n(out);
+  annotations.ForEach([&](ID, ID begin, const Annotation<T>& annotation) {
+    if (!Known(content, begin) || !Known(content, annotation.end)) return;
+    EncodeSpan(&w, content, begin, annotation.end);
+    Encode(&w, annotation.data);
+    n.Add();
+  });
+}
+
+template <class T>
+bool DecodeAnnotations(WireReader* r, const String& content,
+                       std::vector<std::pair<ID, Annotation<T>>>* out) {
+  uint32_t n;
+  if (!r->U32(&n)) return false;
+  out->clear();
+  for (uint32_t i = 0; i < n; i++) {
+    ID begin;
+    Annotation<T> annotation;
+    if (!DecodeSpan(r, content, &begin, &annotation.end) ||
+        !Decode(r, &annotation.data)) {
+      return false;
+    }
+    out->emplace_back(begin, std::move(annotation));
+  }
+  return r->done();
+}
+
+// diagnostics, each followed by its ranges
+void EncodeDiagnostics(std::string* out, const EditNotification& state) {
+  std::map<ID, std::vector<std::pair<ID, ID>>> ranges;
+  state.diagnostic_ranges.ForEach(
+      [&](ID, ID begin, const Annotation<ID>& range) {
+        if (!Known(state.content, begin) ||
+            !Known(state.content, range.end)) {
+          return;
+        }
+        ranges[range.data].emplace_back(begin, range.end);
+      });
+  WireWriter w(out);
+  Counted n(out);
+  state.diagnostics.ForEach([&](ID id, const Diagnostic& diagnostic) {
+    Encode(&w, diagnostic);
+    const auto& spans = ranges[id];
+    w.U32(spans.size());
+    for (const auto& span : spans) {
+      EncodeSpan(&w, state.content, span.first, span.second);
+    }
+    n.Add();
+  });
+}
+
+void EncodeGutterNotes(std::string* out, const EditNotification& state) {
+  WireWriter w(out);
+  Counted n(out);
+  state.gutter_notes.ForEach([&](ID, ID at, const std::string& note) {
+    if (!Known(state.content, at)) return;
+    w.U64(Position(state.content, at));
+    Encode(&w, note);
+    n.Add();
+  });
+}
+
+void EncodeSideBuffers(std::string* out, const EditNotification& state) {
+  WireWriter w(out);
+  Counted n(out);
+  state.side_buffers.ForEach(
+      [&](ID, const std::string& name, const SideBuffer& side_buffer) {
+        Encode(&w, name);
+        Encode(&w, side_buffer);
+        n.Add();
+      });
+}
+
+}  // namespace
+
+constexpr uint64_t Snapshot::kBeginPosition;
+constexpr uint64_t Snapshot::kEndPosition;
+
+std::string Snapshot::PathFor(const std::string& filename) {
+  const size_t slash = filename.rfind('/');
+  const size_t base = slash == std::string::npos ? 0 : slash + 1;
+  return filename.substr(0, base) + "." + filename.substr(base) +
+         ".ced-snapshot";
+}
+
+std::string Snapshot::Encode(const EditNotification& state) {
+  std::string sections[kSections];
+  EncodeAnnotations(&sections[kTokenTypes], state.content, state.token_types);
+  EncodeDiagnostics(&sections[kDiagnostics], state);
+  EncodeGutterNotes(&sections[kGutterNotes], state);
+  EncodeSideBuffers(&sections[kSideBuffers], state);
+  EncodeAnnotations(&sections[kSideBufferRefs], state.content,
+                    state.side_buffer_refs);
+
+  std::string out;
+  WireWriter w(&out);
+  w.Bytes(kMagic, sizeof(kMagic));
+  w.U32(kSnapshotVersion);
+  const ContentHash hash = state.content.Hash();
+  w.U64(hash.hi());
+  w.U64(hash.lo());
+  w.U64(state.content.Length());
+  uint64_t offset = kHeaderSize + kSections * 16;
+  for (const auto& section : sections) {
+    w.U64(offset);
+    w.U64(section.size());
+    offset += section.size();
+  }
+  for (const auto& section : sections) out += section;
+  return out;
+}
+
+bool Snapshot::Write(const std::string& path, const EditNotification& state) {
+  const std::string data = Encode(state);
+  // written aside and renamed over: a reader never sees half a snapshot
+  const std::string tmp = path + ".tmp";
+  const int fd =
+      open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd == -1) return false;
+  for (size_t done = 0; done < data.size();) {
+    const ssize_t n = write(fd, data.data() + done, data.size() - done);
+    if (n <= 0) {
+      close(fd);
+      unlink(tmp.c_str());
+      return false;
+    }
+    done += n;
+  }
+  close(fd);
+  if (rename(tmp.c_str(), path.c_str()) == -1) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+std::unique_ptr<Snapshot> Snapshot::Open(const std::string& path) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return nullptr;
+  struct stat st;
+  if (fstat(fd, &st) == -1 ||
+      static_cast<size_t>(st.st_size) < kHeaderSize + kSections * 16) {
+    close(fd);
+    return nullptr;
+  }
+  const size_t size = st.st_size;
+  void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return nullptr;
+
+  std::unique_ptr<Snapshot> snapshot(
+      new Snapshot(static_cast<const char*>(map), size));
+  WireReader r(snapshot->map_, size);
+  const char* magic;
+  uint32_t version;
+  if (!r.Bytes(sizeof(kMagic), &magic) ||
+      memcmp(magic, kMagic, sizeof(kMagic)) != 0 || !r.U32(&version) ||
+      version != kSnapshotVersion) {
+    Log() << "snapshot " << path << " is of another format";
+    return nullptr;
+  }
+  for (int i = 0; i < kSections; i++) {
+    const auto section = snapshot->Get(static_cast<Section>(i));
+    if (section.first == nullptr) {
+      Log() << "snapshot " << path << " is truncated";
+      return nullptr;
+    }
+  }
+  return snapshot;
+}
+
+Snapshot::~Snapshot() { munmap(const_cast<char*>(map_), size_); }
+
+bool Snapshot::Matches(const String& content) const {
+  WireReader r(map_ + 8, 3 * 8);
+  uint64_t hi, lo, length;
+  r.U64(&hi);
+  r.U64(&lo);
+  r.U64(&length);
+  const ContentHash hash = content.Hash();
+  return hash.hi() == hi && hash.lo() == lo && content.Length() == length;
+}
+
+std::pair<const char*, size_t> Snapshot::Get(Section section) const {
+  WireReader r(map_ + kHeaderSize + section * 16, 16);
+  uint64_t offset, size;
+  r.U64(&offset);
+  r.U64(&size);
+  if (offset > size_ || size > size_ - offset) return {nullptr, 0};
+  return {map_ + offset, size};
+}
+
+bool Snapshot::TokenTypes(
+    const String& content,
+    std::vector<std::pair<ID, Annotation<Tag>>>* out) const {
+  const auto section = Get(kTokenTypes);
+  WireReader r(section.first, section.second);
+  return DecodeAnnotations(&r, content, out);
+}
+
+bool Snapshot::DiagnosticList(const String& content,
+                              std::vector<Diagnostics>* out) const {
+  const auto section = Get(kDiagnostics);
+  WireReader r(section.first, section.second);
+  uint32_t n;
+  if (!r.U32(&n)) return false;
+  out->clear();
+  for (uint32_t i = 0; i < n; i++) {
+    out->emplace_back();
+    uint32_t ranges;
+    if (!Decode(&r, &out->back().diagnostic) || !r.U32(&ranges)) return false;
+    for (uint32_t j = 0; j < ranges; j++) {
+      ID begin, end;
+      if (!DecodeSpan(&r, content, &begin, &end)) return false;
+      out->back().ranges.emplace_back(begin, end);
+    }
+  }
+  return r.done();
+}
+
+bool Snapshot::GutterNotes(
+    const String& content,
+    std::vector<std::pair<ID, std::string>>* out) const {
+  const auto section = Get(kGutterNotes);
+  WireReader r(section.first, section.second);
+  uint32_t n;
+  if (!r.U32(&n)) return false;
+  out->clear();
+  for (uint32_t i = 0; i < n; i++) {
+    uint64_t at;
+    std::string note;
+    if (!r.U64(&at) || !Decode(&r, &note)) return false;
+    out->emplace_back(Resolve(content, at), std::move(note));
+  }
+  return r.done();
+}
+
+bool Snapshot::SideBuffers(
+    std::vector<std::pair<std::string, SideBuffer>>* out) const {
+  const auto section = Get(kSideBuffers);
+  WireReader r(section.first, section.second);
+  return Decode(&r, out) && r.done();
+}
+
+bool Snapshot::SideBufferRefs(
+    const String& content,
+    std::vector<std::pair<ID, Annotation<SideBufferRef>>>* out) const {
+  const auto section = Get(kSideBufferRefs);
+  WireReader r(section.first, section.second);
+  return DecodeAnnotations(&r, content, out);
+}
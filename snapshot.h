@@ -0,0 +1,96 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "buffer.h"
+
+// What collaborators derived from a file's text (tokens, diagnostics, gutter
+// notes, side buffers), saved so that reopening the file can show it before
+// they have derived it again.
+//
+// A snapshot is keyed by the ContentHash of the text it was taken of, and
+// only applies to text with that hash. Ids are only unique within a session,
+// so a snapshot refers to characters by their offset in that text (with
+// kBeginPosition and kEndPosition for String::Begin() and String::End()),
+// resolved against the ids of the text loaded this session.
+//
+// The file is a header, a table of sections (one per field) and the
+// sections, encoded as by wire.h. Opening one maps it and reads only the
+// header and table; each field is decoded when asked for.
+constexpr uint32_t kSnapshotVersion = 1;
+
+class Snapshot {
+ public:
+  static constexpr uint64_t kBeginPosition = ~uint64_t(1);
+  static constexpr uint64_t kEndPosition = ~uint64_t(0);
+
+  // where the snapshot of filename lives: a hidden file next to it
+  static std::string PathFor(const std::string& filename);
+
+  static std::string Encode(const EditNotification& state);
+  // replaces any snapshot at path; false if it could not be written
+  static bool Write(const std::string& path, const EditNotification& state);
+
+  // null if there is no snapshot at path that this build can read
+  static std::unique_ptr<Snapshot> Open(const std::string& path);
+  ~Snapshot();
+
+  Snapshot(const Snapshot&) = delete;
+  Snapshot& operator=(const Snapshot&) = delete;
+
+  // whether the snapshot was taken of content's text
+  bool Matches(const String& content) const;
+
+  // The fields, resolved against content (which Matches); false if the
+  // section is corrupt.
+  struct Diagnostics {
+    Diagnostic diagnostic;
+    // (begin, end)
+    std::vector<std::pair<ID, ID>> ranges;
+  };
+  bool TokenTypes(const String& content,
+                  std::vector<std::pair<ID, Annotation<Tag>>>* out) const;
+  bool DiagnosticList(const String& content,
+                      std::vector<Diagnostics>* out) const;
+  bool GutterNotes(const String& content,
+                   std::vector<std::pair<ID, std::string>>* out) const;
+  bool SideBuffers(std::vector<std::pair<std::string, SideBuffer>>* out) const;
+  bool SideBufferRefs(
+      const String& content,
+      std::vector<std::pair<ID, Annotation<SideBufferRef>>>* out) const;
+
+ private:
+  enum Section {
+    kTokenTypes,
+    kDiagnostics,
+    kGutterNotes,
+    kSideBuffers,
+    kSideBufferRefs,
+    kSections
+  };
+
+  Snapshot(const char* map, size_t size) : map_(map), size_(size) {}
+
+  // the bytes of a section
+  std::pair<const char*, size_t> Get(Section section) const;
+
+  const char* const map_;
+  const size_t size_;
+};
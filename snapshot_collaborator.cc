@@ -0,0 +1,281 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "snapshot_collaborator.h"
+#include "log.h"
+
+// snapshotting walks every annotation: not on every keystroke
+static constexpr absl::Duration kWriteInterval = absl::Seconds(5);
+
+SnapshotCollaborator::SnapshotCollaborator(const Buffer* buffer)
+    : SyncCollaborator("snapshot", absl::Seconds(0), absl::Seconds(0)),
+      path_(Snapshot::PathFor(buffer->filename())),
+      snapshot_(Snapshot::Open(path_)),
+      token_editor_(site()),
+      diagnostic_editor_(site()),
+      range_editor_(site()),
+      gutter_notes_editor_(site()),
+      side_buffer_editor_(site()),
+      side_buffer_ref_editor_(site()) {
+  RequestDeltas();
+  writer_ = std::thread([this]() { RunWriter(); });
+}
+
+SnapshotCollaborator::~SnapshotCollaborator() {
+  {
+    absl::MutexLock lock(&mu_);
+    quit_ = true;
+  }
+  writer_.join();
+}
+
+EditResponse SnapshotCollaborator::Edit(const EditNotification& notification) {
+  EditResponse response;
+  response.done = notification.shutdown;
+  const Published published = Scan(notification);
+  if (!notification.fully_loaded) return response;
+  if (snapshot_) {
+    if (snapshot_->Matches(notification.content)) {
+      Materialize(notification, &response);
+    } else {
+      Log() << "snapshot " << path_ << " is of other text";
+    }
+    snapshot_.reset();
+    // other sites may have published before the snapshot did
+    rescan_ = true;
+    // what was just published is not in this state: not one to snapshot
+    return response;
+  }
+  Retire(published, &response);
+  MaybeWrite(notification);
+  return response;
+}
+
+void SnapshotCollaborator::Materialize(const EditNotification& notification,
+                                       EditResponse* response) {
+  const String& content = notification.content;
+
+  std::vector<std::pair<ID, Annotation<Tag>>> tokens;
+  std::vector<std::pair<ID, std::string>> gutter_notes;
+  if (snapshot_->TokenTypes(content, &tokens) &&
+      snapshot_->GutterNotes(content, &gutter_notes)) {
+    token_editor_.BeginEdit(&response->token_types);
+    for (const auto& token : tokens) {
+      token_editor_.Add(token.first, token.second);
+    }
+    token_editor_.Publish();
+    gutter_notes_editor_.BeginEdit(&response->gutter_notes);
+    for (const auto& note : gutter_notes) {
+      gutter_notes_editor_.Add(note.first, note.second);
+    }
+    gutter_notes_editor_.Publish();
+    live_tokens_ = true;
+  }
+
+  std::vector<Snapshot::Diagnostics> diagnostics;
+  if (snapshot_->DiagnosticList(content, &diagnostics)) {
+    diagnostic_editor_.BeginEdit(&response->diagnostics);
+    range_editor_.BeginEdit(&response->diagnostic_ranges);
+    for (const auto& d : diagnostics) {
+      const ID id = diagnostic_editor_.Add(d.diagnostic);
+      for (const auto& range : d.ranges) {
+        range_editor_.Add(range.first, Annotation<ID>(range.second, id));
+      }
+    }
+    diagnostic_editor_.Publish();
+    range_editor_.Publish();
+    live_diagnostics_ = true;
+  }
+
+  std::vector<std::pair<std::string, SideBuffer>> side_buffers;
+  std::vector<std::pair<ID, Annotation<SideBufferRef>>> refs;
+  if (snapshot_->SideBuffers(&side_buffers) &&
+      snapshot_->SideBufferRefs(content, &refs)) {
+    side_buffer_editor_.BeginEdit(&response->side_buffers);
+    for (const auto& side_buffer : side_buffers) {
+      side_buffer_editor_.Add(side_buffer.first, side_buffer.second);
+    }
+    side_buffer_editor_.Publish();
+    side_buffer_ref_editor_.BeginEdit(&response->side_buffer_refs);
+    for (const auto& ref : refs) {
+      side_buffer_ref_editor_.Add(ref.first, ref.second);
+    }
+    side_buffer_ref_editor_.Publish();
+    live_side_buffers_ = true;
+  }
+
+  Log() << "snapshot " << path_ << ": " << tokens.size() << " tokens, "
+        << diagnostics.size() << " diagnostics, " << side_buffers.size()
+        << " side buffers";
+}
+
+template <class Buf>
+bool SnapshotCollaborator::Foreign(const Buf& commands) {
+  const uint64_t mine = site()->site_id();
+  for (size_t i = 0; i < commands.size(); i++) {
+    if (commands.data()[i].id.site() != mine) return true;
+  }
+  return false;
+}
+
+template <class K, class V>
+bool SnapshotCollaborator::Replaced(const UMap<K, V>& field) {
+  const uint64_t mine = site()->site_id();
+  bool replaced = false;
+  field.ForEach([&](ID id, const K&, const V&) {
+    replaced |= id.site() != mine;
+  });
+  return replaced;
+}
+
+template <class T>
+bool SnapshotCollaborator::Replaced(const USet<T>& field) {
+  const uint64_t mine = site()->site_id();
+  bool replaced = false;
+  field.ForEach([&](ID id, const T&) { replaced |= id.site() != mine; });
+  return replaced;
+}
+
+SnapshotCollaborator::Published SnapshotCollaborator::Scan(
+    const EditNotification& notification) {
+  Published p;
+  const EditState<VersionTrans>& v = notification.field_versions;
+  if (notification.has_delta && !rescan_) {
+    // the responses since the last notification, in the order integrated
+    for (const auto& r : notification.delta) {
+      const bool tokens = Foreign(r->token_types) || Foreign(r->gutter_notes);
+      const bool diagnostics =
+          Foreign(r->diagnostics) || Foreign(r->diagnostic_ranges);
+      const bool side_buffers =
+          Foreign(r->side_buffers) || Foreign(r->side_buffer_refs);
+      p.tokens |= tokens;
+      p.diagnostics |= diagnostics;
+      p.side_buffers |= side_buffers;
+      if (tokens || diagnostics || side_buffers) derived_current_ = true;
+      if (!r->content.empty()) derived_current_ = false;
+    }
+  } else {
+    // only fields that changed can have been replaced since
+    auto replaced = [this](uint64_t version, uint64_t seen, const auto& field) {
+      return (rescan_ || version != seen) && Replaced(field);
+    };
+    p.tokens = replaced(v.token_types, seen_.token_types,
+                        notification.token_types) ||
+               replaced(v.gutter_notes, seen_.gutter_notes,
+                        notification.gutter_notes);
+    p.diagnostics = replaced(v.diagnostics, seen_.diagnostics,
+                             notification.diagnostics) ||
+                    replaced(v.diagnostic_ranges, seen_.diagnostic_ranges,
+                             notification.diagnostic_ranges);
+    p.side_buffers = replaced(v.side_buffers, seen_.side_buffers,
+                              notification.side_buffers) ||
+                     replaced(v.side_buffer_refs, seen_.side_buffer_refs,
+                              notification.side_buffer_refs);
+    // which came last is lost: trust the derived fields only if the text
+    // stayed put while they changed
+    if (v.content != seen_.content) {
+      derived_current_ = false;
+    } else if (p.tokens || p.diagnostics || p.side_buffers) {
+      derived_current_ = true;
+    }
+    rescan_ = false;
+  }
+  seen_ = v;
+  return p;
+}
+
+void SnapshotCollaborator::Retire(const Published& published,
+                                  EditResponse* response) {
+  // tokens, gutter notes and diagnostics come from the same parse: once it
+  // publishes any of them, it has replaced them all
+  if (live_tokens_ && published.tokens) {
+    token_editor_.BeginEdit(&response->token_types);
+    token_editor_.Publish();
+    gutter_notes_editor_.BeginEdit(&response->gutter_notes);
+    gutter_notes_editor_.Publish();
+    live_tokens_ = false;
+    if (live_diagnostics_) {
+      diagnostic_editor_.BeginEdit(&response->diagnostics);
+      diagnostic_editor_.Publish();
+      range_editor_.BeginEdit(&response->diagnostic_ranges);
+      range_editor_.Publish();
+      live_diagnostics_ = false;
+    }
+  }
+  if (live_diagnostics_ && published.diagnostics) {
+    diagnostic_editor_.BeginEdit(&response->diagnostics);
+    diagnostic_editor_.Publish();
+    range_editor_.BeginEdit(&response->diagnostic_ranges);
+    range_editor_.Publish();
+    live_diagnostics_ = false;
+  }
+  if (live_side_buffers_ && published.side_buffers) {
+    side_buffer_editor_.BeginEdit(&response->side_buffers);
+    side_buffer_editor_.Publish();
+    side_buffer_ref_editor_.BeginEdit(&response->side_buffer_refs);
+    side_buffer_ref_editor_.Publish();
+    live_side_buffers_ = false;
+  }
+}
+
+void SnapshotCollaborator::MaybeWrite(const EditNotification& notification) {
+  // annotations derived from older text must not be saved as if of this one
+  if (!derived_current_) return;
+  const EditState<VersionTrans>& v = notification.field_versions;
+  if (v.content == written_.content && v.token_types == written_.token_types &&
+      v.diagnostics == written_.diagnostics &&
+      v.diagnostic_ranges == written_.diagnostic_ranges &&
+      v.gutter_notes == written_.gutter_notes &&
+      v.side_buffers == written_.side_buffers &&
+      v.side_buffer_refs == written_.side_buffer_refs) {
+    return;
+  }
+  written_ = v;
+  absl::MutexLock lock(&mu_);
+  if (!notification.shutdown && absl::Now() - written_at_ < kWriteInterval) {
+    deferred_.reset(new EditNotification(notification));
+    // already integrated: no need to keep the responses alive
+    deferred_->delta.clear();
+    return;
+  }
+  deferred_.reset();
+  Write(notification);
+}
+
+void SnapshotCollaborator::Write(const EditNotification& notification) {
+  if (!Snapshot::Write(path_, notification)) {
+    Log() << "snapshot " << path_ << " could not be written";
+  }
+  written_at_ = absl::Now();
+}
+
+void SnapshotCollaborator::RunWriter() {
+  auto pending = [this]() {
+    mu_.AssertHeld();
+    return quit_ || deferred_ != nullptr;
+  };
+  absl::MutexLock lock(&mu_);
+  for (;;) {
+    mu_.Await(absl::Condition(&pending));
+    // wait out the interval, which restarts with every write made meanwhile
+    while (!quit_ && absl::Now() < written_at_ + kWriteInterval) {
+      mu_.AwaitWithDeadline(absl::Condition(&quit_),
+                            written_at_ + kWriteInterval);
+    }
+    if (deferred_ != nullptr) {
+      Write(*deferred_);
+      deferred_.reset();
+    }
+    if (quit_) return;
+  }
+}
@@ -0,0 +1,95 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <memory>
+#include <thread>
+#include "absl/synchronization/mutex.h"
+#include "buffer.h"
+#include "snapshot.h"
+
+// Publishes the snapshot of the file's text, if there is one, as soon as the
+// text is loaded, and withdraws each field of it once the collaborators that
+// derive that field have published their own. Snapshots the buffer again as
+// the text it saves settles, once the fields derived from it have caught up.
+class SnapshotCollaborator final : public SyncCollaborator {
+ public:
+  SnapshotCollaborator(const Buffer* buffer);
+  // writes any snapshot still deferred
+  ~SnapshotCollaborator();
+
+  EditResponse Edit(const EditNotification& notification) override;
+
+ private:
+  // publish the fields of snapshot_
+  void Materialize(const EditNotification& notification,
+                   EditResponse* response);
+  // which groups of fields other sites published since the last
+  // notification
+  struct Published {
+    // token types and gutter notes
+    bool tokens = false;
+    // diagnostics and their ranges
+    bool diagnostics = false;
+    // side buffers and references to them
+    bool side_buffers = false;
+  };
+  // also tracks whether the fields derived from the text are newer than it
+  Published Scan(const EditNotification& notification);
+  // withdraw the fields other collaborators have replaced
+  void Retire(const Published& published, EditResponse* response);
+  void MaybeWrite(const EditNotification& notification);
+  void Write(const EditNotification& notification)
+      EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  void RunWriter();
+
+  // whether commands carry records of another site
+  template <class Buf>
+  bool Foreign(const Buf& commands);
+  // whether a field has entries another site published
+  template <class K, class V>
+  bool Replaced(const UMap<K, V>& field);
+  template <class T>
+  bool Replaced(const USet<T>& field);
+
+  const std::string path_;
+  // until the text is loaded
+  std::unique_ptr<Snapshot> snapshot_;
+  // fields still published from the snapshot
+  bool live_tokens_ = false;
+  bool live_diagnostics_ = false;
+  bool live_side_buffers_ = false;
+  UMapEditor<ID, Annotation<Tag>> token_editor_;
+  USetEditor<Diagnostic> diagnostic_editor_;
+  UMapEditor<ID, Annotation<ID>> range_editor_;
+  UMapEditor<ID, std::string> gutter_notes_editor_;
+  UMapEditor<std::string, SideBuffer> side_buffer_editor_;
+  UMapEditor<ID, Annotation<SideBufferRef>> side_buffer_ref_editor_;
+  // the field versions of the last notification
+  EditState<VersionTrans> seen_{};
+  // the delta of the next notification cannot be trusted to say what was
+  // published: scan the fields themselves
+  bool rescan_ = true;
+  // other sites published derived fields after the text last changed
+  bool derived_current_ = false;
+  // the field versions last snapshotted, or deferred to be
+  EditState<VersionTrans> written_{};
+  absl::Mutex mu_;
+  absl::Time written_at_ GUARDED_BY(mu_) = absl::InfinitePast();
+  // the state to snapshot once kWriteInterval has passed since written_at_:
+  // the last edit of a burst may not be followed by another for a while
+  std::unique_ptr<EditNotification> deferred_ GUARDED_BY(mu_);
+  bool quit_ GUARDED_BY(mu_) = false;
+  std::thread writer_;
+};
@@ -0,0 +1,202 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "snapshot.h"
+#include <stdio.h>
+#include "gtest/gtest.h"
+#include "snapshot_collaborator.h"
+#include "temp_file.h"
+
+static String Load(Site* site, const std::string& text) {
+  EditResponse r;
+  String::MakeRawInsert(&r.content, site, text, String::Begin(),
+                        String::End());
+  EditNotification state;
+  IntegrateResponse(r, &state);
+  return state.content;
+}
+
+// a state with every snapshotted field set, as collaborators would leave it
+static EditNotification Annotated(Site* site, const std::string& text) {
+  EditNotification state;
+  state.content = Load(site, text);
+  const String& content = state.content;
+  EditResponse r;
+  AnnotationMap<Tag>::MakeInsert(
+      &r.token_types, site, content.IDAtOffset(0),
+      Annotation<Tag>(content.IDAtOffset(3), Tag().Push("keyword")));
+  const ID diagnostic = USet<Diagnostic>::MakeInsert(
+      &r.diagnostics, site, Diagnostic{0, Severity::ERROR, "no main"});
+  AnnotationMap<ID>::MakeInsert(
+      &r.diagnostic_ranges, site, content.IDAtOffset(4),
+      Annotation<ID>(content.IDAtOffset(5), diagnostic));
+  UMap<ID, std::string>::MakeInsert(&r.gutter_notes, site,
+                                    content.IDAtOffset(7), "note");
+  SideBuffer side;
+  side.content = {'r', 'e', 't'};
+  side.tokens = {Tag(), Tag(), Tag()};
+  side.CalcLines();
+  UMap<std::string, SideBuffer>::MakeInsert(&r.side_buffers, site, "disasm",
+                                            side);
+  AnnotationMap<SideBufferRef>::MakeInsert(
+      &r.side_buffer_refs, site, String::Begin(),
+      Annotation<SideBufferRef>(String::End(), SideBufferRef{"disasm", {0}}));
+  IntegrateResponse(r, &state);
+  return state;
+}
+
+TEST(Snapshot, ResolvesOntoTextLoadedAgain) {
+  NamedTempFile tmp;
+  {
+    Site site;
+    ASSERT_TRUE(Snapshot::Write(tmp.filename(),
+                                Annotated(&site, "int x;\nint y;\n")));
+  }
+  // a new session: same text, new ids
+  Site site;
+  const String content = Load(&site, "int x;\nint y;\n");
+  auto snapshot = Snapshot::Open(tmp.filename());
+  ASSERT_NE(snapshot, nullptr);
+  ASSERT_TRUE(snapshot->Matches(content));
+
+  std::vector<std::pair<ID, Annotation<Tag>>> tokens;
+  ASSERT_TRUE(snapshot->TokenTypes(content, &tokens));
+  ASSERT_EQ(tokens.size(), 1u);
+  EXPECT_EQ(tokens[0].first, content.IDAtOffset(0));
+  EXPECT_EQ(tokens[0].second.end, content.IDAtOffset(3));
+  EXPECT_EQ(tokens[0].second.data.Head(), "keyword");
+
+  std::vector<Snapshot::Diagnostics> diagnostics;
+  ASSERT_TRUE(snapshot->DiagnosticList(content, &diagnostics));
+  ASSERT_EQ(diagnostics.size(), 1u);
+  EXPECT_EQ(diagnostics[0].diagnostic.message, "no main");
+  ASSERT_EQ(diagnostics[0].ranges.size(), 1u);
+  EXPECT_EQ(diagnostics[0].ranges[0].first, content.IDAtOffset(4));
+  EXPECT_EQ(diagnostics[0].ranges[0].second, content.IDAtOffset(5));
+
+  std::vector<std::pair<ID, std::string>> notes;
+  ASSERT_TRUE(snapshot->GutterNotes(content, &notes));
+  ASSERT_EQ(notes.size(), 1u);
+  EXPECT_EQ(notes[0].first, content.IDAtOffset(7));
+
+  std::vector<std::pair<std::string, SideBuffer>> side_buffers;
+  ASSERT_TRUE(snapshot->SideBuffers(&side_buffers));
+  ASSERT_EQ(side_buffers.size(), 1u);
+  EXPECT_EQ(side_buffers[0].first, "disasm");
+  EXPECT_EQ(side_buffers[0].second.content.size(), 3u);
+
+  std::vector<std::pair<ID, Annotation<SideBufferRef>>> refs;
+  ASSERT_TRUE(snapshot->SideBufferRefs(content, &refs));
+  ASSERT_EQ(refs.size(), 1u);
+  EXPECT_EQ(refs[0].first, String::Begin());
+  EXPECT_EQ(refs[0].second.end, String::End());
+}
+
+TEST(Snapshot, OnlyMatchesTheSameText) {
+  NamedTempFile tmp;
+  Site site;
+  ASSERT_TRUE(Snapshot::Write(tmp.filename(), Annotated(&site, "int x;\n")));
+  auto snapshot = Snapshot::Open(tmp.filename());
+  ASSERT_NE(snapshot, nullptr);
+  EXPECT_TRUE(snapshot->Matches(Load(&site, "int x;\n")));
+  EXPECT_FALSE(snapshot->Matches(Load(&site, "int y;\n")));
+  EXPECT_FALSE(snapshot->Matches(Load(&site, "int x;\n\n")));
+}
+
+TEST(Snapshot, TruncatedSnapshotIsRefused) {
+  NamedTempFile tmp;
+  Site site;
+  const std::string data =
+      Snapshot::Encode(Annotated(&site, "int x;\nint y;\n"));
+  for (size_t n = 0; n < data.size(); n++) {
+    FILE* f = fopen(tmp.filename().c_str(), "wb");
+    ASSERT_NE(f, nullptr);
+    fwrite(data.data(), 1, n, f);
+    fclose(f);
+    EXPECT_EQ(Snapshot::Open(tmp.filename()), nullptr) << n;
+  }
+}
+
+TEST(SnapshotCollaborator, WritesOnlyAnnotationsOfTheText) {
+  NamedTempFile tmp;
+  const std::string path = Snapshot::PathFor(tmp.filename());
+  Site site;
+  Buffer buffer(tmp.filename());
+  SnapshotCollaborator snapshots(&buffer);
+  auto exists = [&path]() { return access(path.c_str(), F_OK) == 0; };
+
+  // loaded with the annotations at once: which is newer is unknown
+  EditNotification state = Annotated(&site, "int main;");
+  state.fully_loaded = true;
+  state.field_versions.content++;
+  snapshots.Edit(state);
+  EXPECT_FALSE(exists());
+
+  // derived again since
+  auto derived = std::make_shared<EditResponse>();
+  AnnotationMap<Tag>::MakeInsert(
+      &derived->token_types, &site, state.content.IDAtOffset(4),
+      Annotation<Tag>(state.content.IDAtOffset(8), Tag().Push("ident")));
+  IntegrateResponse(*derived, &state);
+  state.has_delta = true;
+  state.delta = {derived};
+  snapshots.Edit(state);
+  EXPECT_TRUE(exists());
+  unlink(path.c_str());
+
+  // typed over, and not derived again before shutting down
+  auto typed = std::make_shared<EditResponse>();
+  state.content.MakeInsert(&typed->content, &site, '\n',
+                           state.content.IDAtOffset(8));
+  IntegrateResponse(*typed, &state);
+  state.delta = {typed};
+  state.shutdown = true;
+  snapshots.Edit(state);
+  EXPECT_FALSE(exists());
+}
+
+TEST(SnapshotCollaborator, WritesTheLastEditOfABurst) {
+  NamedTempFile tmp;
+  const std::string path = Snapshot::PathFor(tmp.filename());
+  Site site;
+  Buffer buffer(tmp.filename());
+  SnapshotCollaborator snapshots(&buffer);
+  auto exists = [&path]() { return access(path.c_str(), F_OK) == 0; };
+  EditNotification state = Annotated(&site, "int main;");
+  state.fully_loaded = true;
+  state.field_versions.content++;
+  snapshots.Edit(state);
+  auto derive = [&](const char* tag) {
+    auto derived = std::make_shared<EditResponse>();
+    AnnotationMap<Tag>::MakeInsert(
+        &derived->token_types, &site, state.content.IDAtOffset(4),
+        Annotation<Tag>(state.content.IDAtOffset(8), Tag().Push(tag)));
+    IntegrateResponse(*derived, &state);
+    state.has_delta = true;
+    state.delta = {derived};
+    snapshots.Edit(state);
+  };
+  derive("ident");
+  EXPECT_TRUE(exists());
+  unlink(path.c_str());
+
+  // too soon after the last write, and nothing follows it
+  derive("function");
+  EXPECT_FALSE(exists());
+  const absl::Time deadline = absl::Now() + absl::Seconds(30);
+  while (!exists() && absl::Now() < deadline) {
+    absl::SleepFor(absl::Milliseconds(100));
+  }
+  EXPECT_TRUE(exists());
+  unlink(path.c_str());
+}
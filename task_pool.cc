@@ -0,0 +1,104 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "task_pool.h"
+#include <algorithm>
+
+namespace {
+
+// what a task threw, kept for Run's caller rather than left to end a worker
+std::exception_ptr Execute(const std::function<void()>& task) {
+  try {
+    task();
+  } catch (...) {
+    return std::current_exception();
+  }
+  return nullptr;
+}
+
+}  // namespace
+
+TaskPool::TaskPool(int threads) {
+  for (int i = 0; i < threads; i++) {
+    threads_.emplace_back([this]() { RunWorker(); });
+  }
+}
+
+TaskPool::~TaskPool() {
+  {
+    absl::MutexLock lock(&mu_);
+    quit_ = true;
+  }
+  for (auto& t : threads_) t.join();
+}
+
+TaskPool* TaskPool::Default() {
+  static TaskPool* pool = new TaskPool(std::min(
+      3, std::max(1, static_cast<int>(std::thread::hardware_concurrency())) -
+             1));
+  return pool;
+}
+
+std::function<void()>* TaskPool::Claim(Batch* batch) {
+  std::function<void()>* task = &batch->tasks[batch->next++];
+  if (batch->next == batch->tasks.size()) {
+    queue_.erase(std::find(queue_.begin(), queue_.end(), batch));
+  }
+  return task;
+}
+
+void TaskPool::Run(std::vector<std::function<void()>> tasks) {
+  if (tasks.empty()) return;
+  Batch batch{std::move(tasks), 0, 0, nullptr};
+  batch.remaining = batch.tasks.size();
+  auto finished = [&batch]() { return batch.remaining == 0; };
+
+  mu_.Lock();
+  queue_.push_back(&batch);
+  // work through the batch alongside the workers...
+  while (batch.next < batch.tasks.size()) {
+    std::function<void()>* task = Claim(&batch);
+    mu_.Unlock();
+    std::exception_ptr error = Execute(*task);
+    mu_.Lock();
+    if (error && !batch.error) batch.error = error;
+    batch.remaining--;
+  }
+  // ...and wait for the tasks they took: the batch must outlive them, even
+  // if one threw
+  mu_.Await(absl::Condition(&finished));
+  mu_.Unlock();
+  if (batch.error) std::rethrow_exception(batch.error);
+}
+
+void TaskPool::RunWorker() {
+  auto runnable = [this]() {
+    mu_.AssertHeld();
+    return quit_ || !queue_.empty();
+  };
+  for (;;) {
+    mu_.LockWhen(absl::Condition(&runnable));
+    if (queue_.empty()) {
+      mu_.Unlock();
+      return;
+    }
+    Batch* batch = queue_.front();
+    std::function<void()>* task = Claim(batch);
+    mu_.Unlock();
+    std::exception_ptr error = Execute(*task);
+    // the batch may be gone as soon as the lock is released
+    absl::MutexLock lock(&mu_);
+    if (error && !batch->error) batch->error = error;
+    batch->remaining--;
+  }
+}
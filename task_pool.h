@@ -0,0 +1,62 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <stddef.h>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <thread>
+#include <vector>
+#include "absl/synchronization/mutex.h"
+
+// A few threads to fan short-lived work out to. Callers run their own tasks
+// too, so a batch completes even while the workers are busy with others (or
+// when there are none).
+class TaskPool {
+ public:
+  explicit TaskPool(int threads);
+  ~TaskPool();
+
+  TaskPool(const TaskPool&) = delete;
+  TaskPool& operator=(const TaskPool&) = delete;
+
+  // shared by the whole process: a thread per spare core, up to three
+  static TaskPool* Default();
+
+  // runs tasks, returning once all of them are done; if any threw, the
+  // first exception caught is rethrown then
+  void Run(std::vector<std::function<void()>> tasks);
+
+ private:
+  struct Batch {
+    std::vector<std::function<void()>> tasks;
+    // first task not yet claimed
+    size_t next;
+    // tasks not yet finished
+    size_t remaining;
+    // the first exception a task threw
+    std::exception_ptr error;
+  };
+
+  // claim the next task of batch, which must have one
+  std::function<void()>* Claim(Batch* batch) EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  void RunWorker();
+
+  absl::Mutex mu_;
+  // batches with unclaimed tasks
+  std::deque<Batch*> queue_ GUARDED_BY(mu_);
+  bool quit_ GUARDED_BY(mu_) = false;
+  std::vector<std::thread> threads_;
+};
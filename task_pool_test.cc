@@ -0,0 +1,49 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "task_pool.h"
+#include <atomic>
+#include <stdexcept>
+#include "gtest/gtest.h"
+
+TEST(TaskPool, RunsEveryTask) {
+  TaskPool pool(2);
+  std::atomic<int> ran{0};
+  std::vector<std::function<void()>> tasks;
+  for (int i = 0; i < 100; i++) tasks.push_back([&ran]() { ran++; });
+  pool.Run(std::move(tasks));
+  EXPECT_EQ(ran, 100);
+}
+
+TEST(TaskPool, ThrowingTaskReachesTheCaller) {
+  TaskPool pool(2);
+  for (int round = 0; round < 10; round++) {
+    std::atomic<int> ran{0};
+    std::vector<std::function<void()>> tasks;
+    for (int i = 0; i < 20; i++) {
+      tasks.push_back([&ran, i]() {
+        ran++;
+        if (i % 5 == 0) throw std::runtime_error("task failed");
+      });
+    }
+    // the rest of the batch still runs before Run rethrows
+    EXPECT_THROW(pool.Run(std::move(tasks)), std::runtime_error);
+    EXPECT_EQ(ran, 20);
+  }
+  // and the workers are still there for the next batch
+  std::atomic<int> ran{0};
+  std::vector<std::function<void()>> tasks;
+  for (int i = 0; i < 20; i++) tasks.push_back([&ran]() { ran++; });
+  pool.Run(std::move(tasks));
+  EXPECT_EQ(ran, 20);
+}
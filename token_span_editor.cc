@@ -0,0 +1,76 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "token_span_editor.h"
+
+void TokenSpanEditor::BeginEdit(AnnotationMap<Tag>::CommandBuf* buf) {
+  buf_ = buf;
+  edit_++;
+  in_run_ = false;
+}
+
+void TokenSpanEditor::Add(ID begin, ID end, const Tag& tag) {
+  const uint32_t t = Intern(tag);
+  if (in_run_ && run_end_ == begin && run_tag_ == t) {
+    run_end_ = end;
+    return;
+  }
+  Flush();
+  in_run_ = true;
+  run_begin_ = begin;
+  run_end_ = end;
+  run_tag_ = t;
+}
+
+void TokenSpanEditor::Publish() {
+  Flush();
+  for (auto it = spans_.begin(); it != spans_.end();) {
+    if (it->second.edit != edit_) {
+      AnnotationMap<Tag>::MakeRemove(buf_, it->second.element);
+      it = spans_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  buf_ = nullptr;
+}
+
+uint32_t TokenSpanEditor::Intern(const Tag& tag) {
+  Fingerprinter f;
+  Fingerprint(&f, tag);
+  const uint64_t fingerprint = f.value();
+  auto range = tag_index_.equal_range(fingerprint);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (Equivalent(tags_[it->second], tag)) return it->second;
+  }
+  tags_.push_back(tag);
+  tag_index_.emplace(fingerprint, tags_.size() - 1);
+  return tags_.size() - 1;
+}
+
+void TokenSpanEditor::Flush() {
+  if (!in_run_) return;
+  in_run_ = false;
+  Span& span = spans_[run_begin_.bits()];
+  if (span.edit != 0 && span.end == run_end_ && span.tag == run_tag_) {
+    span.edit = edit_;
+    return;
+  }
+  // new, or its extent or tag changed
+  if (span.edit != 0) AnnotationMap<Tag>::MakeRemove(buf_, span.element);
+  span.end = run_end_;
+  span.tag = run_tag_;
+  span.element = AnnotationMap<Tag>::MakeInsert(
+      buf_, site_, run_begin_, Annotation<Tag>(run_end_, tags_[run_tag_]));
+  span.edit = edit_;
+}
@@ -0,0 +1,64 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+#include "buffer.h"
+
+// Publishes token highlighting as spans anchored to ids: runs of adjacent
+// tokens with the same tag become one annotation, keyed by the id the run
+// begins at. Tags are interned, so each highlighting pass is diffed against
+// the last one published with integer compares, and only runs whose extent or
+// tag changed produce commands - an edit away from a run leaves it alone.
+class TokenSpanEditor {
+ public:
+  TokenSpanEditor(Site* site) : site_(site) {}
+
+  void BeginEdit(AnnotationMap<Tag>::CommandBuf* buf);
+  // the token [begin, end) has tag; tokens come in document order
+  void Add(ID begin, ID end, const Tag& tag);
+  void Publish();
+
+  // runs currently published
+  size_t size() const { return spans_.size(); }
+
+ private:
+  uint32_t Intern(const Tag& tag);
+  // publish the run being gathered
+  void Flush();
+
+  struct Span {
+    ID end;
+    uint32_t tag = 0;
+    // the annotation published for it
+    ID element;
+    // the last edit that added it; 0 before it is published
+    uint64_t edit = 0;
+  };
+
+  Site* const site_;
+  AnnotationMap<Tag>::CommandBuf* buf_ = nullptr;
+  uint64_t edit_ = 0;
+  std::vector<Tag> tags_;
+  // tags_ indices by fingerprint
+  std::unordered_multimap<uint64_t, uint32_t> tag_index_;
+  // by the bits of the id they begin at
+  std::unordered_map<uint64_t, Span> spans_;
+  // the run being gathered
+  bool in_run_ = false;
+  ID run_begin_;
+  ID run_end_;
+  uint32_t run_tag_ = 0;
+};
@@ -0,0 +1,81 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "token_span_editor.h"
+#include <algorithm>
+#include <map>
+#include <tuple>
+#include "gtest/gtest.h"
+
+class TokenSpanEditorTest : public ::testing::Test {
+ protected:
+  TokenSpanEditorTest() : editor_(&site_) {
+    for (int i = 0; i < 10; i++) ids_.push_back(site_.GenerateID());
+    keyword_ = Tag().Push("keyword");
+    name_ = Tag().Push("name");
+  }
+
+  // publish tokens (begin, end, keyword?) and integrate the result
+  size_t Publish(const std::vector<std::tuple<int, int, bool>>& tokens) {
+    EditResponse r;
+    editor_.BeginEdit(&r.token_types);
+    for (const auto& t : tokens) {
+      editor_.Add(ids_[std::get<0>(t)], ids_[std::get<1>(t)],
+                  std::get<2>(t) ? keyword_ : name_);
+    }
+    editor_.Publish();
+    IntegrateResponse(r, &state_);
+    return r.token_types.size();
+  }
+
+  // begin -> end of the annotations in the state
+  std::map<int, int> Annotations() {
+    std::map<int, int> out;
+    auto index = [this](ID id) {
+      return std::find(ids_.begin(), ids_.end(), id) - ids_.begin();
+    };
+    state_.token_types.ForEach(
+        [&](ID, ID begin, const Annotation<Tag>& annotation) {
+          out[index(begin)] = index(annotation.end);
+        });
+    return out;
+  }
+
+  Site site_;
+  TokenSpanEditor editor_;
+  std::vector<ID> ids_;
+  Tag keyword_;
+  Tag name_;
+  EditNotification state_;
+};
+
+TEST_F(TokenSpanEditorTest, AdjacentTokensWithOneTagAreOneSpan) {
+  Publish({{0, 1, true}, {1, 2, true}, {2, 3, false}, {4, 5, false}});
+  EXPECT_EQ(Annotations(), (std::map<int, int>{{0, 2}, {2, 3}, {4, 5}}));
+  EXPECT_EQ(editor_.size(), 3u);
+}
+
+TEST_F(TokenSpanEditorTest, RepublishesOnlyWhatChanged) {
+  Publish({{0, 1, true}, {2, 3, false}, {4, 5, true}, {6, 7, false}});
+  // the same tokens: nothing to say
+  EXPECT_EQ(Publish({{0, 1, true}, {2, 3, false}, {4, 5, true},
+                     {6, 7, false}}),
+            0u);
+  // one retagged: a remove and an insert
+  EXPECT_EQ(Publish({{0, 1, true}, {2, 3, true}, {4, 5, true},
+                     {6, 7, false}}),
+            2u);
+  // one gone
+  EXPECT_EQ(Publish({{0, 1, true}, {2, 3, true}, {6, 7, false}}), 1u);
+  EXPECT_EQ(Annotations(), (std::map<int, int>{{0, 1}, {2, 3}, {6, 7}}));
+}
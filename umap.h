@@ -15,7 +15,9 @@
 
 #include <map>
 #include <set>
-#include "avl.h"
+#include <unordered_map>
+#include <vector>
+#include "pmap.h"
 #include "crdt.h"
 #include "log.h"
 
@@ -24,34 +26,28 @@ class UMap : public CRDT<UMap<K, V>> {
  public:
   UMap() = default;
 
-  using CommandBuf = typename CRDT<UMap<K, V>>::CommandBuf;
+  // inserts index their key/value pair in the arena
+  typedef ElementOp Op;
+  typedef std::vector<std::pair<K, V>> Arena;
+  typedef CommandBuffer<Op, Arena> CommandBuf;
 
   static ID MakeInsert(CommandBuf* buf, Site* site, const K& k, const V& v) {
-    return MakeCommand(buf, site->GenerateID(), [k, v](UMap m, ID id) {
-      auto* id2v = m.k2id2v_.Lookup(k);
-      if (id2v == nullptr) {
-        // first use of this key
-        return UMap(m.k2id2v_.Add(k, AVL<ID, V>().Add(id, v)),
-                    m.id2kv_.Add(id, std::make_pair(k, v)));
-      } else {
-        return UMap(m.k2id2v_.Add(k, id2v->Add(id, v)),
-                    m.id2kv_.Add(id, std::make_pair(k, v)));
-      }
-    });
+    ID id = site->GenerateID();
+    Op op;
+    op.kind = Op::INSERT;
+    op.id = id;
+    op.index = buf->arena()->size();
+    buf->arena()->emplace_back(k, v);
+    buf->Append(op);
+    return id;
   }
 
   static void MakeRemove(CommandBuf* buf, ID id) {
-    MakeCommand(buf, id, [](UMap m, ID id) {
-      auto* p = m.id2kv_.Lookup(id);
-      auto* id2v = m.k2id2v_.Lookup(p->first);
-      if (id2v == nullptr) return m;  // must already be removed
-      auto id2v_new = id2v->Remove(id);
-      if (id2v_new.Empty()) {
-        return UMap(m.k2id2v_.Remove(p->first), m.id2kv_.Remove(id));
-      } else {
-        return UMap(m.k2id2v_.Add(p->first, id2v_new), m.id2kv_.Remove(id));
-      }
-    });
+    Op op;
+    op.kind = Op::REMOVE;
+    op.id = id;
+    op.index = 0;
+    buf->Append(op);
   }
 
   template <class F>
@@ -61,54 +57,115 @@ class UMap : public CRDT<UMap<K, V>> {
     id2v->ForEach([f](ID, const V& v) { f(v); });
   }
 
+  // visit the values of keys in [lo, hi), in key order, as f(key, value)
+  template <class F>
+  void ForEachValueInRange(const K& lo, const K& hi, F&& f) const {
+    k2id2v_.ForEachInRange(lo, hi,
+                           [&](const K& key, const PMap<ID, V>& id2v) {
+                             id2v.ForEach([&](ID, const V& v) { f(key, v); });
+                           });
+  }
+
   template <class F>
   void ForEach(F&& f) const {
     id2kv_.ForEach(
         [&](ID id, const std::pair<K, V>& kv) { f(id, kv.first, kv.second); });
   }
 
+  bool SameIdentity(const UMap& other) const {
+    return id2kv_.SameIdentity(other.id2kv_);
+  }
+
  private:
-  UMap(AVL<K, AVL<ID, V>>&& k2id2v, const AVL<ID, std::pair<K, V>>&& id2kv)
+  UMap(PMap<K, PMap<ID, V>>&& k2id2v, const PMap<ID, std::pair<K, V>>&& id2kv)
       : k2id2v_(std::move(k2id2v)), id2kv_(std::move(id2kv)) {}
 
-  using CRDT<UMap<K, V>>::MakeCommand;
+  friend class CRDT<UMap<K, V>>;
+  static UMap IntegrateOp(UMap m, const Op& op, const Arena& arena) {
+    switch (op.kind) {
+      case Op::INSERT: {
+        const K& k = arena[op.index].first;
+        const V& v = arena[op.index].second;
+        auto* id2v = m.k2id2v_.Lookup(k);
+        if (id2v == nullptr) {
+          // first use of this key
+          return UMap(m.k2id2v_.Add(k, PMap<ID, V>().Add(op.id, v)),
+                      m.id2kv_.Add(op.id, arena[op.index]));
+        } else {
+          return UMap(m.k2id2v_.Add(k, id2v->Add(op.id, v)),
+                      m.id2kv_.Add(op.id, arena[op.index]));
+        }
+      }
+      case Op::REMOVE: {
+        auto* p = m.id2kv_.Lookup(op.id);
+        auto* id2v = m.k2id2v_.Lookup(p->first);
+        if (id2v == nullptr) return m;  // must already be removed
+        auto id2v_new = id2v->Remove(op.id);
+        if (id2v_new.Empty()) {
+          return UMap(m.k2id2v_.Remove(p->first), m.id2kv_.Remove(op.id));
+        } else {
+          return UMap(m.k2id2v_.Add(p->first, id2v_new),
+                      m.id2kv_.Remove(op.id));
+        }
+      }
+    }
+    return m;
+  }
 
-  AVL<K, AVL<ID, V>> k2id2v_;
-  AVL<ID, std::pair<K, V>> id2kv_;
+  PMap<K, PMap<ID, V>> k2id2v_;
+  PMap<ID, std::pair<K, V>> id2kv_;
 };
 
 template <class K, class V>
 class UMapEditor {
  public:
   UMapEditor(Site* site) : site_(site) {}
-  void BeginEdit(typename UMap<K, V>::CommandBuf* buf) { buf_ = buf; }
+  void BeginEdit(typename UMap<K, V>::CommandBuf* buf) {
+    buf_ = buf;
+    edit_++;
+  }
   ID Add(const K& k, const V& v) {
-    auto kv = std::make_pair(k, v);
-    auto it = last_.find(kv);
-    if (it == last_.end()) {
-      return new_[kv] = UMap<K, V>::MakeInsert(buf_, site_, k, v);
-    } else {
-      new_.insert(*it);
-      return it->second;
+    Fingerprinter f;
+    Fingerprint(&f, k);
+    Fingerprint(&f, v);
+    const uint64_t fingerprint = f.value();
+    auto range = entries_.equal_range(fingerprint);
+    for (auto it = range.first; it != range.second; ++it) {
+      Entry& e = it->second;
+      if (Equivalent(e.key, k) && Equivalent(e.value, v)) {
+        e.edit = edit_;
+        return e.id;
+      }
     }
+    const ID id = UMap<K, V>::MakeInsert(buf_, site_, k, v);
+    entries_.emplace(fingerprint, Entry{k, v, id, edit_});
+    return id;
   }
   void Publish() {
-    for (auto it = last_.begin(); it != last_.end();) {
-      auto next = it;
-      ++next;
-      if (new_.find(it->first) == new_.end()) {
-        UMap<K, V>::MakeRemove(buf_, it->second);
+    for (auto it = entries_.begin(); it != entries_.end();) {
+      if (it->second.edit != edit_) {
+        UMap<K, V>::MakeRemove(buf_, it->second.id);
+        it = entries_.erase(it);
+      } else {
+        ++it;
       }
-      it = next;
     }
-    last_.swap(new_);
-    new_.clear();
     buf_ = nullptr;
   }
 
  private:
+  struct Entry {
+    K key;
+    V value;
+    ID id;
+    // the last edit that added it
+    uint64_t edit;
+  };
+
   Site* const site_;
   typename UMap<K, V>::CommandBuf* buf_ = nullptr;
-  std::map<std::pair<K, V>, ID> last_;
-  std::map<std::pair<K, V>, ID> new_;
+  uint64_t edit_ = 0;
+  // by fingerprint of (key, value)
+  std::unordered_multimap<uint64_t, Entry> entries_;
 };
+
@@ -14,7 +14,9 @@
 #pragma once
 
 #include <map>
-#include "avl.h"
+#include <unordered_map>
+#include <vector>
+#include "pmap.h"
 #include "crdt.h"
 
 template <class T>
@@ -22,18 +24,28 @@ class USet : public CRDT<USet<T>> {
  public:
   USet() {}
 
-  using typename CRDT<USet<T>>::CommandBuf;
+  // inserts index their value in the arena
+  typedef ElementOp Op;
+  typedef std::vector<T> Arena;
+  typedef CommandBuffer<Op, Arena> CommandBuf;
 
   static ID MakeInsert(CommandBuf* buf, Site* site, const T& value) {
-    return MakeCommand(buf, site->GenerateID(), [value](USet<T> uset, ID id) {
-      return USet<T>(uset.avl_.Add(id, value));
-    });
+    ID id = site->GenerateID();
+    Op op;
+    op.kind = Op::INSERT;
+    op.id = id;
+    op.index = buf->arena()->size();
+    buf->arena()->push_back(value);
+    buf->Append(op);
+    return id;
   }
 
   static void MakeRemove(CommandBuf* buf, ID id) {
-    MakeCommand(buf, id, [](USet<T> uset, ID id) {
-      return USet<T>(uset.avl_.Remove(id));
-    });
+    Op op;
+    op.kind = Op::REMOVE;
+    op.id = id;
+    op.index = 0;
+    buf->Append(op);
   }
 
   template <class F>
@@ -51,43 +63,70 @@ class USet : public CRDT<USet<T>> {
   }
 
  private:
-  using CRDT<USet<T>>::MakeCommand;
-  USet(AVL<ID, T> avl) : avl_(avl) {}
+  friend class CRDT<USet<T>>;
+  static USet<T> IntegrateOp(USet<T> uset, const Op& op, const Arena& arena) {
+    switch (op.kind) {
+      case Op::INSERT:
+        return USet<T>(uset.avl_.Add(op.id, arena[op.index]));
+      case Op::REMOVE:
+        return USet<T>(uset.avl_.Remove(op.id));
+    }
+    return uset;
+  }
 
-  AVL<ID, T> avl_;
+  USet(PMap<ID, T> avl) : avl_(avl) {}
+
+  PMap<ID, T> avl_;
 };
 
 template <class T>
 class USetEditor {
  public:
   USetEditor(Site* site) : site_(site) {}
-  void BeginEdit(typename USet<T>::CommandBuf* buf) { buf_ = buf; }
+  void BeginEdit(typename USet<T>::CommandBuf* buf) {
+    buf_ = buf;
+    edit_++;
+  }
   ID Add(const T& v) {
-    auto it = last_.find(v);
-    if (it == last_.end()) {
-      return new_[v] = USet<T>::MakeInsert(buf_, site_, v);
-    } else {
-      new_.insert(*it);
-      return it->second;
+    Fingerprinter f;
+    Fingerprint(&f, v);
+    const uint64_t fingerprint = f.value();
+    auto range = entries_.equal_range(fingerprint);
+    for (auto it = range.first; it != range.second; ++it) {
+      Entry& e = it->second;
+      if (Equivalent(e.value, v)) {
+        e.edit = edit_;
+        return e.id;
+      }
     }
+    const ID id = USet<T>::MakeInsert(buf_, site_, v);
+    entries_.emplace(fingerprint, Entry{v, id, edit_});
+    return id;
   }
   void Publish() {
-    for (auto it = last_.begin(); it != last_.end();) {
-      auto next = it;
-      ++next;
-      if (new_.find(it->first) == new_.end()) {
-        USet<T>::MakeRemove(buf_, it->second);
+    for (auto it = entries_.begin(); it != entries_.end();) {
+      if (it->second.edit != edit_) {
+        USet<T>::MakeRemove(buf_, it->second.id);
+        it = entries_.erase(it);
+      } else {
+        ++it;
       }
-      it = next;
     }
-    last_.swap(new_);
-    new_.clear();
     buf_ = nullptr;
   }
 
  private:
+  struct Entry {
+    T value;
+    ID id;
+    // the last edit that added it
+    uint64_t edit;
+  };
+
   Site* const site_;
   typename USet<T>::CommandBuf* buf_ = nullptr;
-  std::map<T, ID> last_;
-  std::map<T, ID> new_;
+  uint64_t edit_ = 0;
+  // by fingerprint of the value
+  std::unordered_multimap<uint64_t, Entry> entries_;
 };
+
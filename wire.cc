@@ -0,0 +1,315 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "wire.h"
+#include <string.h>
+#include <stdexcept>
+
+namespace {
+
+constexpr char kMagic[4] = {'c', 'e', 'd', 'w'};
+
+// SiteTable entries decoded ids never take
+constexpr uint32_t kReservedSites = SiteTable::kMaxEntries / 4;
+
+// applies f to each field of an EditState, in encoding order
+template <class State, class F>
+bool ForEachField(State* state, F&& f) {
+  return f(&state->content) && f(&state->token_types) &&
+         f(&state->diagnostics) && f(&state->diagnostic_ranges) &&
+         f(&state->side_buffers) && f(&state->side_buffer_refs) &&
+         f(&state->fixits) && f(&state->gutter_notes) &&
+         f(&state->referenced_files) && f(&state->cursors);
+}
+
+struct EncodeField {
+  WireWriter* w;
+  template <class T>
+  bool operator()(const T* field) const {
+    Encode(w, *field);
+    return true;
+  }
+};
+
+struct DecodeField {
+  WireReader* r;
+  template <class T>
+  bool operator()(T* field) const {
+    return Decode(r, field);
+  }
+};
+
+enum ResponseFlag : uint8_t {
+  kDone = 1,
+  kBecomeUsed = 2,
+  kBecomeLoaded = 4,
+  kReferencedFileChanged = 8,
+};
+
+}  // namespace
+
+std::string EncodeResponse(const EditResponse& response) {
+  std::string out;
+  WireWriter w(&out);
+  w.Bytes(kMagic, sizeof(kMagic));
+  w.U32(kWireVersion);
+  w.U8((response.done ? kDone : 0) | (response.become_used ? kBecomeUsed : 0) |
+       (response.become_loaded ? kBecomeLoaded : 0) |
+       (response.referenced_file_changed ? kReferencedFileChanged : 0));
+  ForEachField(&response, EncodeField{&w});
+  return out;
+}
+
+bool DecodeResponse(const char* data, size_t size, EditResponse* response) {
+  WireReader r(data, size);
+  const char* magic;
+  uint32_t version;
+  uint8_t flags;
+  if (!r.Bytes(sizeof(kMagic), &magic) ||
+      memcmp(magic, kMagic, sizeof(kMagic)) != 0 || !r.U32(&version) ||
+      version != kWireVersion || !r.U8(&flags)) {
+    return false;
+  }
+  response->done = flags & kDone;
+  response->become_used = flags & kBecomeUsed;
+  response->become_loaded = flags & kBecomeLoaded;
+  response->referenced_file_changed = flags & kReferencedFileChanged;
+  return ForEachField(response, DecodeField{&r}) && r.done();
+}
+
+// ids travel as (site, clock): SiteTable entries are this process's own
+void Encode(WireWriter* w, const ID& id) {
+  w->U64(id.site());
+  w->U64(id.clock());
+}
+
+bool Decode(WireReader* r, ID* id) {
+  uint64_t site, clock;
+  if (!r->U64(&site) || !r->U64(&clock)) return false;
+  const uint64_t epoch = clock >> ID::kClockBits;
+  uint32_t entry;
+  if (!SiteTable::Find(site, epoch, &entry)) {
+    // keep the last entries for sites of this process
+    if (!r->AllowNewSite() ||
+        SiteTable::Size() >= SiteTable::kMaxEntries - kReservedSites) {
+      return false;
+    }
+    try {
+      entry = SiteTable::Intern(site, epoch);
+    } catch (std::overflow_error&) {
+      return false;
+    }
+  }
+  *id = ID::FromBits(uint64_t(entry) << ID::kClockBits |
+                     (clock & ID::kClockMask));
+  return true;
+}
+
+void Encode(WireWriter* w, const std::string& s) {
+  w->U32(s.size());
+  w->Bytes(s.data(), s.size());
+}
+
+bool Decode(WireReader* r, std::string* s) {
+  uint32_t n;
+  const char* p;
+  if (!r->U32(&n) || !r->Bytes(n, &p)) return false;
+  s->assign(p, n);
+  return true;
+}
+
+void Encode(WireWriter* w, const Tag& tag) {
+  uint32_t n = 0;
+  for (Tag t = tag; !t.Empty(); t = t.Tail()) n++;
+  w->U32(n);
+  for (Tag t = tag; !t.Empty(); t = t.Tail()) Encode(w, t.Head());
+}
+
+bool Decode(WireReader* r, Tag* tag) {
+  std::vector<std::string> parts;
+  if (!Decode(r, &parts)) return false;
+  *tag = Tag();
+  for (auto it = parts.rbegin(); it != parts.rend(); ++it) {
+    *tag = tag->Push(*it);
+  }
+  return true;
+}
+
+void Encode(WireWriter* w, const Diagnostic& diagnostic) {
+  w->U64(diagnostic.index);
+  w->U8(static_cast<uint8_t>(diagnostic.severity));
+  Encode(w, diagnostic.message);
+}
+
+bool Decode(WireReader* r, Diagnostic* diagnostic) {
+  uint64_t index;
+  uint8_t severity;
+  if (!r->U64(&index) || !r->U8(&severity) ||
+      severity > static_cast<uint8_t>(Severity::FATAL)) {
+    return false;
+  }
+  diagnostic->index = index;
+  diagnostic->severity = static_cast<Severity>(severity);
+  return Decode(r, &diagnostic->message);
+}
+
+void Encode(WireWriter* w, const Fixit& fixit) {
+  w->U8(static_cast<uint8_t>(fixit.type));
+  Encode(w, fixit.diagnostic);
+  w->U64(fixit.index);
+  Encode(w, fixit.begin);
+  Encode(w, fixit.end);
+  Encode(w, fixit.replacement);
+}
+
+bool Decode(WireReader* r, Fixit* fixit) {
+  uint8_t type;
+  uint64_t index;
+  if (!r->U8(&type) ||
+      type > static_cast<uint8_t>(Fixit::Type::TIDY_FIX) ||
+      !Decode(r, &fixit->diagnostic) || !r->U64(&index) ||
+      !Decode(r, &fixit->begin) || !Decode(r, &fixit->end)) {
+    return false;
+  }
+  fixit->type = static_cast<Fixit::Type>(type);
+  fixit->index = index;
+  return Decode(r, &fixit->replacement);
+}
+
+void Encode(WireWriter* w, const SideBuffer& side_buffer) {
+  w->U32(side_buffer.content.size());
+  w->Bytes(side_buffer.content.data(), side_buffer.content.size());
+  Encode(w, side_buffer.tokens);
+  w->U32(side_buffer.line_ofs.size());
+  for (size_t ofs : side_buffer.line_ofs) w->U64(ofs);
+}
+
+bool Decode(WireReader* r, SideBuffer* side_buffer) {
+  uint32_t n;
+  const char* p;
+  if (!r->U32(&n) || !r->Bytes(n, &p)) return false;
+  side_buffer->content.assign(p, p + n);
+  if (!Decode(r, &side_buffer->tokens) || !r->U32(&n)) return false;
+  side_buffer->line_ofs.clear();
+  for (uint32_t i = 0; i < n; i++) {
+    uint64_t ofs;
+    if (!r->U64(&ofs)) return false;
+    side_buffer->line_ofs.push_back(ofs);
+  }
+  return true;
+}
+
+void Encode(WireWriter* w, const SideBufferRef& ref) {
+  Encode(w, ref.name);
+  w->U32(ref.lines.size());
+  for (int line : ref.lines) w->U32(line);
+}
+
+bool Decode(WireReader* r, SideBufferRef* ref) {
+  uint32_t n;
+  if (!Decode(r, &ref->name) || !r->U32(&n)) return false;
+  ref->lines.clear();
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t line;
+    if (!r->U32(&line)) return false;
+    ref->lines.push_back(static_cast<int>(line));
+  }
+  return true;
+}
+
+void Encode(WireWriter* w, const String::Op& op) {
+  uint32_t a = 0;
+  uint32_t b = 0;
+  switch (op.kind) {
+    case String::Op::INSERT_CHAR:
+      a = static_cast<uint8_t>(op.chr);
+      break;
+    case String::Op::INSERT_RUN:
+      a = op.text.offset;
+      b = op.text.length;
+      break;
+    case String::Op::REMOVE:
+      a = op.count;
+      break;
+  }
+  w->U8(op.kind);
+  w->Bytes("\0\0\0", 3);
+  w->U32(a);
+  w->U32(b);
+  w->U32(0);
+  Encode(w, op.id);
+  Encode(w, op.after);
+  Encode(w, op.before);
+}
+
+bool Decode(WireReader* r, String::Op* op) {
+  uint8_t kind;
+  const char* pad;
+  uint32_t a, b, c;
+  if (!r->U8(&kind) || kind > String::Op::REMOVE || !r->Bytes(3, &pad) ||
+      !r->U32(&a) || !r->U32(&b) || !r->U32(&c) || !Decode(r, &op->id) ||
+      !Decode(r, &op->after) || !Decode(r, &op->before)) {
+    return false;
+  }
+  op->kind = static_cast<String::Op::Kind>(kind);
+  switch (op->kind) {
+    case String::Op::INSERT_CHAR:
+      op->chr = static_cast<char>(a);
+      break;
+    case String::Op::INSERT_RUN:
+      op->text = String::TextRef{a, b};
+      break;
+    case String::Op::REMOVE:
+      op->count = a;
+      break;
+  }
+  return true;
+}
+
+// the n ids starting at id stay on its SiteTable entry: ID::Offset past the
+// end of the clock would carry into the entry bits
+bool FitsClock(ID id, uint64_t n) {
+  return n <= ID::kClockMask + 1 - id.tick();
+}
+
+bool Valid(const String::Op& op, const std::string& text) {
+  switch (op.kind) {
+    case String::Op::INSERT_CHAR:
+      return true;
+    case String::Op::INSERT_RUN:
+      return op.text.length > 0 && op.text.offset <= text.size() &&
+             op.text.length <= text.size() - op.text.offset &&
+             FitsClock(op.id, op.text.length);
+    case String::Op::REMOVE:
+      return FitsClock(op.id, op.count);
+  }
+  return false;
+}
+
+void Encode(WireWriter* w, const ElementOp& op) {
+  w->U8(op.kind);
+  w->Bytes("\0\0\0", 3);
+  w->U32(op.index);
+  Encode(w, op.id);
+}
+
+bool Decode(WireReader* r, ElementOp* op) {
+  uint8_t kind;
+  const char* pad;
+  if (!r->U8(&kind) || kind > ElementOp::REMOVE || !r->Bytes(3, &pad) ||
+      !r->U32(&op->index) || !Decode(r, &op->id)) {
+    return false;
+  }
+  op->kind = static_cast<ElementOp::Kind>(kind);
+  return true;
+}
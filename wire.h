@@ -0,0 +1,221 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+#include "buffer.h"
+
+// Binary encoding of edit responses, so that collaborators can live in other
+// processes.
+//
+// Integers are little-endian and fixed width, sequences are a uint32 count
+// followed by their elements, and command records are fixed size and start
+// 8-byte aligned, so records and text can be read in place. An encoding
+// starts with its format version: decoders refuse any other, and refuse
+// commands that reference payload they do not carry.
+constexpr uint32_t kWireVersion = 1;
+
+std::string EncodeResponse(const EditResponse& response);
+bool DecodeResponse(const char* data, size_t size, EditResponse* response);
+
+class WireWriter {
+ public:
+  explicit WireWriter(std::string* out) : out_(out) {}
+
+  void U8(uint8_t x) { out_->push_back(static_cast<char>(x)); }
+  void U32(uint32_t x) { Fixed(x, 4); }
+  void U64(uint64_t x) { Fixed(x, 8); }
+  void Bytes(const char* p, size_t n) { out_->append(p, n); }
+  // pad to a multiple of 8 bytes
+  void Align() { out_->append((8 - out_->size() % 8) % 8, '\0'); }
+
+ private:
+  void Fixed(uint64_t x, int bytes) {
+    char buf[8];
+    for (int i = 0; i < bytes; i++) buf[i] = static_cast<char>(x >> (8 * i));
+    out_->append(buf, bytes);
+  }
+
+  std::string* const out_;
+};
+
+// Reads fail, rather than run past the end, on truncated input
+class WireReader {
+ public:
+  WireReader(const char* data, size_t size)
+      : begin_(data), p_(data), end_(data + size) {}
+
+  bool U8(uint8_t* x) {
+    if (p_ == end_) return false;
+    *x = static_cast<uint8_t>(*p_++);
+    return true;
+  }
+  bool U32(uint32_t* x) {
+    uint64_t y;
+    if (!Fixed(&y, 4)) return false;
+    *x = static_cast<uint32_t>(y);
+    return true;
+  }
+  bool U64(uint64_t* x) { return Fixed(x, 8); }
+  // the next n bytes, in place
+  bool Bytes(size_t n, const char** p) {
+    if (static_cast<size_t>(end_ - p_) < n) return false;
+    *p = p_;
+    p_ += n;
+    return true;
+  }
+  bool Align() {
+    const char* p;
+    return Bytes((8 - (p_ - begin_) % 8) % 8, &p);
+  }
+  bool done() const { return p_ == end_; }
+
+  // ids may name sites this process has not seen yet: a message may add only
+  // a few SiteTable entries, so that untrusted input cannot fill the table
+  static constexpr uint32_t kMaxNewSites = 64;
+  bool AllowNewSite() { return new_sites_++ < kMaxNewSites; }
+
+ private:
+  bool Fixed(uint64_t* x, int bytes) {
+    const char* p;
+    if (!Bytes(bytes, &p)) return false;
+    *x = 0;
+    for (int i = 0; i < bytes; i++) {
+      *x |= uint64_t(static_cast<uint8_t>(p[i])) << (8 * i);
+    }
+    return true;
+  }
+
+  const char* const begin_;
+  const char* p_;
+  const char* const end_;
+  uint32_t new_sites_ = 0;
+};
+
+// Values
+
+void Encode(WireWriter* w, const ID& id);
+bool Decode(WireReader* r, ID* id);
+void Encode(WireWriter* w, const std::string& s);
+bool Decode(WireReader* r, std::string* s);
+void Encode(WireWriter* w, const Tag& tag);
+bool Decode(WireReader* r, Tag* tag);
+void Encode(WireWriter* w, const Diagnostic& diagnostic);
+bool Decode(WireReader* r, Diagnostic* diagnostic);
+void Encode(WireWriter* w, const Fixit& fixit);
+bool Decode(WireReader* r, Fixit* fixit);
+void Encode(WireWriter* w, const SideBuffer& side_buffer);
+bool Decode(WireReader* r, SideBuffer* side_buffer);
+void Encode(WireWriter* w, const SideBufferRef& ref);
+bool Decode(WireReader* r, SideBufferRef* ref);
+
+template <class T>
+void Encode(WireWriter* w, const Annotation<T>& annotation);
+template <class T>
+bool Decode(WireReader* r, Annotation<T>* annotation);
+template <class A, class B>
+void Encode(WireWriter* w, const std::pair<A, B>& pair);
+template <class A, class B>
+bool Decode(WireReader* r, std::pair<A, B>* pair);
+template <class T>
+void Encode(WireWriter* w, const std::vector<T>& v);
+template <class T>
+bool Decode(WireReader* r, std::vector<T>* v);
+
+template <class T>
+void Encode(WireWriter* w, const Annotation<T>& annotation) {
+  Encode(w, annotation.end);
+  Encode(w, annotation.data);
+}
+
+template <class T>
+bool Decode(WireReader* r, Annotation<T>* annotation) {
+  return Decode(r, &annotation->end) && Decode(r, &annotation->data);
+}
+
+template <class A, class B>
+void Encode(WireWriter* w, const std::pair<A, B>& pair) {
+  Encode(w, pair.first);
+  Encode(w, pair.second);
+}
+
+template <class A, class B>
+bool Decode(WireReader* r, std::pair<A, B>* pair) {
+  return Decode(r, &pair->first) && Decode(r, &pair->second);
+}
+
+template <class T>
+void Encode(WireWriter* w, const std::vector<T>& v) {
+  w->U32(v.size());
+  for (const auto& x : v) Encode(w, x);
+}
+
+template <class T>
+bool Decode(WireReader* r, std::vector<T>* v) {
+  uint32_t n;
+  if (!r->U32(&n)) return false;
+  v->clear();
+  // every element takes at least a byte: don't trust n with the allocation
+  for (uint32_t i = 0; i < n; i++) {
+    v->emplace_back();
+    if (!Decode(r, &v->back())) return false;
+  }
+  return true;
+}
+
+// Commands
+
+// 64 byte records: kind, three bytes of padding, two uint32 arguments (char,
+// text offset and length, or count), four bytes of padding, then the ids
+void Encode(WireWriter* w, const String::Op& op);
+bool Decode(WireReader* r, String::Op* op);
+bool Valid(const String::Op& op, const std::string& text);
+// 24 byte records: kind, three bytes of padding, index, id
+void Encode(WireWriter* w, const ElementOp& op);
+bool Decode(WireReader* r, ElementOp* op);
+template <class Arena>
+bool Valid(const ElementOp& op, const Arena& arena) {
+  return op.kind != ElementOp::INSERT || op.index < arena.size();
+}
+
+template <class Op, class Arena>
+void Encode(WireWriter* w, const CommandBuffer<Op, Arena>& commands) {
+  w->U32(commands.size());
+  w->Align();
+  for (size_t i = 0; i < commands.size(); i++) {
+    Encode(w, commands.data()[i]);
+  }
+  Encode(w, commands.payload());
+}
+
+template <class Op, class Arena>
+bool Decode(WireReader* r, CommandBuffer<Op, Arena>* commands) {
+  uint32_t n;
+  if (!r->U32(&n) || !r->Align()) return false;
+  commands->clear();
+  for (uint32_t i = 0; i < n; i++) {
+    Op op;
+    if (!Decode(r, &op)) return false;
+    commands->Append(op);
+  }
+  if (!Decode(r, commands->arena())) return false;
+  for (size_t i = 0; i < commands->size(); i++) {
+    if (!Valid(commands->data()[i], commands->payload())) return false;
+  }
+  return true;
+}
@@ -0,0 +1,186 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "wire.h"
+#include "gtest/gtest.h"
+
+// responses of each shape collaborators send, in the order they were made
+static std::vector<EditResponse> Corpus() {
+  Site site;
+  EditNotification state;
+  std::vector<EditResponse> corpus;
+  auto add = [&](EditResponse&& r) {
+    IntegrateResponse(r, &state);
+    corpus.emplace_back(std::move(r));
+  };
+
+  EditResponse loaded;
+  loaded.become_loaded = true;
+  String::MakeRawInsert(&loaded.content, &site, "int main() {\n}\n",
+                        String::Begin(), String::End());
+  add(std::move(loaded));
+
+  EditResponse typed;
+  typed.become_used = true;
+  const String& content = state.content;
+  ID after = String::MakeRawInsert(&typed.content, &site, '\t',
+                                   content.IDAtOffset(12),
+                                   content.IDAtOffset(13));
+  String::MakeRawInsert(&typed.content, &site, "return 0;", after,
+                        content.IDAtOffset(13));
+  content.MakeRemove(&typed.content, content.IDAtOffset(0),
+                     content.IDAtOffset(4));
+  USet<ID>::MakeInsert(&typed.cursors, &site, content.IDAtOffset(5));
+  add(std::move(typed));
+
+  EditResponse annotated;
+  const ID a = state.content.IDAtOffset(1);
+  const ID b = state.content.IDAtOffset(4);
+  AnnotationMap<Tag>::MakeInsert(
+      &annotated.token_types, &site, a,
+      Annotation<Tag>(b, Tag().Push("keyword").Push("cxx")));
+  const ID diagnostic = USet<Diagnostic>::MakeInsert(
+      &annotated.diagnostics, &site,
+      Diagnostic{0, Severity::WARNING, "unused \"x\""});
+  AnnotationMap<ID>::MakeInsert(&annotated.diagnostic_ranges, &site, a,
+                                Annotation<ID>(b, diagnostic));
+  SideBuffer side;
+  side.content = {'m', 'o', 'v', '\n', '\0', 'r', 'e', 't'};
+  side.tokens = {Tag().Push("asm"), Tag()};
+  side.CalcLines();
+  UMap<std::string, SideBuffer>::MakeInsert(&annotated.side_buffers, &site,
+                                            "asm", side);
+  AnnotationMap<SideBufferRef>::MakeInsert(
+      &annotated.side_buffer_refs, &site, a,
+      Annotation<SideBufferRef>(b, SideBufferRef{"asm", {0, 1, 7}}));
+  USet<Fixit>::MakeInsert(&annotated.fixits, &site,
+                          Fixit{Fixit::Type::COMPILE_FIX, diagnostic, 3, a, b,
+                                "long"});
+  UMap<ID, std::string>::MakeInsert(&annotated.gutter_notes, &site, a,
+                                    "note");
+  USet<std::string>::MakeInsert(&annotated.referenced_files, &site,
+                                "/usr/include/stdio.h");
+  annotated.referenced_file_changed = true;
+  add(std::move(annotated));
+
+  EditResponse cleared;
+  cleared.done = true;
+  state.token_types.ForEach([&](ID id, ID, const Annotation<Tag>&) {
+    AnnotationMap<Tag>::MakeRemove(&cleared.token_types, id);
+  });
+  state.diagnostics.ForEach([&](ID id, const Diagnostic&) {
+    USet<Diagnostic>::MakeRemove(&cleared.diagnostics, id);
+  });
+  add(std::move(cleared));
+
+  return corpus;
+}
+
+TEST(Wire, RoundTrip) {
+  EditNotification sent;
+  EditNotification received;
+  for (const EditResponse& r : Corpus()) {
+    const std::string bytes = EncodeResponse(r);
+    EditResponse decoded;
+    ASSERT_TRUE(DecodeResponse(bytes.data(), bytes.size(), &decoded));
+    EXPECT_EQ(EncodeResponse(decoded), bytes);
+    EXPECT_EQ(decoded.done, r.done);
+    EXPECT_EQ(decoded.become_used, r.become_used);
+    EXPECT_EQ(decoded.become_loaded, r.become_loaded);
+    EXPECT_EQ(decoded.referenced_file_changed, r.referenced_file_changed);
+    IntegrateResponse(r, &sent);
+    IntegrateResponse(decoded, &received);
+    EXPECT_EQ(received.content.Render(), sent.content.Render());
+  }
+  EXPECT_EQ(received.content.Render(), "main() {\n\treturn 0;}\n");
+}
+
+TEST(Wire, RejectsTruncated) {
+  for (const EditResponse& r : Corpus()) {
+    const std::string bytes = EncodeResponse(r);
+    for (size_t n = 0; n < bytes.size(); n++) {
+      EditResponse decoded;
+      EXPECT_FALSE(DecodeResponse(bytes.data(), n, &decoded)) << n;
+    }
+  }
+}
+
+TEST(Wire, RejectsOtherVersions) {
+  std::string bytes = EncodeResponse(Corpus()[0]);
+  bytes[4]++;
+  EditResponse decoded;
+  EXPECT_FALSE(DecodeResponse(bytes.data(), bytes.size(), &decoded));
+}
+
+TEST(Wire, RejectsTextOutsidePayload) {
+  EditResponse r;
+  String::Op op{String::Op::INSERT_RUN, ID(1, 0), String::Begin(),
+                String::End(), {}};
+  op.text = String::TextRef{1, 3};
+  r.content.Append(op);
+  r.content.arena()->append("abc");
+  const std::string bytes = EncodeResponse(r);
+  EditResponse decoded;
+  EXPECT_FALSE(DecodeResponse(bytes.data(), bytes.size(), &decoded));
+}
+
+TEST(Wire, RejectsIdsPastTheClock) {
+  auto decodes = [](String::Op op, uint32_t n) {
+    EditResponse r;
+    if (op.kind == String::Op::INSERT_RUN) {
+      op.text = String::TextRef{0, n};
+      r.content.arena()->append(n, 'x');
+    } else {
+      op.count = n;
+    }
+    r.content.Append(op);
+    const std::string bytes = EncodeResponse(r);
+    EditResponse decoded;
+    return DecodeResponse(bytes.data(), bytes.size(), &decoded);
+  };
+  // the last two ticks of an epoch
+  const ID last = ID(1, ID::kClockMask - 1);
+  String::Op insert{String::Op::INSERT_RUN, last, String::Begin(),
+                    String::End(), {}};
+  EXPECT_TRUE(decodes(insert, 2));
+  EXPECT_FALSE(decodes(insert, 3));
+  String::Op remove{String::Op::REMOVE, last, ID(), ID(), {}};
+  EXPECT_TRUE(decodes(remove, 2));
+  EXPECT_FALSE(decodes(remove, 3));
+}
+
+TEST(Wire, BoundsNewSitesPerMessage) {
+  // sites nothing in this process has seen
+  std::string bytes;
+  WireWriter w(&bytes);
+  for (uint64_t i = 0; i <= WireReader::kMaxNewSites; i++) {
+    w.U64(0xbad0000 + i);
+    w.U64(i);
+  }
+  WireReader r(bytes.data(), bytes.size());
+  ID id;
+  for (uint64_t i = 0; i < WireReader::kMaxNewSites; i++) {
+    ASSERT_TRUE(Decode(&r, &id));
+    EXPECT_EQ(id.site(), 0xbad0000 + i);
+    EXPECT_EQ(id.clock(), i);
+  }
+  const uint32_t sites = SiteTable::Size();
+  EXPECT_FALSE(Decode(&r, &id));
+  EXPECT_EQ(SiteTable::Size(), sites);
+
+  // once known they cost a message nothing
+  WireReader again(bytes.data(), bytes.size());
+  for (uint64_t i = 0; i < WireReader::kMaxNewSites; i++) {
+    ASSERT_TRUE(Decode(&again, &id));
+  }
+}
@@ -12,121 +12,533 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "woot.h"
+#include <algorithm>
+#include <limits>
+#include <vector>
 
-std::atomic<uint64_t> Site::id_gen_;
 Site String::root_site_;
 ID String::begin_id_ = root_site_.GenerateID();
 ID String::end_id_ = root_site_.GenerateID();
+constexpr size_t String::kMaxRunLength;
+constexpr uint64_t String::kBeginLabel;
+constexpr uint64_t String::kEndLabel;
+constexpr uint64_t String::kLabelSpacing;
 
-String String::IntegrateRemove(ID id) const {
-  const CharInfo* cdel = avl_.Lookup(id);
-  if (!cdel->visible) return *this;
-  auto line_breaks2 = line_breaks_;
-  if (cdel->chr == '\n') {
-    auto* self = line_breaks2.Lookup(id);
-    auto* prev = line_breaks2.Lookup(self->prev);
-    auto* next = line_breaks2.Lookup(self->next);
-    line_breaks2 = line_breaks2.Remove(id)
-                       .Add(self->prev, LineBreak{prev->prev, self->next})
-                       .Add(self->next, LineBreak{self->prev, next->next});
-  }
-  auto avl2 = avl_.Add(id, CharInfo{false, cdel->chr, cdel->next, cdel->prev,
-                                    cdel->after, cdel->before});
-  return String(avl2, line_breaks2);
-}
-
-String String::IntegrateInsert(ID id, char c, ID after, ID before) const {
-  const CharInfo* caft = avl_.Lookup(after);
-  const CharInfo* cbef = avl_.Lookup(before);
-  assert(caft != nullptr);
-  assert(cbef != nullptr);
-  if (caft->next == before) {
-    auto line_breaks2 = line_breaks_;
-    if (c == '\n') {
-      auto prev_line_id = after;
-      const CharInfo* plic = caft;
-      while (prev_line_id != Begin() && (!plic->visible || plic->chr != '\n')) {
-        prev_line_id = plic->prev;
-        plic = avl_.Lookup(prev_line_id);
-      }
-      auto prev_lb = line_breaks2.Lookup(prev_line_id);
-      auto next_lb = line_breaks2.Lookup(prev_lb->next);
-      line_breaks2 =
-          line_breaks2.Add(prev_line_id, LineBreak{prev_lb->prev, id})
-              .Add(id, LineBreak{prev_line_id, prev_lb->next})
-              .Add(prev_lb->next, LineBreak{id, next_lb->next});
-    }
-    auto avl2 = avl_.Add(after, CharInfo{caft->visible, caft->chr, id,
-                                         caft->prev, caft->after, caft->before})
-                    .Add(id, CharInfo{true, c, before, after, after, before})
-                    .Add(before, CharInfo{cbef->visible, cbef->chr, cbef->next,
-                                          id, cbef->after, cbef->before});
-    return String(avl2, line_breaks2);
-  }
-  typedef std::map<ID, const CharInfo*> LMap;
+bool String::CanMerge(ID a_id, const Run& a, ID b_id, const Run& b) {
+  if (a_id == Begin() || b_id == End()) return false;
+  const ID a_last = OffsetID(a_id, a.chars.size() - 1);
+  return OffsetID(a_id, a.chars.size()) == b_id && a.visible == b.visible &&
+         a.next == b_id && b.prev == a_last && b.after == a_last &&
+         a.before == b.before &&
+         a.chars.size() + b.chars.size() <= kMaxRunLength;
+}
+
+void String::PutRun(ID id, Run run) {
+  RunPos pos{id, 0, 0, 0, ContentHash()};
+  if (run.visible) {
+    pos.chars = run.chars.size();
+    pos.newlines = std::count(run.chars.begin(), run.chars.end(), '\n');
+    pos.hash = ContentHash::Of(run.chars);
+  } else if (id != Begin() && id != End()) {
+    pos.dead = run.chars.size();
+  }
+  order_ = std::move(order_).Add(run.label, pos);
+  avl_ = std::move(avl_).Add(id, std::move(run));
+}
+
+uint64_t String::AllocateLabel(uint64_t lo, uint64_t hi, size_t n) {
+  assert(lo < hi);
+  if (hi - lo > n) return lo + std::min((hi - lo) / (n + 1), kLabelSpacing);
+  // No room between lo and hi: find the smallest aligned window around lo
+  // that is sparse enough and spread its runs out evenly, leaving n slots
+  // after lo. Allowing windows of 2^bits labels to hold at most (4/3)^bits
+  // runs keeps the amortized number of relabelled runs logarithmic.
+  uint64_t wlo, whi;
+  std::vector<std::pair<uint64_t, RunPos>> runs;
+  double capacity = 1;
+  for (int bits = 1; bits <= 64; bits++) {
+    capacity *= 4.0 / 3.0;
+    const uint64_t mask = bits == 64 ? ~uint64_t(0) : (uint64_t(1) << bits) - 1;
+    // Begin and End keep their labels
+    wlo = std::max(lo & ~mask, kBeginLabel + 1);
+    whi = std::min(lo | mask, kEndLabel - 1);
+    const size_t count = order_.SummaryBefore(whi + 1).runs -
+                         order_.SummaryBefore(wlo).runs;
+    if (count + n <= whi - wlo && (count + n <= capacity || bits == 64)) {
+      break;
+    }
+  }
+  order_.ForEachInRange(wlo, whi + 1,
+                        [&](uint64_t label, const RunPos& pos) {
+                          runs.emplace_back(label, pos);
+                        });
+  for (const auto& r : runs) {
+    order_ = std::move(order_).Remove(r.first);
+  }
+  // the new run sits directly after lo
+  const size_t new_idx =
+      std::upper_bound(runs.begin(), runs.end(), lo,
+                       [](uint64_t l, const std::pair<uint64_t, RunPos>& r) {
+                         return l < r.first;
+                       }) -
+      runs.begin();
+  const uint64_t step = (whi - wlo + 1) / (runs.size() + n);
+  uint64_t new_label = 0;
+  for (size_t i = 0; i < runs.size() + n; i++) {
+    const uint64_t label = wlo + i * step + step / 2;
+    if (i == new_idx) new_label = label;
+    if (i >= new_idx && i < new_idx + n) continue;
+    const auto& r = runs[i < new_idx ? i : i - n];
+    Run run = *avl_.Lookup(r.second.id);
+    run.label = label;
+    avl_ = std::move(avl_).Add(r.second.id, run);
+    order_ = std::move(order_).Add(label, r.second);
+  }
+  return new_label;
+}
+
+void String::SplitBefore(ID id) {
+  RunRef r = FindRun(avl_, id);
+  assert(r.run != nullptr);
+  if (r.offset == 0) return;
+  const uint64_t label = AllocateLabel(
+      r.run->label, avl_.Lookup(r.run->next)->label);
+  // reload: allocation may have relabelled the run
+  r = FindRun(avl_, id);
+  const Run run = *r.run;
+  const ID prev = OffsetID(id, -1);
+  PutRun(id, Run{run.visible, run.chars.substr(r.offset), run.next, prev, prev,
+                 run.before, label});
+  PutRun(r.id, Run{run.visible, run.chars.substr(0, r.offset), id, run.prev,
+                   run.after, run.before, run.label});
+}
+
+void String::Coalesce(ID a_id, const Run& a, ID b_id, const Run& b) {
+  Run merged{a.visible, a.chars + b.chars, b.next, a.prev,
+             a.after,   a.before,          a.label};
+  avl_ = std::move(avl_).Remove(b_id);
+  order_ = std::move(order_).Remove(b.label);
+  PutRun(a_id, std::move(merged));
+}
+
+size_t String::OffsetOf(ID id) const {
+  RunRef r = FindRun(avl_, Forward(id, false));
+  assert(r.run != nullptr);
+  size_t ofs = order_.SummaryBefore(r.run->label).chars;
+  if (r.run->visible) ofs += r.offset;
+  return ofs;
+}
+
+ID String::IDAtOffset(size_t offset) const {
+  DocSummary before;
+  auto f = order_.Select(
+      [offset](const DocSummary& s) { return s.chars > offset; }, &before);
+  if (f.first == nullptr) return End();
+  return OffsetID(f.second->id, offset - before.chars);
+}
+
+size_t String::LineOf(ID id) const {
+  RunRef r = FindRun(avl_, Forward(id, false));
+  assert(r.run != nullptr);
+  size_t line = order_.SummaryBefore(r.run->label).newlines;
+  if (r.run->visible) {
+    line += std::count(r.run->chars.begin(), r.run->chars.begin() + r.offset,
+                       '\n');
+  }
+  return line;
+}
+
+ID String::IDAtLine(size_t n) const {
+  if (n == 0) return Begin();
+  DocSummary before;
+  auto f = order_.Select(
+      [n](const DocSummary& s) { return s.newlines >= n; }, &before);
+  if (f.first == nullptr) return End();
+  const std::string& chars = avl_.Lookup(f.second->id)->chars;
+  size_t skip = n - before.newlines;
+  for (size_t i = 0;; i++) {
+    if (chars[i] == '\n' && --skip == 0) return OffsetID(f.second->id, i);
+  }
+}
+
+String String::IntegrateOp(String s, const Op& op, const std::string& text) {
+  switch (op.kind) {
+    case Op::INSERT_CHAR: {
+      const ID after = s.Forward(op.after, true);
+      const ID before = s.Forward(op.before, false);
+      return IntegrateInsert(std::move(s), op.id, op.chr, after, before);
+    }
+    case Op::INSERT_RUN: {
+      const ID after = s.Forward(op.after, true);
+      const ID before = s.Forward(op.before, false);
+      return IntegrateInsertChain(std::move(s), op.id,
+                                  text.data() + op.text.offset,
+                                  op.text.length, after, before);
+    }
+    case Op::REMOVE:
+      return IntegrateRemove(std::move(s), op.id, op.count);
+  }
+  return s;
+}
+
+ID String::Forward(ID id, bool left) const {
+  if (purged_.Empty()) return id;
+  // the neighbours may have been purged later in turn
+  for (;;) {
+    auto f = purged_.LookupFloor(id);
+    if (f.first == nullptr || f.first->entry() != id.entry() ||
+        id.tick() - f.first->tick() >= f.second->length) {
+      return id;
+    }
+    id = left ? f.second->prev : f.second->next;
+  }
+}
+
+String String::IntegrateRemove(String s, ID id, size_t n) {
+  while (n > 0) {
+    RunRef rdel = FindRun(s.avl_, id);
+    // purged since it was removed
+    if (rdel.run == nullptr) {
+      id = OffsetID(id, 1);
+      n--;
+      continue;
+    }
+    const size_t len = std::min(n, rdel.run->chars.size() - rdel.offset);
+    const ID next = OffsetID(id, len);
+    n -= len;
+    // already removed
+    if (!rdel.run->visible) {
+      id = next;
+      continue;
+    }
+    const bool last = rdel.offset + len == rdel.run->chars.size();
+    // isolate the removed characters in their own run
+    s.SplitBefore(id);
+    if (!last) {
+      s.SplitBefore(next);
+    }
+    Run del = *s.avl_.Lookup(id);
+    del.visible = false;
+    s.PutRun(id, del);
+    // and fold them into neighbouring tombstones where possible
+    ID del_id = id;
+    RunRef left = FindRun(s.avl_, del.prev);
+    if (CanMerge(left.id, *left.run, del_id, del)) {
+      s.Coalesce(left.id, Run(*left.run), del_id, del);
+      del_id = left.id;
+      del = *s.avl_.Lookup(del_id);
+    }
+    const Run* right = s.avl_.Lookup(del.next);
+    if (right != nullptr && CanMerge(del_id, del, del.next, *right)) {
+      s.Coalesce(del_id, del, del.next, Run(*right));
+    }
+    id = next;
+  }
+  return s;
+}
+
+String String::IntegrateInsert(String s, ID id, char c, ID after,
+                               ID before) {
+  const CharInfo caft = s.CharAt(after);
+  const CharInfo cbef = s.CharAt(before);
+  if (caft.next == before) {
+    // after must end a run and before must start one: split if we're
+    // inserting into the middle of a run
+    s.SplitBefore(before);
+    RunRef raft = FindRun(s.avl_, after);
+    Run aft = *raft.run;
+    Run ins{true, std::string(1, c), before, after, after, before, 0};
+    aft.next = id;
+    if (CanMerge(raft.id, aft, id, ins)) {
+      // extend the run we're typing at the end of
+      aft.chars += c;
+      aft.next = before;
+      s.PutRun(raft.id, std::move(aft));
+    } else {
+      ins.label = s.AllocateLabel(aft.label, s.avl_.Lookup(before)->label);
+      // reload: allocation may have relabelled the run
+      aft = *s.avl_.Lookup(raft.id);
+      aft.next = id;
+      s.PutLinks(raft.id, std::move(aft));
+      s.PutRun(id, std::move(ins));
+    }
+    Run bef = *s.avl_.Lookup(before);
+    bef.prev = id;
+    s.PutLinks(before, std::move(bef));
+    return s;
+  }
+  typedef std::map<ID, CharInfo> LMap;
   LMap inL;
   std::vector<typename LMap::iterator> L;
-  auto addToL = [&](ID id, const CharInfo* ci) {
+  auto addToL = [&](ID id, const CharInfo& ci) {
     L.push_back(inL.emplace(id, ci).first);
   };
   addToL(after, caft);
-  ID n = caft->next;
+  ID n = caft.next;
   do {
-    const CharInfo* cn = avl_.Lookup(n);
-    assert(cn != nullptr);
+    const CharInfo cn = s.CharAt(n);
     addToL(n, cn);
-    n = cn->next;
+    n = cn.next;
   } while (n != before);
   addToL(before, cbef);
+  // keep only characters whose after/before lie outside (after, before)
+  auto interior = [&](ID id) {
+    auto it = inL.find(id);
+    return it != inL.end() && it != L.front() && it != L.back();
+  };
   size_t i, j;
   for (i = 1, j = 1; i < L.size() - 1; i++) {
     auto it = L[i];
-    auto ai = inL.find(it->second->after);
-    if (ai == inL.end()) continue;
-    auto bi = inL.find(it->second->before);
-    if (bi == inL.end()) continue;
+    if (interior(it->second.after)) continue;
+    if (interior(it->second.before)) continue;
     L[j++] = L[i];
   }
   L[j++] = L[i];
   L.resize(j);
-  for (i = 1; i < L.size() - 1 && L[i]->first < id; i++)
+  for (i = 1; i < L.size() - 1 && L[i]->first.Precedes(id); i++)
     ;
-  return IntegrateInsert(id, c, L[i - 1]->first, L[i]->first);
+  return IntegrateInsert(std::move(s), id, c, L[i - 1]->first, L[i]->first);
+}
+
+String String::IntegrateInsertChain(String s, ID id, const char* chars,
+                                    size_t n, ID after, ID before) {
+  // while other characters lie between after and before (concurrent
+  // inserts), the next character must be ordered among them
+  size_t i = 0;
+  while (i < n && s.CharAt(after).next != before) {
+    s = IntegrateInsert(std::move(s), OffsetID(id, i), chars[i], after,
+                        before);
+    after = OffsetID(id, i);
+    i++;
+  }
+  if (i == n) return s;
+  if (s.order_.Total().runs == 2) {
+    // only Begin and End: loading into an empty document
+    assert(i == 0);
+    s.BulkLoad(id, chars, n);
+    return s;
+  }
+  // everything else goes contiguously between after and before
+  s.SplitBefore(before);
+  const ID aft_id = FindRun(s.avl_, after).id;
+  ID prev = after;
+  for (size_t pos = i; pos < n; pos += kMaxRunLength) {
+    const size_t len = std::min(kMaxRunLength, n - pos);
+    const ID run_id = OffsetID(id, pos);
+    const ID next = pos + len < n ? OffsetID(id, pos + len) : before;
+    // labels of existing runs may move whenever a label is allocated
+    const uint64_t label = s.AllocateLabel(
+        FindRun(s.avl_, prev).run->label, s.avl_.Lookup(before)->label,
+        (n - pos + kMaxRunLength - 1) / kMaxRunLength);
+    s.PutRun(run_id, Run{true, std::string(chars + pos, len), next, prev,
+                         prev, before, label});
+    prev = OffsetID(run_id, len - 1);
+  }
+  Run aft = *s.avl_.Lookup(aft_id);
+  aft.next = OffsetID(id, i);
+  s.PutLinks(aft_id, std::move(aft));
+  Run bef = *s.avl_.Lookup(before);
+  bef.prev = prev;
+  s.PutLinks(before, std::move(bef));
+  return s;
+}
+
+void String::BulkLoad(ID id, const char* chars, size_t n) {
+  const size_t runs = (n + kMaxRunLength - 1) / kMaxRunLength;
+  const ID last = OffsetID(id, n - 1);
+  std::vector<std::pair<ID, Run>> by_id;
+  std::vector<std::pair<uint64_t, RunPos>> by_label;
+  by_id.reserve(runs + 2);
+  by_label.reserve(runs + 2);
+  by_label.emplace_back(kBeginLabel,
+                        RunPos{Begin(), 0, 0, 0, ContentHash()});
+  // spread labels evenly to leave room for later inserts everywhere
+  const uint64_t step = (kEndLabel - kBeginLabel) / (runs + 1);
+  ID prev = Begin();
+  for (size_t r = 0; r < runs; r++) {
+    const size_t pos = r * kMaxRunLength;
+    const size_t len = std::min(kMaxRunLength, n - pos);
+    const ID run_id = OffsetID(id, pos);
+    const ID next = r + 1 < runs ? OffsetID(run_id, len) : End();
+    const uint64_t label = kBeginLabel + (r + 1) * step;
+    Run run{true, std::string(chars + pos, len), next, prev, prev, End(),
+            label};
+    by_label.emplace_back(
+        label, RunPos{run_id, static_cast<uint32_t>(len),
+                      static_cast<uint32_t>(std::count(
+                          run.chars.begin(), run.chars.end(), '\n')),
+                      0, ContentHash::Of(run.chars)});
+    by_id.emplace_back(run_id, std::move(run));
+    prev = OffsetID(run_id, len - 1);
+  }
+  by_label.emplace_back(kEndLabel,
+                        RunPos{End(), 0, 0, 0, ContentHash()});
+  // new ids are consecutive, so sorted: slot Begin and End in
+  Run begin = *avl_.Lookup(Begin());
+  begin.next = id;
+  Run end = *avl_.Lookup(End());
+  end.prev = last;
+  for (auto& e : {std::make_pair(Begin(), std::move(begin)),
+                  std::make_pair(End(), std::move(end))}) {
+    auto it = std::lower_bound(
+        by_id.begin(), by_id.end(), e.first,
+        [](const std::pair<ID, Run>& a, ID b) { return a.first < b; });
+    by_id.insert(it, e);
+  }
+  avl_ = RunMap::FromSorted(by_id.begin(), by_id.end());
+  order_ = OrderMap::FromSorted(by_label.begin(), by_label.end());
 }
 
 int String::OrderIDs(ID a, ID b) const {
   // same id
   if (a == b) return 0;
-  if (a == Begin()) return -1;
-  if (a == End()) return 1;
-  if (b == Begin()) return 1;
-  if (b == End()) return -1;
-  LineIterator line_a(*this, a);
-  LineIterator line_b(*this, b);
-  if (line_a.id() == line_b.id()) {
-    // same line
-    AllIterator it(*this, line_a.id());
-    for (;;) {
-      if (it.id() == a) return -1;
-      if (it.id() == b) return 1;
-      it.MoveNext();
-    }
-  }
-  LineIterator bk = line_a;
-  LineIterator fw = line_a;
-  for (;;) {
-    bk.MovePrev();
-    fw.MoveNext();
-    if (bk.id() == line_b.id()) return 1;
-    if (fw.id() == line_b.id()) return -1;
-    if (bk.is_begin()) return -1;
-    if (fw.is_end()) return 1;
+  // a purged id sits just before the character it forwards to
+  const ID fa = Forward(a, false);
+  const ID fb = Forward(b, false);
+  if (fa == fb) {
+    if (fa == a) return 1;
+    if (fb == b) return -1;
+    // both purged next to each other: their order is gone
+    return a < b ? -1 : 1;
   }
+  RunRef ra = FindRun(avl_, fa);
+  RunRef rb = FindRun(avl_, fb);
+  assert(ra.run != nullptr && rb.run != nullptr);
+  // labels increase along the document; within a run, so do offsets
+  if (ra.run->label != rb.run->label) {
+    return ra.run->label < rb.run->label ? -1 : 1;
+  }
+  return ra.offset < rb.offset ? -1 : 1;
+}
+
+std::vector<String::Change> String::Diff(const String& older) const {
+  struct Span {
+    ID first;
+    size_t length;
+    ID end() const { return OffsetID(first, length); }
+    // the part from id on
+    Span From(ID id) const {
+      return Span{id, length - (id.tick() - first.tick())};
+    }
+  };
+  // visible spans outside the shared structure, per version, in id order;
+  // spans seen in both cancel out below
+  std::vector<Span> spans[2];
+  RunMap::ForEachDifference(
+      older.avl_, avl_, [&spans](const ID& id, const Run& run, bool in_new) {
+        if (!run.visible) return;
+        std::vector<Span>& v = spans[in_new];
+        if (!v.empty() && v.back().end() == id) {
+          v.back().length += run.chars.size();
+        } else {
+          v.push_back(Span{id, run.chars.size()});
+        }
+      });
+
+  std::vector<Change> changes;
+  auto emit = [&changes](ID first, ID end, bool inserted) {
+    const size_t length = end.tick() - first.tick();
+    if (!changes.empty() && changes.back().inserted == inserted &&
+        OffsetID(changes.back().first, changes.back().length) == first) {
+      changes.back().length += length;
+    } else {
+      changes.push_back(Change{first, length, inserted});
+    }
+  };
+  // symmetric difference of the two span lists; spans never cross sites
+  const std::vector<Span>& before = spans[0];
+  const std::vector<Span>& after = spans[1];
+  size_t i = 0, j = 0;
+  Span a = i < before.size() ? before[i] : Span();
+  Span b = j < after.size() ? after[j] : Span();
+  while (i < before.size() && j < after.size()) {
+    if (!(b.first < a.end())) {
+      emit(a.first, a.end(), false);
+      if (++i < before.size()) a = before[i];
+    } else if (!(a.first < b.end())) {
+      emit(b.first, b.end(), true);
+      if (++j < after.size()) b = after[j];
+    } else if (a.first < b.first) {
+      emit(a.first, b.first, false);
+      a = a.From(b.first);
+    } else if (b.first < a.first) {
+      emit(b.first, a.first, true);
+      b = b.From(a.first);
+    } else {
+      // a common prefix is unchanged
+      const size_t n = std::min(a.length, b.length);
+      a = a.From(OffsetID(a.first, n));
+      b = b.From(OffsetID(b.first, n));
+      if (a.length == 0 && ++i < before.size()) a = before[i];
+      if (b.length == 0 && ++j < after.size()) b = after[j];
+    }
+  }
+  for (; i < before.size(); a = ++i < before.size() ? before[i] : a) {
+    emit(a.first, a.end(), false);
+  }
+  for (; j < after.size(); b = ++j < after.size() ? after[j] : b) {
+    emit(b.first, b.end(), true);
+  }
+  return changes;
+}
+
+String::PurgeList String::PurgeableRuns(const String& acked) const {
+  PurgeList runs;
+  order_.ForEach([&](uint64_t, const RunPos& pos) {
+    if (pos.dead == 0) return;
+    // every character must already be a tombstone in acked
+    for (size_t i = 0; i < pos.dead;) {
+      RunRef r = FindRun(acked.avl_, OffsetID(pos.id, i));
+      if (r.run == nullptr || r.run->visible) return;
+      i += r.run->chars.size() - r.offset;
+    }
+    runs.emplace_back(pos.id, pos.dead);
+  });
+  return runs;
+}
+
+String String::Purge(const PurgeList& runs) const {
+  String s = *this;
+  for (const auto& p : runs) {
+    // a replayed journal may have cut these characters into runs
+    // differently: purge them as long as every one is a tombstone
+    bool dead = true;
+    for (size_t i = 0; dead && i < p.second;) {
+      RunRef r = FindRun(s.avl_, OffsetID(p.first, i));
+      dead = r.run != nullptr && !r.run->visible;
+      if (dead) i += r.run->chars.size() - r.offset;
+    }
+    if (!dead) continue;
+    const ID end = OffsetID(p.first, p.second);
+    s.SplitBefore(p.first);
+    if (FindRun(s.avl_, end).run != nullptr) s.SplitBefore(end);
+    for (ID id = p.first; id != end;) {
+      const Run dead_run = *s.avl_.Lookup(id);
+      const size_t length = dead_run.chars.size();
+      // unlink: the run's prev is the last character of the run before it,
+      // and its next starts the run after it
+      RunRef left = FindRun(s.avl_, dead_run.prev);
+      Run prev = *left.run;
+      prev.next = dead_run.next;
+      s.PutLinks(left.id, std::move(prev));
+      Run next = *s.avl_.Lookup(dead_run.next);
+      next.prev = dead_run.prev;
+      s.PutLinks(dead_run.next, std::move(next));
+      s.avl_ = std::move(s.avl_).Remove(id);
+      s.order_ = std::move(s.order_).Remove(dead_run.label);
+      s.purged_ = std::move(s.purged_).Add(
+          id, Purged{length, dead_run.prev, dead_run.next});
+      id = OffsetID(id, length);
+    }
+  }
+  return s;
 }
 
 std::string String::Render() const { return Render(Begin(), End()); }
 
 std::string String::Render(ID beg, ID end) const {
+  beg = Forward(beg, false);
+  end = Forward(end, false);
   if (OrderIDs(beg, end) > 0) {
     std::swap(beg, end);
   }
@@ -134,21 +546,52 @@ std::string String::Render(ID beg, ID end) const {
   std::string out;
   ID cur = beg;
   while (cur != end) {
-    const CharInfo* c = avl_.Lookup(cur);
-    if (c->visible) out += c->chr;
-    cur = c->next;
+    RunRef r = FindRun(avl_, cur);
+    size_t stop = r.run->chars.size();
+    bool end_in_run = end.entry() == r.id.entry() && end.tick() > cur.tick() &&
+                      end.tick() - r.id.tick() < stop;
+    if (end_in_run) stop = end.tick() - r.id.tick();
+    if (r.run->visible) out.append(r.run->chars, r.offset, stop - r.offset);
+    cur = end_in_run ? end : r.run->next;
   }
   return out;
 }
 
 void String::MakeRemove(CommandBuf* buf, ID beg, ID end) const {
+  beg = Forward(beg, false);
+  end = Forward(end, false);
   if (OrderIDs(beg, end) > 0) {
     std::swap(beg, end);
   }
 
-  AllIterator it(*this, beg);
-  while (it.id() != end) {
-    if (it.is_visible()) MakeRemove(buf, it.id());
-    it.MoveNext();
+  // the span of consecutive visible ids being collected
+  ID span = beg;
+  size_t span_len = 0;
+  auto flush = [&]() {
+    if (span_len == 0) return;
+    Op op{Op::REMOVE, span, ID(), ID(), {}};
+    op.count = span_len;
+    buf->Append(op);
+    span_len = 0;
+  };
+  ID cur = beg;
+  while (cur != end) {
+    RunRef r = FindRun(avl_, cur);
+    size_t stop = r.run->chars.size();
+    bool end_in_run = end.entry() == r.id.entry() && end.tick() > cur.tick() &&
+                      end.tick() - r.id.tick() < stop;
+    if (end_in_run) stop = end.tick() - r.id.tick();
+    if (r.run->visible) {
+      const size_t len = stop - r.offset;
+      // runs split from one another continue the span
+      if (OffsetID(span, span_len) != cur ||
+          span_len + len > std::numeric_limits<uint32_t>::max()) {
+        flush();
+        span = cur;
+      }
+      span_len += len;
+    }
+    cur = end_in_run ? end : r.run->next;
   }
+  flush();
 }
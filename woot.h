@@ -20,18 +20,40 @@
 #include <string>
 #include <vector>
 
-#include "avl.h"
+#include "content_hash.h"
 #include "crdt.h"
+#include "pmap.h"
 
 class String : public CRDT<String> {
  public:
+  // chars [offset, offset + length) of a command buffer's text arena
+  struct TextRef {
+    uint32_t offset;
+    uint32_t length;
+  };
+  // a command record
+  struct Op {
+    enum Kind : uint8_t { INSERT_CHAR, INSERT_RUN, REMOVE } kind;
+    // the character inserted or removed; the first one for INSERT_RUN and
+    // REMOVE
+    ID id;
+    // where inserts go
+    ID after;
+    ID before;
+    union {
+      char chr;
+      TextRef text;
+      // REMOVE: ids id, id + 1, ..., id + count - 1
+      uint32_t count;
+    };
+  };
+  typedef CommandBuffer<Op, std::string> CommandBuf;
+
   String() {
-    avl_ =
-        avl_.Add(Begin(), CharInfo{false, char(), End(), End(), End(), End()})
-            .Add(End(),
-                 CharInfo{false, char(), Begin(), Begin(), Begin(), Begin()});
-    line_breaks_ = line_breaks_.Add(Begin(), LineBreak{End(), End()})
-                       .Add(End(), LineBreak{Begin(), Begin()});
+    PutRun(Begin(), Run{false, std::string(1, char()), End(), End(), End(),
+                        End(), kBeginLabel});
+    PutRun(End(), Run{false, std::string(1, char()), Begin(), Begin(), Begin(),
+                      Begin(), kEndLabel});
   }
 
   static ID Begin() { return begin_id_; }
@@ -40,43 +62,182 @@ class String : public CRDT<String> {
   // return <0 if a before b, >0 if a after b, ==0 if a==b
   int OrderIDs(ID a, ID b) const;
 
-  bool Has(ID id) const { return avl_.Lookup(id) != nullptr; }
+  bool Has(ID id) const { return FindRun(avl_, id).run != nullptr; }
+
+  // number of visible characters in the document
+  size_t Length() const { return order_.Total().chars; }
+  // number of visible characters before id
+  size_t OffsetOf(ID id) const;
+  // the visible character at offset, or End() if offset is past the end
+  ID IDAtOffset(size_t offset) const;
+  // number of visible line breaks before id
+  size_t LineOf(ID id) const;
+  // hash of the visible text: equal for equal text, however it was edited
+  ContentHash Hash() const { return order_.Total().hash; }
+  // number of removed characters still kept as tombstones
+  size_t Tombstones() const { return order_.Total().dead; }
+  // the line break that starts line n: Begin() for the first line, End()
+  // past the last one (matches LineIterator::id())
+  ID IDAtLine(size_t n) const;
 
   static ID MakeRawInsert(CommandBuf* buf, Site* site, char c, ID after,
                           ID before) {
-    return MakeCommand(buf, site->GenerateID(),
-                       [c, after, before](String s, ID id) {
-                         return s.IntegrateInsert(id, c, after, before);
-                       });
+    Op op{Op::INSERT_CHAR, site->GenerateID(), after, before, {}};
+    op.chr = c;
+    buf->Append(op);
+    return op.id;
   }
 
+  // inserts s as one command: equivalent to inserting its characters one
+  // at a time, each after the previous one, but integrated a run at a time
   static ID MakeRawInsert(CommandBuf* buf, Site* site, const std::string& s,
                           ID after, ID before) {
-    // TODO(ctiller): make this an optimization
-    for (auto c : s) {
-      after = MakeRawInsert(buf, site, c, after, before);
-    }
-    return after;
+    if (s.empty()) return after;
+    Op op{Op::INSERT_RUN, site->GenerateIDs(s.size()), after, before, {}};
+    op.text = TextRef{static_cast<uint32_t>(buf->arena()->size()),
+                      static_cast<uint32_t>(s.size())};
+    buf->arena()->append(s);
+    buf->Append(op);
+    return OffsetID(op.id, s.size() - 1);
   }
 
   template <class T>
   ID MakeInsert(CommandBuf* buf, Site* site, const T& c, ID after) const {
-    return MakeRawInsert(buf, site, c, after, avl_.Lookup(after)->next);
+    after = Forward(after, true);
+    return MakeRawInsert(buf, site, c, after, CharAt(after).next);
   }
 
   void MakeRemove(CommandBuf* buf, ID chr) const {
-    MakeCommand(buf, chr,
-                [](String s, ID id) { return s.IntegrateRemove(id); });
+    Op op{Op::REMOVE, chr, ID(), ID(), {}};
+    op.count = 1;
+    buf->Append(op);
   }
 
+  // removes the characters visible in [beg, end): one command per span of
+  // consecutive ids, so concurrent inserts into the range survive
   void MakeRemove(CommandBuf* buf, ID beg, ID end) const;
 
   std::string Render() const;
   std::string Render(ID beg, ID end) const;
 
+  // visit the characters from `from` up to but excluding `to`, tombstones
+  // included, a span of consecutive ids at a time: as f(first, chars, n,
+  // visible) for the n characters with ids first, first + 1, ...
+  template <class F>
+  void ForEachSpan(ID from, ID to, F&& f) const {
+    to = Forward(to, false);
+    RunRef r = FindRun(avl_, Forward(from, false));
+    while (r.run != nullptr && r.id != End()) {
+      const Run& run = *r.run;
+      size_t end = run.chars.size();
+      if (to.entry() == r.id.entry() && to.tick() >= r.id.tick() + r.offset &&
+          to.tick() < r.id.tick() + end) {
+        end = to.tick() - r.id.tick();
+      }
+      if (end > r.offset) {
+        f(OffsetID(r.id, r.offset), run.chars.data() + r.offset,
+          end - r.offset, run.visible);
+      }
+      if (end < run.chars.size()) return;
+      r = FindRun(avl_, run.next);
+    }
+  }
+
   bool SameIdentity(String s) const { return avl_.SameIdentity(s.avl_); }
 
+  // a range of consecutive ids whose characters became visible (inserted) or
+  // stopped being visible (removed)
+  struct Change {
+    ID first;
+    size_t length;
+    bool inserted;
+  };
+  // what changed between older and this version, in id order (not document
+  // order); skips the structure the two share, so cheap for close versions
+  std::vector<Change> Diff(const String& older) const;
+
+  // Tombstone compaction. PurgeableRuns lists tombstone runs that were
+  // already removed in acked as (first id, length); it walks every run, so
+  // run it off the editing path. Purge drops the listed characters from the
+  // document however they are cut into runs, skipping any range that is no
+  // longer all tombstones.
+  // Purged ids live on outside the document: commands made against older
+  // versions name them as after or before (an insert next to a tombstone
+  // does), and cursors, fixits and annotations may sit on them for as long
+  // as they like. So Purge remembers each run's neighbours, and every lookup
+  // of an id goes to the closest character still there.
+  typedef std::vector<std::pair<ID, size_t>> PurgeList;
+  PurgeList PurgeableRuns(const String& acked) const;
+  String Purge(const PurgeList& runs) const;
+
  private:
+  // Characters inserted consecutively by one site share one map entry: the run
+  // keyed by ID (site, clock) holds the characters (site, clock) ..
+  // (site, clock + chars.size() - 1), which share a SiteTable entry.
+  // Inside a run each character's prev and after is the preceding character
+  // of the run, its next is the following character, and all characters
+  // share the same before - so only the links at the run edges are stored.
+  struct Run {
+    // tombstones if false
+    bool visible;
+    // glyphs
+    std::string chars;
+    // next of the last character, prev of the first character
+    ID next;
+    ID prev;
+    // after of the first character, before of all characters
+    ID after;
+    ID before;
+    // position of the run in order_
+    uint64_t label;
+  };
+
+  // runs are copied whenever they are extended: cap their length
+  static constexpr size_t kMaxRunLength = 64;
+
+  // Runs are also kept in document order in order_, keyed by a label that
+  // increases along the document. Subtree summaries of visible characters and
+  // line breaks there give offset <-> ID translation in O(log n).
+  struct RunPos {
+    ID id;
+    uint32_t chars;
+    uint32_t newlines;
+    // tombstones
+    uint32_t dead;
+    // of the visible characters
+    ContentHash hash;
+  };
+
+  struct DocSummary {
+    DocSummary() {}
+    DocSummary(uint64_t, const RunPos& pos)
+        : runs(1),
+          chars(pos.chars),
+          newlines(pos.newlines),
+          dead(pos.dead),
+          hash(pos.hash) {}
+    DocSummary operator+(const DocSummary& other) const {
+      DocSummary s;
+      s.runs = runs + other.runs;
+      s.chars = chars + other.chars;
+      s.newlines = newlines + other.newlines;
+      s.dead = dead + other.dead;
+      s.hash = hash + other.hash;
+      return s;
+    }
+    size_t runs = 0;
+    size_t chars = 0;
+    size_t newlines = 0;
+    size_t dead = 0;
+    ContentHash hash;
+  };
+
+  static constexpr uint64_t kBeginLabel = 0;
+  static constexpr uint64_t kEndLabel = ~uint64_t(0);
+  // label distance left between runs appended in sequence
+  static constexpr uint64_t kLabelSpacing = uint64_t(1) << 32;
+
+  // per character view of a run
   struct CharInfo {
     // tombstone if false
     bool visible;
@@ -90,19 +251,88 @@ class String : public CRDT<String> {
     ID before;
   };
 
-  struct LineBreak {
+  struct RunRef {
+    // id of the first character of the run
+    ID id;
+    // nullptr if not found
+    const Run* run;
+    // offset of the looked up character within the run
+    size_t offset;
+  };
+
+  // a purged run: where its ids lead now
+  struct Purged {
+    size_t length;
+    // its prev and next when it was purged
     ID prev;
     ID next;
   };
 
-  String(AVL<ID, CharInfo> avl, AVL<ID, LineBreak> line_breaks)
-      : avl_(avl), line_breaks_(line_breaks) {}
+  typedef PMap<ID, Run> RunMap;
+  typedef PMap<uint64_t, RunPos, DocSummary> OrderMap;
+  typedef PMap<ID, Purged> PurgedMap;
+
+  static ID OffsetID(ID id, int64_t n) { return id.Offset(n); }
+
+  static RunRef FindRun(const RunMap& avl, ID id) {
+    auto f = avl.LookupFloor(id);
+    if (f.first == nullptr || f.first->entry() != id.entry() ||
+        id.tick() - f.first->tick() >= f.second->chars.size()) {
+      return RunRef{id, nullptr, 0};
+    }
+    return RunRef{*f.first, f.second,
+                  static_cast<size_t>(id.tick() - f.first->tick())};
+  }
+
+  // id, or if it was purged the closest character left (or right) of it
+  // still in the document
+  ID Forward(ID id, bool left) const;
+
+  static CharInfo CharAt(const RunRef& r) {
+    const Run& run = *r.run;
+    const ID id = OffsetID(r.id, r.offset);
+    return CharInfo{
+        run.visible,
+        run.chars[r.offset],
+        r.offset == run.chars.size() - 1 ? run.next : OffsetID(id, 1),
+        r.offset == 0 ? run.prev : OffsetID(id, -1),
+        r.offset == 0 ? run.after : OffsetID(id, -1),
+        run.before};
+  }
+
+  CharInfo CharAt(ID id) const {
+    RunRef r = FindRun(avl_, id);
+    assert(r.run != nullptr);
+    return CharAt(r);
+  }
 
-  String IntegrateRemove(ID id) const;
-  String IntegrateInsert(ID id, char c, ID after, ID before) const;
+  static bool CanMerge(ID a_id, const Run& a, ID b_id, const Run& b);
 
-  AVL<ID, CharInfo> avl_;
-  AVL<ID, LineBreak> line_breaks_;
+  // mutators used while integrating into a fresh copy; they update the maps
+  // transiently, so pointers into avl_/order_ die with each call
+  // PutRun updates order_ too, PutLinks only when position is unchanged
+  void PutRun(ID id, Run run);
+  void PutLinks(ID id, Run run) {
+    avl_ = std::move(avl_).Add(id, std::move(run));
+  }
+  void SplitBefore(ID id);
+  void Coalesce(ID a_id, const Run& a, ID b_id, const Run& b);
+  // the first of n labels to be allocated in sequence after lo (each after
+  // the previous one) and before hi
+  uint64_t AllocateLabel(uint64_t lo, uint64_t hi, size_t n = 1);
+
+  friend class CRDT<String>;
+  static String IntegrateOp(String s, const Op& op, const std::string& text);
+  static String IntegrateRemove(String s, ID id, size_t n);
+  static String IntegrateInsert(String s, ID id, char c, ID after, ID before);
+  static String IntegrateInsertChain(String s, ID id, const char* chars,
+                                     size_t n, ID after, ID before);
+  // build the document Begin, chars, End from scratch in O(n)
+  void BulkLoad(ID id, const char* chars, size_t n);
+
+  RunMap avl_;
+  OrderMap order_;
+  PurgedMap purged_;
   static Site root_site_;
   static ID begin_id_;
   static ID end_id_;
@@ -110,29 +340,42 @@ class String : public CRDT<String> {
  public:
   class AllIterator {
    public:
+    // a purged where starts at the closest character left of it
     AllIterator(const String& str, ID where)
-        : str_(&str), pos_(where), cur_(str_->avl_.Lookup(pos_)) {}
+        : str_(&str),
+          pos_(str.Forward(where, true)),
+          cur_(FindRun(str_->avl_, pos_)) {}
 
     bool is_end() const { return pos_ == End(); }
     bool is_begin() const { return pos_ == Begin(); }
 
     ID id() const { return pos_; }
-    char value() const { return cur_->chr; }
-    bool is_visible() const { return cur_->visible; }
+    char value() const { return cur_.run->chars[cur_.offset]; }
+    bool is_visible() const { return cur_.run->visible; }
 
     void MoveNext() {
-      pos_ = cur_->next;
-      cur_ = str_->avl_.Lookup(pos_);
+      if (cur_.offset + 1 < cur_.run->chars.size()) {
+        cur_.offset++;
+        pos_ = OffsetID(pos_, 1);
+      } else {
+        pos_ = cur_.run->next;
+        cur_ = FindRun(str_->avl_, pos_);
+      }
     }
     void MovePrev() {
-      pos_ = cur_->prev;
-      cur_ = str_->avl_.Lookup(pos_);
+      if (cur_.offset > 0) {
+        cur_.offset--;
+        pos_ = OffsetID(pos_, -1);
+      } else {
+        pos_ = cur_.run->prev;
+        cur_ = FindRun(str_->avl_, pos_);
+      }
     }
 
    private:
     const String* str_;
     ID pos_;
-    const CharInfo* cur_;
+    RunRef cur_;
   };
 
   class Iterator {
@@ -173,12 +416,9 @@ class String : public CRDT<String> {
    public:
     LineIterator(const String& str, ID where) : str_(&str) {
       Iterator it(str, where);
-      const LineBreak* lb = str.line_breaks_.Lookup(it.id());
-      while (lb == nullptr) {
-        it.MovePrev();
-        lb = str.line_breaks_.Lookup(it.id());
-      }
-      id_ = it.id();
+      line_ = str.LineOf(it.id());
+      if (!it.is_begin() && it.value() == '\n') line_++;
+      id_ = str.IDAtLine(line_);
     }
 
     bool is_end() const { return id_ == End(); }
@@ -186,12 +426,12 @@ class String : public CRDT<String> {
 
     void MovePrev() {
       if (id_ == Begin()) return;
-      id_ = str_->line_breaks_.Lookup(id_)->prev;
+      id_ = str_->IDAtLine(--line_);
     }
 
     void MoveNext() {
       if (id_ == End()) return;
-      id_ = str_->line_breaks_.Lookup(id_)->next;
+      id_ = str_->IDAtLine(++line_);
     }
 
     LineIterator Next() {
@@ -207,6 +447,7 @@ class String : public CRDT<String> {
 
    private:
     const String* str_;
+    size_t line_;
     ID id_;
   };
 };
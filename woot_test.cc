@@ -14,18 +14,386 @@
 #include "woot.h"
 #include "gtest/gtest.h"
 
+static String Apply(String s, const String::CommandBuf& buf) {
+  for (const auto& cmd : buf) {
+    s = s.Integrate(cmd);
+  }
+  return s;
+}
+
 TEST(String, NoOp) { String s; }
 
 TEST(String, MutateThenRender) {
   String s;
   Site site;
-  auto r = s.Insert(&site, 'a', String::Begin());
+  String::CommandBuf buf;
+  auto a = s.MakeInsert(&buf, &site, 'a', String::Begin());
   EXPECT_EQ(s.Render(), "");
-  EXPECT_EQ(r.str.Render(), "a");
-  s = r.str;
-  r = s.Insert(&site, 'b', r.command->id());
-  EXPECT_EQ(r.str.Render(), "ab");
-  s = r.str;
-  auto rr = s.Remove(r.command->id());
-  EXPECT_EQ(rr.str.Render(), "a");
+  s = Apply(s, buf);
+  EXPECT_EQ(s.Render(), "a");
+  buf.clear();
+  auto b = s.MakeInsert(&buf, &site, 'b', a);
+  s = Apply(s, buf);
+  EXPECT_EQ(s.Render(), "ab");
+  buf.clear();
+  s.MakeRemove(&buf, b);
+  s = Apply(s, buf);
+  EXPECT_EQ(s.Render(), "a");
+}
+
+TEST(String, EditInsideRun) {
+  String s;
+  Site site;
+  String::CommandBuf buf;
+  String::MakeRawInsert(&buf, &site, "hello world", String::Begin(),
+                        String::End());
+  s = Apply(s, buf);
+  EXPECT_EQ(s.Render(), "hello world");
+
+  // insert into the middle of the run
+  String::Iterator it(s, String::Begin());
+  for (int i = 0; i < 5; i++) it.MoveNext();
+  buf.clear();
+  s.MakeInsert(&buf, &site, std::string(","), it.id());
+  s = Apply(s, buf);
+  EXPECT_EQ(s.Render(), "hello, world");
+
+  // remove a range spanning both runs
+  String::Iterator beg(s, String::Begin());
+  for (int i = 0; i < 4; i++) beg.MoveNext();
+  String::Iterator end = beg;
+  for (int i = 0; i < 4; i++) end.MoveNext();
+  buf.clear();
+  s.MakeRemove(&buf, beg.id(), end.id());
+  s = Apply(s, buf);
+  EXPECT_EQ(s.Render(), "helworld");
+  EXPECT_EQ(s.Render(beg.id(), end.id()), "");
+}
+
+TEST(String, ConcurrentInserts) {
+  String s;
+  Site site1;
+  Site site2;
+  String::CommandBuf buf1;
+  String::CommandBuf buf2;
+  String::MakeRawInsert(&buf1, &site1, "aaa", String::Begin(), String::End());
+  String::MakeRawInsert(&buf2, &site2, "bbb", String::Begin(), String::End());
+  String s12 = Apply(Apply(s, buf1), buf2);
+  String s21 = Apply(Apply(s, buf2), buf1);
+  EXPECT_EQ(s12.Render(), s21.Render());
+  EXPECT_EQ(s12.Render().length(), 6);
+}
+
+TEST(String, ConcurrentRangeRemove) {
+  String s;
+  Site site1;
+  Site site2;
+  String::CommandBuf buf;
+  String::MakeRawInsert(&buf, &site1, "hello world", String::Begin(),
+                        String::End());
+  s = Apply(s, buf);
+  const ID o = s.IDAtOffset(4);
+  const ID w = s.IDAtOffset(6);
+  // one side removes "o w" while the other types into the middle of it
+  String::CommandBuf remove;
+  s.MakeRemove(&remove, o, s.IDAtOffset(7));
+  EXPECT_EQ(remove.size(), 1);
+  String::CommandBuf insert;
+  s.MakeInsert(&insert, &site2, std::string("XY"), w);
+  String s12 = Apply(Apply(s, remove), insert);
+  String s21 = Apply(Apply(s, insert), remove);
+  EXPECT_EQ(s12.Render(), "hellXYorld");
+  EXPECT_EQ(s21.Render(), "hellXYorld");
+  // removing again is a no-op
+  EXPECT_EQ(Apply(s12, remove).Render(), "hellXYorld");
+
+  // removing across the insert leaves one span either side of it
+  buf.clear();
+  s21.MakeRemove(&buf, s21.IDAtOffset(1), s21.IDAtOffset(8));
+  EXPECT_EQ(buf.size(), 3);
+  EXPECT_EQ(Apply(s21, buf).Render(), "hld");
+}
+
+TEST(String, LineIterator) {
+  String s;
+  Site site;
+  String::CommandBuf buf;
+  String::MakeRawInsert(&buf, &site, "one\ntwo\nthree", String::Begin(),
+                        String::End());
+  s = Apply(s, buf);
+  String::LineIterator line(s, String::Begin());
+  line.MoveNext();
+  line.MoveNext();
+  EXPECT_EQ(s.Render(line.id(), String::End()), "\nthree");
+}
+
+TEST(String, OffsetsAndLines) {
+  String s;
+  Site site;
+  String::CommandBuf buf;
+  String::MakeRawInsert(&buf, &site, "ab\ncd\n\nef", String::Begin(),
+                        String::End());
+  s = Apply(s, buf);
+  EXPECT_EQ(s.Length(), 9);
+  // keep inserting at the same place to exhaust the space between labels
+  ID after = s.IDAtOffset(3);
+  for (int i = 0; i < 1000; i++) {
+    buf.clear();
+    s.MakeInsert(&buf, &site, 'x', after);
+    s = Apply(s, buf);
+  }
+  std::string text = s.Render();
+  EXPECT_EQ(text, "ab\nc" + std::string(1000, 'x') + "d\n\nef");
+  for (size_t i = 0; i < text.size(); i++) {
+    ID id = s.IDAtOffset(i);
+    EXPECT_EQ(s.OffsetOf(id), i);
+    EXPECT_EQ(s.LineOf(id), std::count(text.begin(), text.begin() + i, '\n'));
+  }
+  EXPECT_EQ(s.IDAtOffset(text.size()), String::End());
+  EXPECT_EQ(s.IDAtLine(0), String::Begin());
+  EXPECT_EQ(s.IDAtLine(1), s.IDAtOffset(2));
+  EXPECT_EQ(s.IDAtLine(3), s.IDAtOffset(text.size() - 3));
+  EXPECT_EQ(s.IDAtLine(4), String::End());
+}
+
+TEST(String, BulkLoadThenPaste) {
+  String s;
+  Site site;
+  String::CommandBuf buf;
+  std::string text;
+  for (int i = 0; i < 300; i++) text += i % 10 == 9 ? '\n' : 'a' + i % 26;
+  String::MakeRawInsert(&buf, &site, text, String::Begin(), String::End());
+  s = Apply(s, buf);
+  EXPECT_EQ(s.Render(), text);
+  EXPECT_EQ(s.LineOf(String::End()), 30);
+
+  std::string paste(200, 'z');
+  buf.clear();
+  ID last = s.MakeInsert(&buf, &site, paste, s.IDAtOffset(99));
+  EXPECT_EQ(buf.size(), 1);
+  s = Apply(s, buf);
+  text.insert(100, paste);
+  EXPECT_EQ(s.Render(), text);
+  EXPECT_EQ(s.OffsetOf(last), 299);
+  EXPECT_EQ(s.OrderIDs(s.IDAtOffset(5), last), -1);
+  EXPECT_EQ(s.OrderIDs(s.IDAtOffset(450), last), 1);
+  EXPECT_EQ(s.OrderIDs(last, s.IDAtOffset(298)), 1);
+  EXPECT_EQ(s.OrderIDs(String::Begin(), String::End()), -1);
+  // starts at the last visible character
+  String::Iterator it(s, String::End());
+  for (size_t i = text.size(); i > 0; i--) {
+    EXPECT_EQ(it.value(), text[i - 1]);
+    it.MovePrev();
+  }
+  EXPECT_TRUE(it.is_begin());
+}
+
+TEST(String, PurgeTombstones) {
+  String s;
+  Site site;
+  String::CommandBuf buf;
+  auto last = String::MakeRawInsert(&buf, &site, "hello world", String::Begin(),
+                                    String::End());
+  s = Apply(s, buf);
+  String::Iterator o(s, String::Begin());
+  for (int i = 0; i < 5; i++) o.MoveNext();
+  buf.clear();
+  String::Iterator space = o;
+  space.MoveNext();
+  s.MakeRemove(&buf, space.id(), String::End());
+  String removed = Apply(s, buf);
+  EXPECT_EQ(removed.Render(), "hello");
+  EXPECT_EQ(removed.Tombstones(), 6u);
+
+  // nothing is purged while a site may still work from before the remove
+  EXPECT_TRUE(removed.PurgeableRuns(s).empty());
+  auto runs = removed.PurgeableRuns(removed);
+  EXPECT_FALSE(runs.empty());
+  String purged = removed.Purge(runs);
+  EXPECT_EQ(purged.Render(), "hello");
+  EXPECT_EQ(purged.Tombstones(), 0u);
+  EXPECT_FALSE(purged.Has(last));
+  EXPECT_EQ(removed.Render(), "hello");
+
+  // editing carries on around the purged range
+  buf.clear();
+  purged.MakeInsert(&buf, &site, std::string("!"), o.id());
+  purged = Apply(purged, buf);
+  EXPECT_EQ(purged.Render(), "hello!");
+  EXPECT_EQ(purged.OffsetOf(String::End()), 6u);
+}
+
+TEST(String, PurgedTombstonesForwardInserts) {
+  String s;
+  Site site;
+  String::CommandBuf buf;
+  String::MakeRawInsert(&buf, &site, "hello world", String::Begin(),
+                        String::End());
+  s = Apply(s, buf);
+  std::vector<ID> ids;
+  for (String::Iterator it(s, String::Begin()); !it.is_end(); it.MoveNext()) {
+    if (!it.is_begin()) ids.push_back(it.id());
+  }
+  ASSERT_EQ(ids.size(), 11u);
+  buf.clear();
+  // remove " wor"
+  s.MakeRemove(&buf, ids[5], ids[9]);
+  String acked = Apply(s, buf);
+  EXPECT_EQ(acked.Render(), "hellold");
+  const auto runs = acked.PurgeableRuns(acked);
+  String purged = acked.Purge(runs);
+  EXPECT_EQ(purged.Tombstones(), 0u);
+
+  // made against acked: the insert after "o" goes before the purged " "...
+  buf.clear();
+  acked.MakeInsert(&buf, &site, '!', ids[4]);
+  EXPECT_EQ(Apply(acked, buf).Render(), "hello!ld");
+  EXPECT_EQ(Apply(purged, buf).Render(), "hello!ld");
+  // ...and this one goes after the purged "r"
+  buf.clear();
+  String::MakeRawInsert(&buf, &site, "?", ids[8], ids[9]);
+  EXPECT_EQ(Apply(acked, buf).Render(), "hello?ld");
+  EXPECT_EQ(Apply(purged, buf).Render(), "hello?ld");
+
+}
+
+TEST(String, PurgedIdsStayUsable) {
+  String s;
+  Site site;
+  String::CommandBuf buf;
+  String::MakeRawInsert(&buf, &site, "ab\ncd\nef", String::Begin(),
+                        String::End());
+  s = Apply(s, buf);
+  std::vector<ID> ids;
+  for (String::Iterator it(s, String::Begin()); !it.is_end(); it.MoveNext()) {
+    if (!it.is_begin()) ids.push_back(it.id());
+  }
+  ASSERT_EQ(ids.size(), 8u);
+  buf.clear();
+  // remove "d\ne": a cursor or fixit may still sit on any of them
+  s.MakeRemove(&buf, ids[4], ids[7]);
+  s = Apply(s, buf);
+  String purged = s.Purge(s.PurgeableRuns(s));
+  ASSERT_EQ(purged.Tombstones(), 0u);
+  EXPECT_EQ(purged.Render(), "ab\ncf");
+
+  // lookups land on the closest character still there
+  String::Iterator it(purged, ids[5]);
+  EXPECT_EQ(it.value(), 'c');
+  EXPECT_EQ(it.Prev().value(), '\n');
+  EXPECT_EQ(purged.OffsetOf(ids[5]), purged.OffsetOf(ids[7]));
+  EXPECT_EQ(purged.LineOf(ids[5]), 1);
+  EXPECT_LT(purged.OrderIDs(ids[3], ids[5]), 0);
+  EXPECT_LT(purged.OrderIDs(ids[5], ids[7]), 0);
+  EXPECT_GT(purged.OrderIDs(ids[7], ids[4]), 0);
+  EXPECT_EQ(purged.Render(ids[0], ids[5]), "ab\nc");
+  buf.clear();
+  purged.MakeRemove(&buf, ids[3], ids[5]);
+  EXPECT_EQ(Apply(purged, buf).Render(), "ab\nf");
+  buf.clear();
+  purged.MakeInsert(&buf, &site, '!', ids[5]);
+  EXPECT_EQ(Apply(purged, buf).Render(), "ab\nc!f");
+}
+
+TEST(String, HashFollowsText) {
+  String typed;
+  String pasted;
+  Site site;
+  String::CommandBuf buf;
+  ID after = String::Begin();
+  for (char c : std::string("hello world")) {
+    after = typed.MakeInsert(&buf, &site, c, after);
+    typed = Apply(typed, buf);
+    buf.clear();
+  }
+  String::MakeRawInsert(&buf, &site, "hello world", String::Begin(),
+                        String::End());
+  pasted = Apply(pasted, buf);
+  EXPECT_FALSE(typed.SameIdentity(pasted));
+  EXPECT_TRUE(typed.Hash() == pasted.Hash());
+  EXPECT_FALSE(typed.Hash() == String().Hash());
+
+  // removing and retyping a character restores the hash
+  buf.clear();
+  typed.MakeRemove(&buf, after);
+  String removed = Apply(typed, buf);
+  EXPECT_FALSE(removed.Hash() == typed.Hash());
+  buf.clear();
+  String::Iterator last(removed, String::End());
+  removed.MakeInsert(&buf, &site, 'd', last.id());
+  EXPECT_TRUE(Apply(removed, buf).Hash() == typed.Hash());
+}
+
+TEST(String, Diff) {
+  String s;
+  Site site;
+  String::CommandBuf buf;
+  std::string text;
+  for (int i = 0; i < 1000; i++) text += "line\n";
+  String::MakeRawInsert(&buf, &site, text, String::Begin(), String::End());
+  s = Apply(s, buf);
+  EXPECT_TRUE(s.Diff(s).empty());
+
+  String::Iterator it(s, String::Begin());
+  for (int i = 0; i < 2500; i++) it.MoveNext();
+  buf.clear();
+  const ID x = s.MakeInsert(&buf, &site, 'x', it.id());
+  String::Iterator gone = it;
+  gone.MoveNext();
+  gone.MoveNext();
+  s.MakeRemove(&buf, gone.id());
+  String edited = Apply(s, buf);
+
+  auto changes = edited.Diff(s);
+  ASSERT_EQ(changes.size(), 2u);
+  for (const auto& c : changes) {
+    EXPECT_EQ(c.length, 1u);
+    EXPECT_EQ(c.first, c.inserted ? x : gone.id());
+  }
+  changes = s.Diff(edited);
+  ASSERT_EQ(changes.size(), 2u);
+  for (const auto& c : changes) {
+    EXPECT_EQ(c.first, c.inserted ? gone.id() : x);
+  }
+}
+
+TEST(String, ForEachSpan) {
+  String s;
+  Site site;
+  String::CommandBuf buf;
+  String::MakeRawInsert(&buf, &site, "hello world", String::Begin(),
+                        String::End());
+  s = Apply(s, buf);
+  buf.clear();
+  s.MakeRemove(&buf, s.IDAtOffset(4), s.IDAtOffset(7));
+  s = Apply(s, buf);
+  ASSERT_EQ(s.Render(), "hellorld");
+
+  std::string visible;
+  std::string all;
+  int spans = 0;
+  auto collect = [&](ID first, const char* chars, size_t n, bool vis) {
+    spans++;
+    all.append(chars, n);
+    if (vis) visible.append(chars, n);
+  };
+  const ID h = s.IDAtOffset(0);
+  s.ForEachSpan(h, String::End(), collect);
+  EXPECT_EQ(visible, "hellorld");
+  EXPECT_EQ(all, "hello world");
+  EXPECT_EQ(spans, 3);
+
+  // cut at both ends, inside runs
+  visible.clear();
+  all.clear();
+  spans = 0;
+  s.ForEachSpan(h.Offset(2), h.Offset(9), collect);
+  EXPECT_EQ(visible, "llor");
+  EXPECT_EQ(all, "llo wor");
+  EXPECT_EQ(spans, 3);
+
+  // an empty range
+  spans = 0;
+  s.ForEachSpan(h.Offset(5), h.Offset(5), collect);
+  EXPECT_EQ(spans, 0);
 }